@@ -1,26 +1,48 @@
 #include "Sim.hpp"
 
 #include <elfio.hpp>
-#include <set>
+#include "decoder.hpp"
+#include "elf.hpp"
+#include "fusion.hpp"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <random>
+#include <type_traits>
 
 //#define ELF_FILE_INFO_DUMP
 
 #define USE_CACHE
 
-Sim::Sim(const std::string& elf_filename) :
-    registers(std::vector<uint32_t>(REG_NUM)) 
-{   
-    // problem - no space on my pc
-    memspace = std::vector<uint8_t>(static_cast<size_t>(std::numeric_limits<uint32_t>::max()) + 2);
+// common pairs of instructions in cached blocks are executed as one superinstruction
+#define USE_FUSION
 
+// computed goto is a GNU extension, other compilers and SIM_SWITCH_ENGINE builds use the switch engine
+#if defined(__GNUC__) && !defined(SIM_SWITCH_ENGINE)
+#define USE_THREADED_CODE
+#endif
 
-    ELFIO::elfio reader;
-    if (!reader.load(elf_filename)) {
-        throw std::invalid_argument("Can't open " + elf_filename);
+// hot blocks are translated to native code, works on top of the threaded engine
+#if defined(HAS_JIT) && defined(USE_THREADED_CODE)
+#define USE_JIT
+#endif
+
+Sim::Sim(const std::string& elf_filename, const SimOptions& options) :
+    registers(std::vector<uint32_t>(REG_NUM + 1)),
+    memory(std::make_shared<GuestMemory>()),
+    syscalls(std::make_shared<Syscalls>(options.console_buffering, options.console_sink)),
+    decoded_text(options.decoded_text),
+#ifdef HAS_JIT
+    jit(options.jit_code_size),
+#endif
+    jit_threshold(options.jit_threshold)
+{   
+    if (options.memory_backend == MemoryBackend::Reserved) {
+        memory->emplace<ReservedMemory>();
     }
 
-    assert(reader.get_class() == ELFIO::ELFCLASS32);
-    assert(reader.get_encoding() == ELFIO::ELFDATA2LSB);
+    ELFIO::elfio reader;
+    load_guest_elf(reader, elf_filename);
 
 #ifdef ELF_FILE_INFO_DUMP
     std::cout << "ELF file class : ";
@@ -68,8 +90,19 @@ Sim::Sim(const std::string& elf_filename) :
 #endif
 
     pc = static_cast<uint32_t>(reader.get_entry());
+    text_hash = aot_text_hash(reader);
+
+    std::visit([&](auto& mem) {
+        mem.on_code_write([this](uint32_t addr, uint32_t size) { code_written(addr, size); });
+    }, *memory);
+
+    bool predecode = options.predecode && !decoded_text;
+    if (!decoded_text) {
+        decoded_text = std::make_shared<DecodedText>();
+    }
 
     auto segments_num = reader.segments.size();
+    uint64_t heap_start = 0;
 
     for (int i = 0; i < segments_num; ++i) {
 
@@ -81,724 +114,769 @@ Sim::Sim(const std::string& elf_filename) :
         const uint8_t* segment_data = reinterpret_cast<const uint8_t*>(segment->get_data());
         assert(segment_data);
 
-        std::memcpy(memspace.data() + static_cast<uint32_t>(segment->get_virtual_address()), 
-                    reinterpret_cast<const char *>(segment_data),
-                    static_cast<size_t>(segment->get_file_size()) * sizeof(uint8_t));
+        heap_start = std::max<uint64_t>(heap_start, segment->get_virtual_address() + segment->get_memory_size());
+
+        if ((segment->get_flags() & ELFIO::PF_X) && segment->get_memory_size()) {
+            uint64_t first = segment->get_virtual_address();
+            uint64_t last = first + segment->get_memory_size() - 1;
+            text_pages.emplace_back(static_cast<uint32_t>(first >> PageFlags::PAGE_BITS),
+                                    static_cast<uint32_t>(last >> PageFlags::PAGE_BITS));
+        }
+
+        std::visit([&](auto& mem) {
+            mem.write(static_cast<uint32_t>(segment->get_virtual_address()), 
+                      segment_data,
+                      static_cast<size_t>(segment->get_file_size()) * sizeof(uint8_t));
+        }, *memory);
+
+        if (predecode && (segment->get_flags() & ELFIO::PF_X)) {
+            decoded_text->add_segment(static_cast<uint32_t>(segment->get_virtual_address()),
+                                     segment_data,
+                                     static_cast<size_t>(segment->get_file_size()),
+                                     options.predecode_threads);
+        }
     }
 
+    syscalls->start_heap(static_cast<uint32_t>((heap_start + PagedMemory::PAGE_MASK) & ~uint64_t(PagedMemory::PAGE_MASK)));
+
+    std::visit([&](auto& mem) { setup_stack(mem, reader, elf_filename, options); }, *memory);
+
+    flag_text_pages();
 }
 
-// static Instruction decode(uint32_t word) {
-
-//     Instruction instr{};
-
-//     uint32_t opcode = (word >> OPCODE_SHIFT) & OPCODE_MASK;
-
-//     switch (opcode) {
-//         case LOAD_MASK : {
-//             uint32_t width = (word >> FUNCT3_SHIFT) & FUNCT3_MASK;
-
-//             switch (width) {
-//                 case 0b0:
-//                 {
-                    
-//                 }
-//                 case 0b1:
-//                 {
-                    
-//                 }
-//                 case 0b10:
-//                 {
-                    
-//                 }
-//                 case 0b100:
-//                 {
-                    
-//                 }
-//                 case 0b101:
-//                 {
-                    
-//                 }
-//             } 
-//         }
-//     }
-
-
-// }
-
-static Instruction decode(uint32_t word) {
-    Instruction instr{};
-    switch ((word >> 0) & 0b1111111) {
-        case 0b11: {
-            switch ((word >> 12) & 0b111) {
-                case 0b0: {
-                    //! LB
-                    //! xxxxxxxxxxxxxxxxx000xxxxx0000011
-                    instr.id = Opcode::LB;
-                    instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                    instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-                    instr.imm |= static_cast<int32_t>(slice<30, 20>(word) << 0) >> 0;
-                    return instr;
-                }
-                case 0b1: {
-                    //! LH
-                    //! xxxxxxxxxxxxxxxxx001xxxxx0000011
-                    instr.id = Opcode::LH;
-                    instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                    instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-                    instr.imm |= static_cast<int32_t>(slice<30, 20>(word) << 0) >> 0;
-                    return instr;
-                }
-                case 0b10: {
-                    //! LW
-                    //! xxxxxxxxxxxxxxxxx010xxxxx0000011
-                    instr.id = Opcode::LW;
-                    instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                    instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-                    instr.imm |= static_cast<int32_t>(slice<30, 20>(word) << 0) >> 0;
-                    return instr;
-                }
-                case 0b100: {
-                    //! LBU
-                    //! xxxxxxxxxxxxxxxxx100xxxxx0000011
-                    instr.id = Opcode::LBU;
-                    instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                    instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-                    instr.imm |= static_cast<int32_t>(slice<30, 20>(word) << 0) >> 0;
-                    return instr;
-                }
-                case 0b101: {
-                    //! LHU
-                    //! xxxxxxxxxxxxxxxxx101xxxxx0000011
-                    instr.id = Opcode::LHU;
-                    instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                    instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-                    instr.imm |= static_cast<int32_t>(slice<30, 20>(word) << 0) >> 0;
-                    return instr;
-                }
-            }
-        }
-        case 0b1111: {
-            switch ((word >> 12) & 0b111) {
-                case 0b0: {
-                    //! FENCE
-                    //! xxxxxxxxxxxxxxxxx000xxxxx0001111
-                    instr.id = Opcode::FENCE;
-                    instr.imm |= static_cast<int32_t>(slice<31, 28>(word) << 0) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<27, 24>(word) << 0) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<23, 20>(word) << 0) >> 0;
-                    instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                    instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                    return instr;
-                }
-            }
-        }
-        case 0b10011: {
-            switch ((word >> 12) & 0b111) {
-                case 0b0: {
-                    //! ADDI
-                    //! xxxxxxxxxxxxxxxxx000xxxxx0010011
-                    instr.id = Opcode::ADDI;
-                    instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                    instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-                    instr.imm |= static_cast<int32_t>(slice<30, 20>(word) << 0) >> 0;
-                    return instr;
-                }
-                case 0b10: {
-                    //! SLTI
-                    //! xxxxxxxxxxxxxxxxx010xxxxx0010011
-                    instr.id = Opcode::SLTI;
-                    instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                    instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-                    instr.imm |= static_cast<int32_t>(slice<30, 20>(word) << 0) >> 0;
-                    return instr;
-                }
-                case 0b11: {
-                    //! SLTIU
-                    //! xxxxxxxxxxxxxxxxx011xxxxx0010011
-                    instr.id = Opcode::SLTIU;
-                    instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                    instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-                    instr.imm |= static_cast<int32_t>(slice<30, 20>(word) << 0) >> 0;
-                    return instr;
-                }
-                case 0b100: {
-                    //! XORI
-                    //! xxxxxxxxxxxxxxxxx100xxxxx0010011
-                    instr.id = Opcode::XORI;
-                    instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                    instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-                    instr.imm |= static_cast<int32_t>(slice<30, 20>(word) << 0) >> 0;
-                    return instr;
-                }
-                case 0b110: {
-                    //! ORI
-                    //! xxxxxxxxxxxxxxxxx110xxxxx0010011
-                    instr.id = Opcode::ORI;
-                    instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                    instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-                    instr.imm |= static_cast<int32_t>(slice<30, 20>(word) << 0) >> 0;
-                    return instr;
-                }
-                case 0b111: {
-                    //! ANDI
-                    //! xxxxxxxxxxxxxxxxx111xxxxx0010011
-                    instr.id = Opcode::ANDI;
-                    instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                    instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-                    instr.imm |= static_cast<int32_t>(slice<30, 20>(word) << 0) >> 0;
-                    return instr;
-                }
-            }
-        }
-        case 0b10111: {
-            //! AUIPC
-            //! xxxxxxxxxxxxxxxxxxxxxxxxx0010111
-            instr.id = Opcode::AUIPC;
-            instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-            instr.imm |= static_cast<int32_t>(slice<31, 12>(word) << 12) >> 0;
-            return instr;
-        }
-        case 0b100011: {
-            switch ((word >> 12) & 0b111) {
-                case 0b0: {
-                    //! SB
-                    //! xxxxxxxxxxxxxxxxx000xxxxx0100011
-                    instr.id = Opcode::SB;
-                    instr.imm |= static_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-                    instr.imm |= static_cast<int32_t>(slice<30, 25>(word) << 5) >> 0;
-                    instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                    instr.rs2 = static_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                    return instr;
-                }
-                case 0b1: {
-                    //! SH
-                    //! xxxxxxxxxxxxxxxxx001xxxxx0100011
-                    instr.id = Opcode::SH;
-                    instr.imm |= static_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-                    instr.imm |= static_cast<int32_t>(slice<30, 25>(word) << 5) >> 0;
-                    instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                    instr.rs2 = static_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                    return instr;
-                }
-                case 0b10: {
-                    //! SW
-                    //! xxxxxxxxxxxxxxxxx010xxxxx0100011
-                    instr.id = Opcode::SW;
-                    instr.imm |= static_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-                    instr.imm |= static_cast<int32_t>(slice<30, 25>(word) << 5) >> 0;
-                    instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                    instr.rs2 = static_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                    return instr;
-                }
-            }
-        }
-        case 0b110011: {
-            switch ((word >> 25) & 0b1111111) {
-                case 0b0: {
-                    switch ((word >> 12) & 0b111) {
-                        case 0b0: {
-                            //! ADD
-                            //! 0000000xxxxxxxxxx000xxxxx0110011
-                            instr.id = Opcode::ADD;
-                            instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                            instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                            instr.rs2 = static_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-                            return instr;
-                        }
-                        case 0b1: {
-                            //! SLL
-                            //! 0000000xxxxxxxxxx001xxxxx0110011
-                            instr.id = Opcode::SLL;
-                            instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                            instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                            instr.rs2 = static_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-                            return instr;
-                        }
-                        case 0b10: {
-                            //! SLT
-                            //! 0000000xxxxxxxxxx010xxxxx0110011
-                            instr.id = Opcode::SLT;
-                            instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                            instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                            instr.rs2 = static_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-                            return instr;
-                        }
-                        case 0b11: {
-                            //! SLTU
-                            //! 0000000xxxxxxxxxx011xxxxx0110011
-                            instr.id = Opcode::SLTU;
-                            instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                            instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                            instr.rs2 = static_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-                            return instr;
-                        }
-                        case 0b100: {
-                            //! XOR
-                            //! 0000000xxxxxxxxxx100xxxxx0110011
-                            instr.id = Opcode::XOR;
-                            instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                            instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                            instr.rs2 = static_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-                            return instr;
-                        }
-                        case 0b101: {
-                            //! SRL
-                            //! 0000000xxxxxxxxxx101xxxxx0110011
-                            instr.id = Opcode::SRL;
-                            instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                            instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                            instr.rs2 = static_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-                            return instr;
-                        }
-                        case 0b110: {
-                            //! OR
-                            //! 0000000xxxxxxxxxx110xxxxx0110011
-                            instr.id = Opcode::OR;
-                            instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                            instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                            instr.rs2 = static_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-                            return instr;
-                        }
-                        case 0b111: {
-                            //! AND
-                            //! 0000000xxxxxxxxxx111xxxxx0110011
-                            instr.id = Opcode::AND;
-                            instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                            instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                            instr.rs2 = static_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-                            return instr;
-                        }
-                    }
-                }
-                case 0b100000: {
-                    switch ((word >> 12) & 0b111) {
-                        case 0b0: {
-                            //! SUB
-                            //! 0100000xxxxxxxxxx000xxxxx0110011
-                            instr.id = Opcode::SUB;
-                            instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                            instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                            instr.rs2 = static_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-                            return instr;
-                        }
-                        case 0b101: {
-                            //! SRA
-                            //! 0100000xxxxxxxxxx101xxxxx0110011
-                            instr.id = Opcode::SRA;
-                            instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-                            instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                            instr.rs2 = static_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-                            return instr;
-                        }
-                    }
-                }
-            }
-        }
-        case 0b110111: {
-            //! LUI
-            //! xxxxxxxxxxxxxxxxxxxxxxxxx0110111
-            instr.id = Opcode::LUI;
-            instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-            instr.imm |= static_cast<int32_t>(slice<31, 12>(word) << 12) >> 0;
-            return instr;
+// Auxiliary vector entries of the Linux ABI
+static constexpr uint32_t AT_NULL = 0;
+static constexpr uint32_t AT_PHDR = 3;
+static constexpr uint32_t AT_PHENT = 4;
+static constexpr uint32_t AT_PHNUM = 5;
+static constexpr uint32_t AT_PAGESZ = 6;
+static constexpr uint32_t AT_ENTRY = 9;
+static constexpr uint32_t AT_RANDOM = 25;
+
+// The layout of the Linux ELF loader: strings and the AT_RANDOM bytes at the top, below them
+// argc, the argv and envp pointers, each list ended by a null one, and the auxiliary vector.
+// Only sp is set, crt0 takes the rest from the stack; a0 stays 0, the C libraries read it as
+// the exit hook of a dynamic loader. The AT_RANDOM bytes are fixed, so runs of a program repeat.
+template <typename Memory>
+void Sim::setup_stack(Memory& mem, const ELFIO::elfio& reader, const std::string& elf_filename, const SimOptions& options) {
+
+    if (options.stack_top > (uint64_t(1) << 32) || (options.stack_top & 15))
+        throw std::invalid_argument("Stack top must be 16-byte aligned and within the guest space");
+
+    uint64_t top = options.stack_top;
+    auto push = [&](const void* data, size_t size) {
+        if (top < size + PagedMemory::PAGE_SIZE)
+            throw std::invalid_argument("Process arguments don't fit below the stack top");
+        top -= size;
+        mem.write(static_cast<uint32_t>(top), data, size);
+        return static_cast<uint32_t>(top);
+    };
+
+    std::vector<uint32_t> env_ptrs;
+    for (const auto& var : options.env)
+        env_ptrs.push_back(push(var.c_str(), var.size() + 1));
+
+    std::vector<uint32_t> arg_ptrs;
+    for (auto arg = options.args.rbegin(); arg != options.args.rend(); ++arg)
+        arg_ptrs.push_back(push(arg->c_str(), arg->size() + 1));
+    arg_ptrs.push_back(push(elf_filename.c_str(), elf_filename.size() + 1));
+    std::reverse(arg_ptrs.begin(), arg_ptrs.end());
+
+    std::mt19937 random_bytes(0);
+    uint32_t random[4];
+    for (auto& word : random)
+        word = static_cast<uint32_t>(random_bytes());
+    uint32_t random_ptr = push(random, sizeof(random));
+
+    // the program headers as loaded, by the segment whose file range holds them
+    uint64_t offset = reader.get_segments_offset();
+    uint32_t phdr = 0;
+    for (const auto& segment : reader.segments) {
+        if (segment->get_type() == ELFIO::PT_PHDR) {
+            phdr = static_cast<uint32_t>(segment->get_virtual_address());
+            break;
         }
-        case 0b1100011: {
-            switch ((word >> 12) & 0b111) {
-                case 0b0: {
-                    //! BEQ
-                    //! xxxxxxxxxxxxxxxxx000xxxxx1100011
-                    instr.id = Opcode::BEQ;
-                    instr.imm |= static_cast<int32_t>(slice<31, 31>(word) << 31) >> 19;
-                    instr.imm |= static_cast<int32_t>(slice<30, 25>(word) << 5) >> 0;
-                    instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                    instr.rs2 = static_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<11, 8>(word) << 1) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<7, 7>(word) << 11) >> 0;
-                    return instr;
-                }
-                case 0b1: {
-                    //! BNE
-                    //! xxxxxxxxxxxxxxxxx001xxxxx1100011
-                    instr.id = Opcode::BNE;
-                    instr.imm |= static_cast<int32_t>(slice<31, 31>(word) << 31) >> 19;
-                    instr.imm |= static_cast<int32_t>(slice<30, 25>(word) << 5) >> 0;
-                    instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                    instr.rs2 = static_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<11, 8>(word) << 1) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<7, 7>(word) << 11) >> 0;
-                    return instr;
-                }
-                case 0b100: {
-                    //! BLT
-                    //! xxxxxxxxxxxxxxxxx100xxxxx1100011
-                    instr.id = Opcode::BLT;
-                    instr.imm |= static_cast<int32_t>(slice<31, 31>(word) << 31) >> 19;
-                    instr.imm |= static_cast<int32_t>(slice<30, 25>(word) << 5) >> 0;
-                    instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                    instr.rs2 = static_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<11, 8>(word) << 1) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<7, 7>(word) << 11) >> 0;
-                    return instr;
-                }
-                case 0b101: {
-                    //! BGE
-                    //! xxxxxxxxxxxxxxxxx101xxxxx1100011
-                    instr.id = Opcode::BGE;
-                    instr.imm |= static_cast<int32_t>(slice<31, 31>(word) << 31) >> 19;
-                    instr.imm |= static_cast<int32_t>(slice<30, 25>(word) << 5) >> 0;
-                    instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                    instr.rs2 = static_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<11, 8>(word) << 1) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<7, 7>(word) << 11) >> 0;
-                    return instr;
-                }
-                case 0b110: {
-                    //! BLTU
-                    //! xxxxxxxxxxxxxxxxx110xxxxx1100011
-                    instr.id = Opcode::BLTU;
-                    instr.imm |= static_cast<int32_t>(slice<31, 31>(word) << 31) >> 19;
-                    instr.imm |= static_cast<int32_t>(slice<30, 25>(word) << 5) >> 0;
-                    instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                    instr.rs2 = static_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<11, 8>(word) << 1) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<7, 7>(word) << 11) >> 0;
-                    return instr;
-                }
-                case 0b111: {
-                    //! BGEU
-                    //! xxxxxxxxxxxxxxxxx111xxxxx1100011
-                    instr.id = Opcode::BGEU;
-                    instr.imm |= static_cast<int32_t>(slice<31, 31>(word) << 31) >> 19;
-                    instr.imm |= static_cast<int32_t>(slice<30, 25>(word) << 5) >> 0;
-                    instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-                    instr.rs2 = static_cast<int32_t>(slice<24, 20>(word) << 0) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<11, 8>(word) << 1) >> 0;
-                    instr.imm |= static_cast<int32_t>(slice<7, 7>(word) << 11) >> 0;
-                    return instr;
-                }
-            }
+        if (segment->get_type() == ELFIO::PT_LOAD && offset >= segment->get_offset() &&
+            offset < segment->get_offset() + segment->get_file_size())
+            phdr = static_cast<uint32_t>(segment->get_virtual_address() + offset - segment->get_offset());
+    }
+
+    std::vector<uint32_t> words;
+    words.push_back(static_cast<uint32_t>(arg_ptrs.size()));
+    words.insert(words.end(), arg_ptrs.begin(), arg_ptrs.end());
+    words.push_back(0);
+    words.insert(words.end(), env_ptrs.begin(), env_ptrs.end());
+    words.push_back(0);
+    if (phdr) {
+        words.insert(words.end(), { AT_PHDR, phdr,
+                                    AT_PHENT, static_cast<uint32_t>(reader.get_segment_entry_size()),
+                                    AT_PHNUM, static_cast<uint32_t>(reader.segments.size()) });
+    }
+    words.insert(words.end(), { AT_PAGESZ, PagedMemory::PAGE_SIZE,
+                                AT_ENTRY, static_cast<uint32_t>(reader.get_entry()),
+                                AT_RANDOM, random_ptr,
+                                AT_NULL, 0 });
+
+    // sp is 16-byte aligned as the psABI wants
+    size_t frame = words.size() * sizeof(uint32_t);
+    top = ((top - frame) & ~uint64_t(15)) + frame;
+    uint32_t sp = push(words.data(), frame);
+
+    registers[2] = sp;
+}
+
+Sim::Sim(Sim& boot, uint32_t hart_id, const SimOptions& options) :
+    registers(std::vector<uint32_t>(REG_NUM + 1)),
+    memory(boot.memory),
+    syscalls(boot.syscalls),
+    pc(boot.pc),
+    hart_id(hart_id),
+    decoded_text(boot.decoded_text),
+#ifdef HAS_JIT
+    jit(options.jit_code_size),
+#endif
+    jit_threshold(options.jit_threshold),
+    text_hash(boot.text_hash),
+    text_pages(boot.text_pages)
+{
+    if ((options.hart_stack_size & 15) || boot.registers[2] <= options.stack_top - options.hart_stack_size)
+        throw std::invalid_argument("Hart stack size must be 16-byte aligned and hold the process arguments");
+    uint64_t stack_size = uint64_t(options.hart_stack_size) * hart_id;
+    if (stack_size + PagedMemory::PAGE_SIZE > options.stack_top)
+        throw std::invalid_argument("Hart stacks don't fit below the stack top");
+
+    registers[2] = static_cast<uint32_t>(options.stack_top - stack_size);
+    registers[10] = hart_id;
+    shared_memory = boot.shared_memory = true;
+}
+
+// LR, SC and AMOs raise an address-misaligned exception on an unaligned word
+static uint32_t atomic_address(uint32_t addr) {
+    if (addr & 3)
+        throw std::invalid_argument("Misaligned atomic access: " + std::to_string(addr));
+    return addr;
+}
+
+// memory hook of the instrumentation, passes the address on to the access
+template <typename Instrumentation>
+static uint32_t accessed(Instrumentation& instrumentation, uint32_t addr, uint32_t size, bool store) {
+    instrumentation.memory(addr, size, store);
+    return addr;
+}
+
+// Engine glue for semantics.inc, the definitions are common for both engines,
+// only OP, NEXT and END_BLOCK are engine specific. The memory and branch hooks of the
+// instrumentation policy are called from here, the block hook by the engines.
+#define X(field)    x[in->field]
+#define F(field)    fpu.registers[in->field]
+#define IMM         in->imm
+#define IMM2        in->imm2
+#define LENGTH      in->length
+#define LOAD(T, addr)           mem.template load<T>(accessed(instrumentation, addr, sizeof(T), false))
+#define STORE(T, addr, value)   mem.template store<T>(accessed(instrumentation, addr, sizeof(T), true), value)
+#define ATOMIC(addr, ...)       mem.atomic(accessed(instrumentation, addr, 4, true), __VA_ARGS__)
+#define MEM         mem
+#define INSTRUMENTATION instrumentation
+// the branch of a fused pair is its second instruction
+#define BRANCH(taken, target)   { bool branch_taken = (taken); \
+                                  instrumentation.branch(PC + in->first_length, target, branch_taken); \
+                                  END_BLOCK(branch_taken ? (target) : PC + LENGTH); }
+#define JUMP(target)            { instrumentation.branch(PC + in->first_length, target, true); END_BLOCK(target); }
+
+void Sim::execute(Instruction instr) {
+    NoInstrumentation instrumentation;
+    std::visit([&](auto& mem) { execute(instr, mem, instrumentation); }, *memory);
+}
+
+template <typename Memory, typename Instrumentation>
+void Sim::execute(Instruction instr, Memory& mem, Instrumentation& instrumentation) {
+
+    const Instruction* in = &instr;
+    uint32_t* x = registers.data();
+
+#define OP(name)    case Opcode::name:
+#define PC          pc
+#define NEXT        { pc += in->length; goto done; }
+#define END_BLOCK(next_pc)  { pc = (next_pc); goto done; }
+
+    switch (instr.id) {
+#include "semantics.inc"
+    }
+
+#undef OP
+#undef PC
+#undef NEXT
+#undef END_BLOCK
+
+done:
+    registers[0] = 0;
+}
+
+size_t Sim::run(size_t limit) {
+    NoInstrumentation instrumentation;
+    return run(instrumentation, limit);
+}
+
+template <InstrumentationPolicy Instrumentation>
+size_t Sim::run(Instrumentation& instrumentation, size_t limit) {
+    marker_reached = false;
+
+    // another hart ended the process
+    if (syscalls->group_exited()) {
+        program_halted = true;
+        return 0;
+    }
+
+    Fpu::HostScope fpu_scope(fpu);
+    size_t instr_count = 0;
+    try {
+        instr_count = std::visit([&](auto& mem) {
+#ifdef USE_THREADED_CODE
+            return run_threaded(mem, instrumentation, limit);
+#else
+            return run_switch(mem, instrumentation, limit);
+#endif
+        }, *memory);
+    }
+    catch (...) {
+        syscalls->flush_console();
+        throw;
+    }
+
+    // the host reports a halted hart right away, its output comes first
+    if (program_halted && !marker_reached)
+        syscalls->flush_console();
+
+    // the ECALL marker leaves the engine as a halt does, the hart goes on after it
+    if (marker_reached)
+        program_halted = false;
+    return instr_count;
+}
+
+template size_t Sim::run(NoInstrumentation& instrumentation, size_t limit);
+template size_t Sim::run(CountingInstrumentation& instrumentation, size_t limit);
+template size_t Sim::run(TracingInstrumentation& instrumentation, size_t limit);
+template size_t Sim::run(CallbackInstrumentation& instrumentation, size_t limit);
+
+RunResult Sim::run(const RunLimits& limits) {
+
+    auto status = [&] {
+        if (program_halted)
+            return RunStatus::Halted;
+        return marker_reached ? RunStatus::Marker : RunStatus::BudgetExhausted;
+    };
+
+    bool polled = shared_memory || limits.stop || limits.deadline != std::chrono::steady_clock::time_point::max();
+    if (!polled) {
+        size_t instr_count = run(limits.budget);
+        return {status(), instr_count};
+    }
+
+    size_t instr_count = 0;
+    while (instr_count < limits.budget) {
+        if (limits.stop && limits.stop->load(std::memory_order_relaxed))
+            return {RunStatus::Stopped, instr_count};
+        if (std::chrono::steady_clock::now() >= limits.deadline)
+            return {RunStatus::DeadlineExpired, instr_count};
+
+        instr_count += run(std::min(limits.budget - instr_count, RUN_SLICE));
+        if (program_halted || marker_reached)
+            break;
+
+        // the next slice would start at the marker and execute it
+        if (pc == marker_pc) {
+            marker_reached = true;
+            break;
         }
-        case 0b1100111: {
-            //! JALR
-            //! xxxxxxxxxxxxxxxxx000xxxxx1100111
-            instr.id = Opcode::JALR;
-            instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-            instr.rs1 = static_cast<int32_t>(slice<19, 15>(word) << 0) >> 0;
-            instr.imm |= static_cast<int32_t>(slice<31, 31>(word) << 31) >> 20;
-            instr.imm |= static_cast<int32_t>(slice<30, 20>(word) << 0) >> 0;
-            return instr;
+    }
+
+    return {status(), instr_count};
+}
+
+void Sim::load_aot(const std::string& path) {
+    if (!std::holds_alternative<ReservedMemory>(*memory)) {
+        throw std::invalid_argument("Translated blocks need the reserved memory backend");
+    }
+
+    aot.open(path, text_hash);
+    block_cache.flush();
+    flag_text_pages();
+}
+
+bool Sim::ahead_of_time_code(uint32_t page) const {
+    if (!decoded_text->size() && !aot.size())
+        return false;
+    return std::any_of(text_pages.begin(), text_pages.end(),
+                       [&](const auto& range) { return page >= range.first && page <= range.second; });
+}
+
+void Sim::flag_text_pages() {
+    if (!decoded_text->size() && !aot.size())
+        return;
+    std::visit([&](auto& mem) {
+        for (auto [first, last] : text_pages) {
+            for (uint32_t page = first; page <= last; ++page)
+                mem.set_code(page, true);
         }
-        case 0b1101111: {
-            //! JAL
-            //! xxxxxxxxxxxxxxxxxxxxxxxxx1101111
-            instr.id = Opcode::JAL;
-            instr.rd = static_cast<int32_t>(slice<11, 7>(word) << 0) >> 0;
-            instr.imm |= static_cast<int32_t>(slice<31, 31>(word) << 31) >> 11;
-            instr.imm |= static_cast<int32_t>(slice<30, 21>(word) << 1) >> 0;
-            instr.imm |= static_cast<int32_t>(slice<20, 20>(word) << 11) >> 0;
-            instr.imm |= static_cast<int32_t>(slice<19, 12>(word) << 12) >> 0;
-            return instr;
+    }, *memory);
+}
+
+void Sim::set_marker(uint32_t new_marker_pc) {
+    // blocks at the old and the new marker and those running over them are decoded again
+    if (marker_pc != NO_MARKER)
+        drop_blocks(marker_pc, 2);
+    marker_pc = new_marker_pc;
+    if (marker_pc != NO_MARKER)
+        drop_blocks(marker_pc, 2);
+}
+
+void Sim::set_ecall_marker(uint32_t number) {
+    marker_ecall = number;
+}
+
+void Sim::clear_markers() {
+    set_marker(NO_MARKER);
+    marker_ecall = -1;
+}
+
+void Sim::snapshot() {
+    if (shared_memory) {
+        throw std::invalid_argument("Harts sharing memory can't be snapshot");
+    }
+
+    saved = std::make_unique<Snapshot>();
+    saved->registers = registers;
+    saved->pc = pc;
+    saved->halted = program_halted;
+    saved->program_break = syscalls->program_break();
+    saved->fpu = fpu;
+    saved->vpu = vpu;
+
+    std::visit([&](auto& mem) {
+        mem.on_first_write([this](uint32_t page) { page_written(page); });
+        mem.watch_all();
+    }, *memory);
+}
+
+void Sim::page_written(uint32_t page) {
+    auto& content = saved->pages[page];
+    if (!content) {
+        content = std::make_unique<uint8_t[]>(PagedMemory::PAGE_SIZE);
+        read_memory(page << PageFlags::PAGE_BITS, content.get(), PagedMemory::PAGE_SIZE);
+    }
+    saved->dirty.push_back(page);
+}
+
+void Sim::restore() {
+    if (!saved) {
+        throw std::invalid_argument("No snapshot to restore");
+    }
+
+    // written back like any store, so blocks decoded from the pages are dropped,
+    // but without the hook, the pages are watched again right away
+    std::visit([&](auto& mem) {
+        mem.on_first_write(nullptr);
+        for (uint32_t page : saved->dirty) {
+            mem.write(page << PageFlags::PAGE_BITS, saved->pages[page].get(), PagedMemory::PAGE_SIZE);
+            mem.set_watched(page, true);
         }
-        case 0b1110011: {
-            switch ((word >> 7) & 0b1111111111111111111111111) {
-                case 0b0: {
-                    //! ECALL
-                    //! 00000000000000000000000001110011
-                    instr.id = Opcode::ECALL;
-                    return instr;
-                }
-                case 0b10000000000000: {
-                    //! EBREAK
-                    //! 00000000000100000000000001110011
-                    instr.id = Opcode::EBREAK;
-                    return instr;
-                }
-            }
+        mem.on_first_write([this](uint32_t page) { page_written(page); });
+    }, *memory);
+    saved->dirty.clear();
+
+    registers = saved->registers;
+    pc = saved->pc;
+    program_halted = saved->halted;
+    syscalls->set_program_break(saved->program_break);
+    fpu = saved->fpu;
+    vpu = saved->vpu;
+    reserved_addr = NO_RESERVATION;
+    marker_reached = false;
+}
+
+void Sim::read_memory(uint32_t addr, void* dst, size_t size) {
+    std::visit([&](auto& mem) { mem.read(addr, dst, size); }, *memory);
+}
+
+void Sim::write_memory(uint32_t addr, const void* src, size_t size) {
+    std::visit([&](auto& mem) { mem.write(addr, src, size); }, *memory);
+}
+
+uint32_t Sim::read_register(uint32_t index) const {
+    if (index >= REG_NUM) {
+        throw std::invalid_argument("Invalid register: " + std::to_string(index));
+    }
+    return registers[index];
+}
+
+void Sim::write_register(uint32_t index, uint32_t value) {
+    if (index >= REG_NUM) {
+        throw std::invalid_argument("Invalid register: " + std::to_string(index));
+    }
+    if (index)
+        registers[index] = value;
+}
+
+// Decodes the block starting at block_pc into the block cache.
+// Every entry gets its offset from block_pc. With handlers, every instruction gets the label
+// of its handler in the threaded engine, and a block cut at MAX_BLOCK_LENGTH or before
+// the marker is followed by a terminator jumping to exit_handler. The first entry of the block
+// at the marker gets marker_handler instead.
+template <typename Memory>
+Block& Sim::build_block(Memory& mem, uint32_t block_pc, const void* const* handlers,
+                        const void* exit_handler, const void* marker_handler) {
+
+    Block& block = block_cache.open(block_pc);
+
+    bool ended = decode_block(block_pc, BlockCache::MAX_BLOCK_LENGTH,
+        [&](uint32_t addr) {
+            if (const Instruction* instr = decoded_text->find(addr))
+                return *instr;
+            return decode(mem.template load<uint32_t>(addr));
+        },
+        [&](Instruction instr) {
+            if (instr.rd == 0 && !writes_float_register(instr.id) && !writes_vector_register(instr.id))
+                instr.rd = REG_ZERO_SINK;
+            block_cache.append(block, instr);
+        }, marker_pc);
+
+    Instruction* instrs = block_cache.instructions(block);
+
+#ifdef USE_FUSION
+    block_cache.shrink(block, static_cast<uint32_t>(fuse_block(instrs, block.size)));
+#endif
+
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < block.size; ++i) {
+        instrs[i].offset = static_cast<uint16_t>(offset);
+        offset += instrs[i].length;
+        if (handlers)
+            instrs[i].handler = handlers[static_cast<int>(instrs[i].id)];
+    }
+
+    if (!ended) {
+        Instruction terminator = {};
+        terminator.offset = static_cast<uint16_t>(offset);
+        terminator.handler = exit_handler;
+        block_cache.terminate(terminator);
+    }
+
+    if (handlers && block_pc == marker_pc)
+        instrs[0].handler = marker_handler;
+
+    // statically translated code, if the block was found ahead of time and ends where it does
+    bool cut_at_marker = !ended && block.end_pc == marker_pc;
+    if (block_pc != marker_pc && !cut_at_marker)
+        block.native = aot.find(block_pc);
+
+    block_cache.track(block, [&](uint32_t page) { mem.set_code(page, true); });
+
+    return block;
+}
+
+// Self-modifying code: blocks decoded from the modified bytes are dropped with their
+// native code, the block being executed finishes as it was decoded, like without FENCE.I
+void Sim::code_written(uint32_t addr, uint32_t size, bool by_this_hart) {
+
+    if (!by_this_hart) {
+        std::lock_guard lock(remote_code_mutex);
+        uint32_t last = static_cast<uint32_t>((uint64_t(addr) + size - 1) >> PageFlags::PAGE_BITS);
+        for (uint32_t page = addr >> PageFlags::PAGE_BITS; page <= last; ++page) {
+            if (std::find(remote_code_pages.begin(), remote_code_pages.end(), page) == remote_code_pages.end())
+                remote_code_pages.push_back(page);
         }
+        return;
     }
 
-}  //!
+    drop_blocks(addr, size);
 
-void Sim::execute(Instruction instr) {
+    // instruction starting a halfword before addr may cover it
+    uint32_t first = (addr & ~1u) - 2;
+    for (uint32_t half_addr = first; half_addr - first < size + (addr & 1u) + 2; half_addr += 2) {
+        if (!decoded_text->find(half_addr))
+            continue;
 
-    uint8_t r1 = instr.rs1;
-    uint8_t r2 = instr.rs2;
-    uint8_t r3 = instr.rs3;
+        // other harts and Sims may share the text, it is copied before its first change
+        if (decoded_text.use_count() > 1)
+            decoded_text = std::make_shared<DecodedText>(*decoded_text);
 
-    uint8_t rd = instr.rd;
+        *decoded_text->find(half_addr) =
+            std::visit([&](auto& mem) { return decode(mem.template load<uint32_t>(half_addr)); }, *memory);
+    }
 
-    int32_t imm = instr.imm;
+    aot.invalidate(addr, addr + size);
+}
+
+void Sim::drop_blocks(uint32_t addr, uint32_t size) {
+    // flags are shared, other harts may still have blocks on the page
+    block_cache.invalidate(addr, size, [&](uint32_t page) {
+        if (!shared_memory && !ahead_of_time_code(page))
+            std::visit([&](auto& mem) { mem.set_code(page, false); }, *memory);
+    });
+}
 
-    uint32_t tmp_32;
-    uint16_t tmp_16;
-    uint8_t  tmp_8;
+void Sim::on_code_write(std::function<void(uint32_t addr, uint32_t size)> hook) {
+    std::visit([&](auto& mem) { mem.on_code_write(std::move(hook)); }, *memory);
+}
 
-    switch (instr.id)
+void Sim::fence_i() {
+    if (!shared_memory)
+        return;
+
+    std::vector<uint32_t> pages;
     {
-    case Opcode::ADD :
-        registers[rd] = registers[r1] + registers[r2];
-        pc += 4;
-        break;
-    case Opcode::ADDI :
-        registers[rd] = registers[r1] + imm;
-        pc += 4;
-        break;
-    case Opcode::SUB :
-        registers[rd] = registers[r1] - registers[r2];
-        pc += 4;
-        break;
-    case Opcode::XOR :
-        registers[rd] = registers[r1] ^ registers[r2];
-        pc += 4;
-        break;
-    case Opcode::XORI :
-        registers[rd] = registers[r1] ^ static_cast<uint32_t>(imm);
-        pc += 4;
-        break;
-    case Opcode::OR :
-        registers[rd] = registers[r1] | registers[r2];
-        pc += 4;
-        break;
-    case Opcode::ORI :
-        registers[rd] = registers[r1] | static_cast<uint32_t>(imm);
-        pc += 4;
-        break;
-    case Opcode::AND :
-        registers[rd] = registers[r1] & registers[r2];
-        pc += 4;
-        break;
-    case Opcode::ANDI :
-        registers[rd] = registers[r1] & static_cast<uint32_t>(imm);
-        pc += 4;
-        break;
-    case Opcode::AUIPC :
-        registers[rd] = pc + imm;
-        pc += 4;
-        break;
-    case Opcode::BEQ :
-        pc += (r1 == r2) ? imm : 4;
-        break;
-    case Opcode::BGE :
-        pc += (static_cast<int32_t>(registers[r1]) >= static_cast<int32_t>(registers[r2])) ? imm : 4;
-        break;
-    case Opcode::BGEU :
-        pc += (registers[r1] >= registers[r2]) ? imm : 4;
-        break;
-    case Opcode::BLT :
-        pc += (static_cast<int32_t>(registers[r1]) < static_cast<int32_t>(registers[r2])) ? imm : 4;
-        break;
-    case Opcode::BLTU :
-        pc += (registers[r1] < registers[r2]) ? imm : 4;
-        break;
-    case Opcode::BNE :
-        pc += (r1 != r2) ? imm : 4;
-        break;
-    case Opcode::EBREAK :
-        program_halted = true;
-        break;
-    case Opcode::ECALL :
-        program_halted = true;
-        break;
-    case Opcode::FENCE :
-        pc =+ 4;
-        break;
-    case Opcode::FENCE_TSO :
-        pc =+ 4;
-        break;
-    case Opcode::JAL :
-        registers[rd] = pc + 4;
-        pc += imm;
-        break;
-    case Opcode::JALR :
-        registers[rd] = (static_cast<int32_t>(registers[r1]) + imm) & (~0b01);
-        pc = imm;
-        break;
-    case Opcode::LB :
-        tmp_32 = *reinterpret_cast<const uint8_t*>(memspace.data() + (registers[r1] + imm));
-        registers[rd] = static_cast<uint32_t>(tmp_32 << 24) >> 24;
-        pc += 4;
-        break;
-    case Opcode::LBU :
-        registers[rd] = 0xFF & (*reinterpret_cast<const uint8_t*>(memspace.data() + (registers[r1] + imm)));
-        pc += 4;
-        break;
-    case Opcode::LH :
-        tmp_32 = *reinterpret_cast<const uint16_t*>(memspace.data() + (registers[r1] + imm));
-        registers[rd] = static_cast<uint32_t>(tmp_32 << 16) >> 16;
-        pc += 4;
-        break;
-    case Opcode::LHU :
-        registers[rd] = 0xFFFF & (*reinterpret_cast<const uint16_t*>(memspace.data() + (registers[r1] + imm)));
-        pc += 4;
-        break;
-    case Opcode::LUI :
-        registers[rd] = static_cast<uint32_t>(imm);
-        pc += 4;
-        break;
-    case Opcode::LW :
-        tmp_32 = *reinterpret_cast<const uint32_t*>(memspace.data() + (registers[r1] + imm));
-        registers[rd] = tmp_32;
-        pc += 4;
-        break;
-    case Opcode::PAUSE :
-        program_halted = true;
-        break;
-    case Opcode::SB :
-        tmp_8 = static_cast<uint8_t>(registers[r2] & 0xFF);
-        *reinterpret_cast<uint8_t*>(memspace.data() + (registers[r1] + imm)) = tmp_8;
-        pc += 4;
-        break;
-    case Opcode::SBREAK :
-        program_halted = true;
-        break;
-    case Opcode::SCALL :
-        program_halted = true;
-        break;
-    case Opcode::SH :
-        tmp_16 = static_cast<uint16_t>(registers[r2] & 0xFFFF);
-        *reinterpret_cast<uint16_t*>(memspace.data() + (registers[r1] + imm)) = tmp_16;
-        pc += 4;
-        break;
-    case Opcode::SLL :
-        registers[rd] = registers[r1] << (registers[r2] & 0b011111);
-        pc += 4;
-        break;
-    case Opcode::SLT :
-        registers[rd] = static_cast<int32_t>(registers[r1]) < static_cast<int32_t>(registers[r2]);
-        pc += 4;
-        break;
-    case Opcode::SLTI :
-        registers[rd] = static_cast<int32_t>(registers[r1]) < static_cast<int32_t>(imm);
-        pc += 4;
-        break;
-    case Opcode::SLTIU :
-        registers[rd] = static_cast<uint32_t>(registers[r1]) < static_cast<uint32_t>(imm);
-        pc += 4;
-        break;
-    case Opcode::SLTU :
-        registers[rd] = registers[r1] < registers[r2];
-        pc += 4;
-        break;
-    case Opcode::SRL :
-        registers[rd] = registers[r1] >> (registers[r2] & 0b011111);
-        pc += 4;
-        break;
-    case Opcode::SRA :
-        registers[rd] = (int)registers[r1] >> (registers[r2] & 0b011111);
-        pc += 4;
-        break;
-    case Opcode::SW :
-        tmp_32 = registers[r2];
-        *reinterpret_cast<uint32_t*>(memspace.data() + (registers[r1] + imm)) = tmp_32;
-        pc += 4;
-        break;
-    default:
-        throw std::invalid_argument("Invalid Opcode: " + static_cast<int>(instr.id));
-        break;
+        std::lock_guard lock(remote_code_mutex);
+        pages.swap(remote_code_pages);
     }
 
-    registers[0] = 0;
+    for (uint32_t page : pages)
+        code_written(page << PageFlags::PAGE_BITS, PagedMemory::PAGE_SIZE);
 }
 
-static bool is_end_of_block(Opcode opcode) {
-
-    static std::set<Opcode> end_of_block_opcodes = {
-        Opcode::BEQ, 
-        Opcode::BGE,
-        Opcode::BGEU,
-        Opcode::BLT,
-        Opcode::BLTU,
-        Opcode::BNE,
-        Opcode::EBREAK,
-        Opcode::ECALL,
-        Opcode::JAL,
-        Opcode::JALR,
-        Opcode::PAUSE,
-        Opcode::SBREAK,
-        Opcode::SCALL
-    };
+// Follows the chained successor of the block for pc,
+// falls back to the cache lookup and patches the link on a miss.
+template <typename Memory>
+Block* Sim::next_block(Memory& mem, Block* block, uint32_t next_pc, const void* const* handlers,
+                       const void* exit_handler, const void* marker_handler) {
 
-    return end_of_block_opcodes.count(opcode);
+    Block* next = block->next[0];
+    if (next->pc == next_pc)
+        return next;
+
+    next = block->next[1];
+    if (next->pc == next_pc)
+        return next;
+
+    next = block_cache.find(next_pc);
+    if (!next) {
+        next = &build_block(mem, next_pc, handlers, exit_handler, marker_handler);
+    }
+
+    block->next[Block::link_index(*block, next_pc)] = next;
+    return next;
 }
 
-size_t Sim::run(std::ostream& trace_out) {
+template <typename Memory, typename Instrumentation>
+size_t Sim::run_switch(Memory& mem, Instrumentation& instrumentation, size_t limit) {
 
     size_t instr_count = 0;
     Instruction instr = {};
 
-    while (!program_halted) {
-
 #ifdef USE_CACHE
-        std::vector<Instruction> cached_instrs = {};
-        uint32_t cashed_pc = pc; // start of block
-        if (!simple_cache.count(pc)) {
-
-            do {
-                uint32_t word = *reinterpret_cast<const uint32_t*>(memspace.data() + pc);
-                instr = decode(word);
-                pc += 4;
-                cached_instrs.push_back(instr);
+    Block* block = block_cache.find(pc);
+    if (!block) {
+        block = &build_block(mem, pc, nullptr, nullptr, nullptr);
+    }
+#endif
 
-            } while(!is_end_of_block(instr.id));
+    while (!program_halted && instr_count < limit) {
 
-            simple_cache[cashed_pc] = cached_instrs;
-            pc = cashed_pc;     
+        if (pc == marker_pc && instr_count) {
+            marker_reached = true;
+            break;
         }
-        else {
-            cached_instrs = simple_cache[pc];
+
+#ifdef USE_CACHE
+        if (pc != block->pc) {
+            block = next_block(mem, block, pc, nullptr, nullptr, nullptr);
         }
-        
-        for (auto&& instr : cached_instrs)
+
+        instrumentation.block(pc, block->length);
+
+        const Instruction* cached_instrs = block_cache.instructions(*block);
+        for (uint32_t i = 0; i < block->size; ++i)
         {   
-            execute(instr);
+            instr = cached_instrs[i];
+            execute(instr, mem, instrumentation);
         }
 
-        instr_count += cached_instrs.size();
+        instr_count += block->length;
 #else
-        uint32_t word = *reinterpret_cast<const uint32_t*>(memspace.data() + pc);
+        uint32_t word = mem.template load<uint32_t>(pc);
         Instruction instr = decode(word);
 
-        execute(instr);
+        instrumentation.block(pc, 1);
+        execute(instr, mem, instrumentation);
 
         instr_count++;
 #endif
+    }
 
-#ifdef TRACE
-    trace_out << "---------------------------------------------------------------" << std::endl;
-    trace_out << int(instr.id)
-                  << std::dec << " rd = " << (int)instr.rd
-                  << ", rs1 = " << (int)instr.rs1
-                  << ", rs2 = " << (int)instr.rs2
-                  << ", rs3 = " << (int)instr.rs3 << std::hex << ", imm = 0x"
-                  << instr.imm << std::dec << std::endl;
+    return instr_count;
+}
 
-        trace_out << "PC = 0x" << std::hex << pc << std::endl;
+#ifdef USE_THREADED_CODE
+
+// Threaded code engine: every cached instruction carries the label of its handler,
+// and each handler jumps straight to the handler of the next instruction,
+// so there is no central switch and no call per instruction.
+// block_pc stays at the start of the block while it runs, handlers which need pc
+// add the offset of their instruction, so the others don't touch pc at all.
+// Writes to x0 are redirected to REG_ZERO_SINK when block is cached,
+// that's why x0 doesn't have to be cleared after every instruction.
+template <typename Memory, typename Instrumentation>
+size_t Sim::run_threaded(Memory& mem, Instrumentation& instrumentation, size_t limit) {
+
+    static const void* const handlers[] = {
+#define OPCODE_LABEL(name) &&op_##name,
+        OPCODE_LIST(OPCODE_LABEL)
+#undef OPCODE_LABEL
+    };
 
-        trace_out << "rd val" << std::hex << registers[instr.rd] << std::endl;
-        trace_out << "Zero reg: " << registers[0] << std::endl;
-        
+    size_t instr_count = 0;
+
+    uint32_t* x = registers.data();
+    uint32_t block_pc = pc;
+    const Instruction* in = nullptr;
+
+#define OP(name)    op_##name:
+#define PC          (block_pc + in->offset)
+#define NEXT        goto *(++in)->handler
+#define END_BLOCK(next_pc)  { block_pc = (next_pc); goto block_end; }
+
+    Block* block = block_cache.find(block_pc);
+    if (!block) {
+        block = &build_block(mem, block_pc, handlers, &&block_cut, &&marker_hit);
+    }
+
+    while (!program_halted && instr_count < limit) {
+
+        if (block_pc != block->pc) {
+            block = next_block(mem, block, block_pc, handlers, &&block_cut, &&marker_hit);
+        }
+
+        instr_count += block->length;
+
+        // translated code addresses guest memory as base + address, it has no instrumentation hooks
+        if constexpr (std::is_same_v<Memory, ReservedMemory> && !Instrumentation::enabled) {
+            if (block->native) {
+                block_pc = block->native(x, mem.data());
+                if (!(block_pc & 1))
+                    continue;
+
+                // stopped before a store to a flagged page, the interpreter goes on from the store
+                block_pc &= ~1u;
+                instr_count -= block_cache.length_from(*block, block_pc);
+
+                block = block_cache.find(block_pc);
+                if (!block) {
+                    block = &build_block(mem, block_pc, handlers, &&block_cut, &&marker_hit);
+                }
+                instr_count += block->length;
+            }
+#ifdef USE_JIT
+            // the block at the marker stays interpreted for its marker handler
+            else if (jit_threshold && ++block->exec_count == jit_threshold && block->pc != marker_pc) {
+                block->native = jit.translate(*block, block_cache.instructions(*block));
+                if (jit.full()) {
+                    // starts over in an empty buffer
+                    block_cache.drop_native();
+                    jit.reset();
+                    block->native = jit.translate(*block, block_cache.instructions(*block));
+                }
+            }
 #endif
+        }
+
+        // marker_hit reports the block at the marker once it's sure to run
+        if (block_pc != marker_pc)
+            instrumentation.block(block_pc, block->length);
+        in = block_cache.instructions(*block);
+        goto *in->handler;
+
+#include "semantics.inc"
+
+        // first entry of the block at the marker: stops the run unless the run started with it
+marker_hit:
+        if (instr_count != block->length) {
+            instr_count -= block->length;
+            marker_reached = true;
+            break;
+        }
+        instrumentation.block(block_pc, block->length);
+        goto *handlers[static_cast<int>(in->id)];
+
+        // terminator of a block cut at MAX_BLOCK_LENGTH or before the marker,
+        // its offset is the end of the block
+block_cut:
+        block_pc += in->offset;
+
+block_end:
+        pc = block_pc;
     }
 
+    // translated blocks go on to the next one without passing block_end
+    pc = block_pc;
+
+#undef OP
+#undef PC
+#undef NEXT
+#undef END_BLOCK
+
     return instr_count;
 }
 
+#endif
+
+#undef X
+#undef F
+#undef IMM
+#undef IMM2
+#undef LENGTH
+#undef LOAD
+#undef STORE
+#undef ATOMIC
+#undef MEM
+#undef INSTRUMENTATION
+#undef BRANCH
+#undef JUMP
+
 void Sim::dump_registers(std::ostream& out) {
-    for (int i = 0; i < registers.size(); ++i) 
-        out << std::dec << "r" << i << " : " << registers[i] << std::endl;
-}
\ No newline at end of file
+    for (int i = 0; i < REG_NUM; ++i) 
+        out << std::dec << "r" << i << " : " << registers[i] << '\n';
+    for (int i = 0; i < REG_NUM; ++i)
+        out << std::dec << "f" << i << " : 0x" << std::hex << fpu.registers[i] << '\n';
+    out << std::dec;
+}
+
+uint32_t Sim::read_csr(uint32_t csr) {
+    switch (csr) {
+    case Fpu::CSR_FFLAGS: return fpu.fflags();
+    case Fpu::CSR_FRM:    return fpu.frm();
+    case Fpu::CSR_FCSR:   return fpu.frm() << 5 | fpu.fflags();
+    case Vpu::CSR_VSTART: return 0;
+    case Vpu::CSR_VL:     return vpu.vl();
+    case Vpu::CSR_VTYPE:  return vpu.vtype();
+    case Vpu::CSR_VLENB:  return Vpu::VLENB;
+    case CSR_MHARTID:     return hart_id;
+    default:
+        throw std::invalid_argument("Unsupported CSR: " + std::to_string(csr));
+    }
+}
+
+void Sim::write_csr(uint32_t csr, uint32_t value) {
+    switch (csr) {
+    case Fpu::CSR_FFLAGS:
+        fpu.set_fflags(value);
+        break;
+    case Fpu::CSR_FRM:
+        fpu.set_frm(value);
+        break;
+    case Fpu::CSR_FCSR:
+        fpu.set_frm(value >> 5);
+        fpu.set_fflags(value);
+        break;
+    case Vpu::CSR_VSTART:
+        // instructions always complete, so vstart stays 0
+        if (value)
+            throw std::invalid_argument("Unsupported vstart: " + std::to_string(value));
+        break;
+    case Vpu::CSR_VL:
+    case Vpu::CSR_VTYPE:
+    case Vpu::CSR_VLENB:
+    case CSR_MHARTID:
+        throw std::invalid_argument("Read-only CSR: " + std::to_string(csr));
+    default:
+        throw std::invalid_argument("Unsupported CSR: " + std::to_string(csr));
+    }
+}
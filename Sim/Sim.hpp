@@ -2,41 +2,271 @@
 
 #include <vector>
 #include <string>
+#include <atomic>
+#include <chrono>
 #include <stdexcept>
 #include <iostream>
+#include <variant>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <limits>
 #include <unordered_map>
 
 #include "helper.hpp" 
 #include "opdefs.hpp"
+#include "memory.hpp"
+#include "block_cache.hpp"
+#include "jit_x86_64.hpp"
+#include "aot.hpp"
+#include "decoder.hpp"
+#include "fpu.hpp"
+#include "vpu.hpp"
+#include "syscalls.hpp"
+#include "instrumentation.hpp"
 
-//#define TRACE
+// GCC merges identical tails of the instruction handlers, which costs the hot ones an extra jump
+#if defined(__GNUC__) && !defined(__clang__)
+#define NO_TAIL_MERGING __attribute__((optimize("no-crossjumping")))
+#else
+#define NO_TAIL_MERGING
+#endif
+
+struct SimOptions {
+    MemoryBackend memory_backend = default_memory_backend;
+
+    // decode the executable segments when the ELF is loaded instead of on first execution
+    bool predecode = false;
+    unsigned predecode_threads = 1;
+
+    // executable segments of the same ELF decoded by another Sim, used instead of predecoding
+    std::shared_ptr<DecodedText> decoded_text;
+
+    // executions of a block before the JIT translates it, 0 for never, and the size of
+    // its code buffer, which starts over when a block doesn't fit
+    uint32_t jit_threshold = Jit::HOT_THRESHOLD;
+    size_t jit_code_size = Jit::CODE_SIZE;
+
+    // guest writes to stdout and stderr, see Console
+    ConsoleBuffering console_buffering = ConsoleBuffering::Auto;
+    Console::Sink console_sink;
+
+    // Process start as on Linux: argc, argv, envp and the auxiliary vector at the top of the stack,
+    // sp points to argc. argv[0] is the ELF name, args follow it. The stack grows down from
+    // stack_top, by default the top of the guest space. Every other hart gets a stack of its own
+    // below: hart n starts with sp at stack_top - n * hart_stack_size.
+    std::vector<std::string> args;
+    std::vector<std::string> env;
+    uint64_t stack_top = uint64_t(1) << 32;
+    uint32_t hart_stack_size = 1 << 20;
+};
+
+// Bounds of a run, all of them checked at block boundaries. The budget is the limit of run,
+// the deadline and the stop flag are polled between slices of RUN_SLICE instructions,
+// so another thread which sets stop waits for a slice at most.
+struct RunLimits {
+    size_t budget = std::numeric_limits<size_t>::max();
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    const std::atomic<bool>* stop = nullptr;
+};
+
+enum class RunStatus {
+    Halted,
+    Marker,             // at_marker(), see set_marker
+    BudgetExhausted,
+    DeadlineExpired,
+    Stopped,
+};
+
+struct RunResult {
+    RunStatus status;
+    size_t instr_count;
+};
+
+using GuestMemory = std::variant<PagedMemory, ReservedMemory>;
 
 class Sim final {
 
 public:
 
-    Sim(const std::string& elf_filename);
+    static constexpr uint32_t CSR_MHARTID = 0xf14;
+
+    // instructions between two polls of the deadline and the stop flag, about a millisecond
+    static constexpr size_t RUN_SLICE = size_t(1) << 20;
+
+public:
+
+    Sim(const std::string& elf_filename, const SimOptions& options = {});
+
+    // Another hart of the machine of boot: shares its guest memory and starts where boot is,
+    // with its hart id in a0 and mhartid and sp at its own stack, options as boot was created with.
+    // Harts on several host threads need the reserved backend.
+    Sim(Sim& boot, uint32_t hart_id, const SimOptions& options = {});
 
 public:
 
-    size_t run(std::ostream& out);
+    // Runs until the hart halts or, at the end of a block, at least limit instructions were executed.
+    // Returns the instructions executed, the next call goes on where this one stopped.
+    size_t run(size_t limit = std::numeric_limits<size_t>::max());
+
+    // The same with the hooks of an instrumentation policy, see instrumentation.hpp.
+    // Instantiated for the policies there, the run above is the one with NoInstrumentation.
+    template <InstrumentationPolicy Instrumentation>
+    size_t run(Instrumentation& instrumentation, size_t limit = std::numeric_limits<size_t>::max());
+
+    // Runs within limits and tells why it stopped. Without a deadline and a stop flag it's the run
+    // above, slicing only starts when one of them is set, so unbounded runs pay nothing for it.
+    // Harts of a machine always run in slices, exit_group of one of them halts the others.
+    RunResult run(const RunLimits& limits);
+
+    bool halted() const { return program_halted; }
+
+    // a0 of the halted guest, where it leaves its exit code, or the status of exit_group
+    uint32_t exit_code() const { return syscalls->group_exited() ? syscalls->group_exit_code() : registers[10]; }
+
+    // Predecoded executable segments, shared with the harts of this Sim and with other Sims
+    // of the same ELF through SimOptions. A Sim copies them before it changes them.
+    const std::shared_ptr<DecodedText>& text() const { return decoded_text; }
+
+    // blocks translated by aot_compile, used instead of the interpreter with the reserved memory backend
+    void load_aot(const std::string& path);
+
+public:
+
+    // Markers stop a run with at_marker(): at marker_pc before its instruction, or right after
+    // an ECALL with number in a7. A run which starts at marker_pc executes it.
+    static constexpr uint32_t NO_MARKER = 1;
+    void set_marker(uint32_t marker_pc);
+    void set_ecall_marker(uint32_t number);
+    void clear_markers();
+    bool at_marker() const { return marker_reached; }
+
+    // Snapshot-and-fork: snapshot saves the hart and watches the guest pages, restore brings
+    // the snapshot back by copying only the pages written since the snapshot or the previous
+    // restore, so any number of runs start from the same point for a fraction of a boot.
+    // A new snapshot replaces the previous one. Not for harts sharing memory.
+    void snapshot();
+    void restore();
+
+    // e.g. the input of every run from a snapshot
+    void read_memory(uint32_t addr, void* dst, size_t size);
+    void write_memory(uint32_t addr, const void* src, size_t size);
+    uint32_t read_register(uint32_t index) const;
+    void write_register(uint32_t index, uint32_t value);
 
 public:
 
     void execute(Instruction instr);
     void dump_registers(std::ostream& out);
 
+    // Stores which modified cached code end up here. Blocks of the storing hart are dropped at once,
+    // the other harts keep the pages until their next FENCE.I, as instruction fetch of other harts
+    // is only ordered by it. See Machine, which routes the stores of all harts with on_code_write.
+    void code_written(uint32_t addr, uint32_t size, bool by_this_hart = true);
+    void on_code_write(std::function<void(uint32_t addr, uint32_t size)> hook);
+
+private:
+
+    template <typename Memory, typename Instrumentation>
+    void execute(Instruction instr, Memory& mem, Instrumentation& instrumentation);
+
+    // argc, argv, envp and the auxiliary vector of the process start, see SimOptions
+    template <typename Memory>
+    void setup_stack(Memory& mem, const ELFIO::elfio& reader, const std::string& elf_filename, const SimOptions& options);
+
+    template <typename Memory>
+    Block& build_block(Memory& mem, uint32_t block_pc, const void* const* handlers,
+                       const void* exit_handler, const void* marker_handler);
+    template <typename Memory>
+    Block* next_block(Memory& mem, Block* block, uint32_t next_pc, const void* const* handlers,
+                      const void* exit_handler, const void* marker_handler);
+
+    // drops the cached blocks overlapping [addr, addr + size)
+    void drop_blocks(uint32_t addr, uint32_t size);
+
+    // FENCE.I, decodes again the code other harts stored since the last one
+    void fence_i();
+
+    // Zicsr, only the floating point and vector CSRs are implemented
+    uint32_t read_csr(uint32_t csr);
+    void write_csr(uint32_t csr, uint32_t value);
+
+    template <typename Memory, typename Instrumentation>
+    NO_TAIL_MERGING size_t run_switch(Memory& mem, Instrumentation& instrumentation, size_t limit);
+    template <typename Memory, typename Instrumentation>
+    NO_TAIL_MERGING size_t run_threaded(Memory& mem, Instrumentation& instrumentation, size_t limit);
+
 private:
     std::vector<uint32_t> registers;
-    std::vector<uint8_t> memspace;    
+    std::shared_ptr<GuestMemory> memory;
+    std::shared_ptr<Syscalls> syscalls;
+    Fpu fpu;
+    Vpu vpu;
 
 private:
 
     uint32_t pc = 0;
     bool program_halted = false;
 
+    uint32_t hart_id = 0;
+    bool shared_memory = false;
+
+    // LR reservation: the word and the value LR read, SC stores if the word still holds the value.
+    // Harts only touch their own reservation, so unrelated LR/SC pairs never wait for each other.
+    static constexpr uint32_t NO_RESERVATION = 1;
+    uint32_t reserved_addr = NO_RESERVATION;
+    uint32_t reserved_value = 0;
+
+    // pages with code stored by other harts since the last FENCE.I
+    std::mutex remote_code_mutex;
+    std::vector<uint32_t> remote_code_pages;
+
+    // blocks are cut before marker_pc, the block at it starts with the marker handler
+    uint32_t marker_pc = NO_MARKER;
+    int64_t marker_ecall = -1;
+    bool marker_reached = false;
+
+private:
+
+    struct Snapshot {
+        std::vector<uint32_t> registers;
+        uint32_t pc = 0;
+        bool halted = false;
+        uint32_t program_break = 0;
+        Fpu fpu;
+        Vpu vpu;
+
+        // snapshot content of every page written since, kept for the next restores
+        std::unordered_map<uint32_t, std::unique_ptr<uint8_t[]>> pages;
+
+        // pages written since the snapshot or the last restore
+        std::vector<uint32_t> dirty;
+    };
+
+    std::unique_ptr<Snapshot> saved;
+
+    // first store to a watched page
+    void page_written(uint32_t page);
+
 private:
 
-    std::unordered_map<uint32_t, std::vector<Instruction>> simple_cache = {};
+    BlockCache block_cache;
+    std::shared_ptr<DecodedText> decoded_text;
+
+#ifdef HAS_JIT
+    Jit jit;
+#endif
+    uint32_t jit_threshold = Jit::HOT_THRESHOLD;
+
+    AotLibrary aot;
+    uint64_t text_hash = 0;
+
+    // first and last page of every executable segment
+    std::vector<std::pair<uint32_t, uint32_t>> text_pages;
+
+    // Pages of predecoded or translated code stay CODE, so stores to them reach code_written
+    // even before any block was decoded from them
+    bool ahead_of_time_code(uint32_t page) const;
+    void flag_text_pages();
     
 };
\ No newline at end of file
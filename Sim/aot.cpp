@@ -0,0 +1,527 @@
+#include "aot.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <elfio.hpp>
+
+#include "decoder.hpp"
+#include "elf.hpp"
+#include "helper.hpp"
+#include "memory.hpp"
+
+#ifdef HAS_AOT
+#include <dlfcn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// layout of the block table exported by the translated library
+struct AotBlock {
+    uint32_t pc;
+    NativeBlock native;
+};
+
+static bool is_executable_load(const ELFIO::segment* segment) {
+    return segment->get_type() == ELFIO::PT_LOAD && (segment->get_flags() & ELFIO::PF_X);
+}
+
+// bumped when the contract between generated code and Sim changes
+static constexpr uint8_t AOT_FORMAT = 3;
+
+uint64_t aot_text_hash(const ELFIO::elfio& reader) {
+
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&](uint8_t byte) {
+        hash ^= byte;
+        hash *= 1099511628211ull;
+    };
+
+    mix(AOT_FORMAT);
+
+    for (const auto& segment : reader.segments) {
+        if (!is_executable_load(segment.get()))
+            continue;
+
+        uint32_t addr = static_cast<uint32_t>(segment->get_virtual_address());
+        for (int i = 0; i < 4; ++i)
+            mix(static_cast<uint8_t>(addr >> (8 * i)));
+
+        const uint8_t* data = reinterpret_cast<const uint8_t*>(segment->get_data());
+        for (size_t i = 0; i < segment->get_file_size(); ++i)
+            mix(data[i]);
+    }
+
+    return hash;
+}
+
+namespace {
+
+// executable segments of the ELF, the only memory static translation may read
+class Text final {
+
+public:
+
+    explicit Text(const ELFIO::elfio& reader) {
+        for (const auto& segment : reader.segments) {
+            if (!is_executable_load(segment.get()))
+                continue;
+
+            const uint8_t* data = reinterpret_cast<const uint8_t*>(segment->get_data());
+            segments[static_cast<uint32_t>(segment->get_virtual_address())] =
+                std::vector<uint8_t>(data, data + segment->get_file_size());
+        }
+    }
+
+    bool contains(uint32_t addr, uint32_t size) const {
+        auto it = segments.upper_bound(addr);
+        if (it == segments.begin())
+            return false;
+        --it;
+        return addr - it->first + size <= it->second.size();
+    }
+
+    // up to 4 bytes at addr, a compressed instruction may end the segment
+    uint32_t fetch(uint32_t addr) const {
+        auto it = --segments.upper_bound(addr);
+        uint32_t word = 0;
+        std::memcpy(&word, it->second.data() + (addr - it->first),
+                    std::min<size_t>(sizeof(word), it->second.size() - (addr - it->first)));
+        return word;
+    }
+
+private:
+
+    std::map<uint32_t, std::vector<uint8_t>> segments;
+};
+
+struct StaticBlock {
+    uint32_t pc;
+    uint32_t end_pc;
+    std::vector<Instruction> instrs;
+    bool ended;
+};
+
+bool translatable(Opcode id) {
+    switch (id) {
+    case Opcode::NONE:
+    case Opcode::EBREAK:
+    case Opcode::ECALL:
+    case Opcode::PAUSE:
+    case Opcode::SBREAK:
+    case Opcode::SCALL:
+    // floating point and vector state live in Fpu and Vpu
+    case Opcode::CSRRC:
+    case Opcode::CSRRCI:
+    case Opcode::CSRRS:
+    case Opcode::CSRRSI:
+    case Opcode::CSRRW:
+    case Opcode::CSRRWI:
+    // the reservation of LR/SC and code stored by other harts live in Sim
+    case Opcode::FENCE_I:
+        return false;
+    default:
+        return !is_atomic(id) && !is_float(id) && !is_vector(id);
+    }
+}
+
+// Walks blocks from the entry point and function symbols,
+// following branch and jump targets and return addresses of calls.
+std::vector<StaticBlock> discover(const ELFIO::elfio& reader, const Text& text) {
+
+    std::deque<uint32_t> worklist = {static_cast<uint32_t>(reader.get_entry())};
+
+    for (const auto& section : reader.sections) {
+        if (section->get_type() != ELFIO::SHT_SYMTAB)
+            continue;
+
+        ELFIO::const_symbol_section_accessor symbols(reader, section.get());
+        for (ELFIO::Elf_Xword i = 0; i < symbols.get_symbols_num(); ++i) {
+            std::string name;
+            ELFIO::Elf64_Addr value = 0;
+            ELFIO::Elf_Xword size = 0;
+            unsigned char bind = 0, type = 0, other = 0;
+            ELFIO::Elf_Half section_index = 0;
+            symbols.get_symbol(i, name, value, size, bind, type, section_index, other);
+            if (type == ELFIO::STT_FUNC)
+                worklist.push_back(static_cast<uint32_t>(value));
+        }
+    }
+
+    std::set<uint32_t> visited;
+    std::vector<StaticBlock> blocks;
+
+    while (!worklist.empty()) {
+        uint32_t pc = worklist.front();
+        worklist.pop_front();
+
+        if (pc % 2 || !visited.insert(pc).second || !text.contains(pc, 2))
+            continue;
+
+        StaticBlock block = {pc, pc, {}, false};
+        bool inside = true;
+        block.ended = decode_block(pc, BlockCache::MAX_BLOCK_LENGTH,
+            [&](uint32_t addr) {
+                if (text.contains(addr, 2)) {
+                    Instruction instr = decode(text.fetch(addr));
+                    if (text.contains(addr, instr.length))
+                        return instr;
+                }
+                // ends the block, which is then dropped
+                inside = false;
+                return Instruction{};
+            },
+            [&](Instruction instr) {
+                if (instr.rd == 0 && !writes_float_register(instr.id) && !writes_vector_register(instr.id))
+                    instr.rd = REG_ZERO_SINK;
+                block.instrs.push_back(instr);
+                block.end_pc += instr.length;
+            });
+
+        if (!inside)
+            continue;
+
+        uint32_t end_pc = block.end_pc;
+        const Instruction& last = block.instrs.back();
+        uint32_t last_pc = end_pc - last.length;
+
+        switch (last.id) {
+        case Opcode::BEQ:
+        case Opcode::BNE:
+        case Opcode::BLT:
+        case Opcode::BGE:
+        case Opcode::BLTU:
+        case Opcode::BGEU:
+        case Opcode::JAL:
+            worklist.push_back(last_pc + last.imm);
+            break;
+        default:
+            break;
+        }
+        // fall-through and return address of calls
+        worklist.push_back(end_pc);
+
+        bool supported = true;
+        for (const auto& instr : block.instrs)
+            supported &= translatable(instr.id);
+
+        if (supported)
+            blocks.push_back(std::move(block));
+    }
+
+    return blocks;
+}
+
+std::string reg(uint8_t r) {
+    return r == 0 ? std::string("0u") : std::string("x").append(std::to_string(r));
+}
+
+std::string hex(uint32_t value) {
+    char buf[16];
+    std::snprintf(buf, sizeof(buf), "0x%08xu", value);
+    return buf;
+}
+
+std::string function_name(uint32_t pc) {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "sim_aot_%08x", pc);
+    return buf;
+}
+
+// C++ statement of one instruction at pc
+std::string statement(const Instruction& in, uint32_t pc) {
+
+    std::string a = reg(in.rs1);
+    std::string b = reg(in.rs2);
+    std::string imm = hex(static_cast<uint32_t>(in.imm));
+    std::string addr = a + " + " + imm;
+
+    std::string value;
+    switch (in.id) {
+    case Opcode::ADD:   value = a + " + " + b; break;
+    case Opcode::SUB:   value = a + " - " + b; break;
+    case Opcode::XOR:   value = a + " ^ " + b; break;
+    case Opcode::OR:    value = a + " | " + b; break;
+    case Opcode::AND:   value = a + " & " + b; break;
+    case Opcode::ADDI:  value = a + " + " + imm; break;
+    case Opcode::XORI:  value = a + " ^ " + imm; break;
+    case Opcode::ORI:   value = a + " | " + imm; break;
+    case Opcode::ANDI:  value = a + " & " + imm; break;
+    case Opcode::SLL:   value = a + " << (" + b + " & 31)"; break;
+    case Opcode::SRL:   value = a + " >> (" + b + " & 31)"; break;
+    case Opcode::SRA:   value = "uint32_t(int32_t(" + a + ") >> (" + b + " & 31))"; break;
+    case Opcode::SLLI:  value = a + " << " + std::to_string(in.imm); break;
+    case Opcode::SRLI:  value = a + " >> " + std::to_string(in.imm); break;
+    case Opcode::SRAI:  value = "uint32_t(int32_t(" + a + ") >> " + std::to_string(in.imm) + ")"; break;
+    case Opcode::SLT:   value = "uint32_t(int32_t(" + a + ") < int32_t(" + b + "))"; break;
+    case Opcode::SLTU:  value = "uint32_t(" + a + " < " + b + ")"; break;
+    case Opcode::SLTI:  value = "uint32_t(int32_t(" + a + ") < int32_t(" + imm + "))"; break;
+    case Opcode::SLTIU: value = "uint32_t(" + a + " < " + imm + ")"; break;
+    case Opcode::MUL:    value = a + " * " + b; break;
+    case Opcode::MULH:   value = "uint32_t((int64_t(int32_t(" + a + ")) * int32_t(" + b + ")) >> 32)"; break;
+    case Opcode::MULHSU: value = "uint32_t((int64_t(int32_t(" + a + ")) * int64_t(" + b + ")) >> 32)"; break;
+    case Opcode::MULHU:  value = "uint32_t((uint64_t(" + a + ") * " + b + ") >> 32)"; break;
+    case Opcode::DIV:    value = b + " == 0u ? ~0u : (" + a + " == 0x80000000u && " + b + " == ~0u) ? " + a +
+                                 " : uint32_t(int32_t(" + a + ") / int32_t(" + b + "))"; break;
+    case Opcode::DIVU:   value = b + " == 0u ? ~0u : " + a + " / " + b; break;
+    case Opcode::REM:    value = b + " == 0u ? " + a + " : (" + a + " == 0x80000000u && " + b + " == ~0u) ? 0u" +
+                                 " : uint32_t(int32_t(" + a + ") % int32_t(" + b + "))"; break;
+    case Opcode::REMU:   value = b + " == 0u ? " + a + " : " + a + " % " + b; break;
+    case Opcode::SH1ADD: value = "(" + a + " << 1) + " + b; break;
+    case Opcode::SH2ADD: value = "(" + a + " << 2) + " + b; break;
+    case Opcode::SH3ADD: value = "(" + a + " << 3) + " + b; break;
+    case Opcode::ANDN:   value = a + " & ~" + b; break;
+    case Opcode::ORN:    value = a + " | ~" + b; break;
+    case Opcode::XNOR:   value = "~(" + a + " ^ " + b + ")"; break;
+    case Opcode::CLZ:    value = a + " ? uint32_t(__builtin_clz(" + a + ")) : 32u"; break;
+    case Opcode::CTZ:    value = a + " ? uint32_t(__builtin_ctz(" + a + ")) : 32u"; break;
+    case Opcode::CPOP:   value = "uint32_t(__builtin_popcount(" + a + "))"; break;
+    case Opcode::MIN:    value = "int32_t(" + a + ") < int32_t(" + b + ") ? " + a + " : " + b; break;
+    case Opcode::MINU:   value = a + " < " + b + " ? " + a + " : " + b; break;
+    case Opcode::MAX:    value = "int32_t(" + a + ") > int32_t(" + b + ") ? " + a + " : " + b; break;
+    case Opcode::MAXU:   value = a + " > " + b + " ? " + a + " : " + b; break;
+    case Opcode::SEXT_B: value = "uint32_t(int8_t(" + a + "))"; break;
+    case Opcode::SEXT_H: value = "uint32_t(int16_t(" + a + "))"; break;
+    case Opcode::ZEXT_H: value = "uint32_t(uint16_t(" + a + "))"; break;
+    case Opcode::ROL:    value = "rol(" + a + ", " + b + ")"; break;
+    case Opcode::ROR:    value = "ror(" + a + ", " + b + ")"; break;
+    case Opcode::RORI:   value = "ror(" + a + ", " + std::to_string(in.imm) + "u)"; break;
+    case Opcode::ORC_B:  value = "orc_b(" + a + ")"; break;
+    case Opcode::REV8:   value = "__builtin_bswap32(" + a + ")"; break;
+    case Opcode::BCLR:   value = a + " & ~(1u << (" + b + " & 31))"; break;
+    case Opcode::BEXT:   value = "(" + a + " >> (" + b + " & 31)) & 1u"; break;
+    case Opcode::BINV:   value = a + " ^ (1u << (" + b + " & 31))"; break;
+    case Opcode::BSET:   value = a + " | (1u << (" + b + " & 31))"; break;
+    case Opcode::BCLRI:  value = a + " & " + hex(~(1u << in.imm)); break;
+    case Opcode::BEXTI:  value = "(" + a + " >> " + std::to_string(in.imm) + ") & 1u"; break;
+    case Opcode::BINVI:  value = a + " ^ " + hex(1u << in.imm); break;
+    case Opcode::BSETI:  value = a + " | " + hex(1u << in.imm); break;
+    case Opcode::LUI:   value = imm; break;
+    case Opcode::AUIPC: value = hex(pc + in.imm); break;
+    case Opcode::LB:    value = "uint32_t(int8_t(ld<uint8_t>(m, " + addr + ")))"; break;
+    case Opcode::LBU:   value = "uint32_t(ld<uint8_t>(m, " + addr + "))"; break;
+    case Opcode::LH:    value = "uint32_t(int16_t(ld<uint16_t>(m, " + addr + ")))"; break;
+    case Opcode::LHU:   value = "uint32_t(ld<uint16_t>(m, " + addr + "))"; break;
+    case Opcode::LW:    value = "ld<uint32_t>(m, " + addr + ")"; break;
+
+    // stores to flagged pages leave the block before the store, the interpreter redoes it
+    case Opcode::SB:
+    case Opcode::SH:
+    case Opcode::SW: {
+        std::string type = in.id == Opcode::SB ? "uint8_t" : in.id == Opcode::SH ? "uint16_t" : "uint32_t";
+        return "{ uint32_t a = " + addr + "; if (flagged(m, a, sizeof(" + type + "))) { next = " + hex(pc | 1) + "; goto exit; } "
+               "st<" + type + ">(m, a, " + type + "(" + b + ")); }";
+    }
+
+    case Opcode::FENCE:     return "__atomic_thread_fence(__ATOMIC_SEQ_CST);";
+    case Opcode::FENCE_TSO: return "__atomic_thread_fence(__ATOMIC_ACQ_REL);";
+
+    case Opcode::BEQ:   return "next = " + a + " == " + b + " ? " + hex(pc + in.imm) + " : " + hex(pc + in.length) + ";";
+    case Opcode::BNE:   return "next = " + a + " != " + b + " ? " + hex(pc + in.imm) + " : " + hex(pc + in.length) + ";";
+    case Opcode::BLT:   return "next = int32_t(" + a + ") < int32_t(" + b + ") ? " + hex(pc + in.imm) + " : " + hex(pc + in.length) + ";";
+    case Opcode::BGE:   return "next = int32_t(" + a + ") >= int32_t(" + b + ") ? " + hex(pc + in.imm) + " : " + hex(pc + in.length) + ";";
+    case Opcode::BLTU:  return "next = " + a + " < " + b + " ? " + hex(pc + in.imm) + " : " + hex(pc + in.length) + ";";
+    case Opcode::BGEU:  return "next = " + a + " >= " + b + " ? " + hex(pc + in.imm) + " : " + hex(pc + in.length) + ";";
+
+    case Opcode::JAL: {
+        std::string link = in.rd == REG_ZERO_SINK ? "" : reg(in.rd) + " = " + hex(pc + in.length) + "; ";
+        return link + "next = " + hex(pc + in.imm) + ";";
+    }
+    case Opcode::JALR: {
+        std::string link = in.rd == REG_ZERO_SINK ? "" : reg(in.rd) + " = " + hex(pc + in.length) + "; ";
+        return "{ uint32_t target = (" + addr + ") & ~1u; " + link + "next = target; }";
+    }
+
+    default:
+        throw std::logic_error("Untranslatable opcode " + std::to_string(static_cast<int>(in.id)));
+    }
+
+    if (in.rd == REG_ZERO_SINK)
+        return "";
+    return reg(in.rd) + " = " + value + ";";
+}
+
+void generate(std::ostream& out, const std::vector<StaticBlock>& blocks, uint64_t text_hash) {
+
+    out << "// generated by Sim, static translation of RV32I blocks\n"
+        << "#include <cstddef>\n"
+        << "#include <cstdint>\n"
+        << "#include <cstring>\n\n"
+        << "template <typename T> static inline T ld(uint8_t* m, uint32_t a) { T v; std::memcpy(&v, m + a, sizeof(T)); return v; }\n"
+        << "template <typename T> static inline void st(uint8_t* m, uint32_t a, T v) { std::memcpy(m + a, &v, sizeof(T)); }\n"
+        << "static inline bool flag(uint8_t* m, uint32_t a) { return __atomic_load_n(m + std::ptrdiff_t(a >> " << PageFlags::PAGE_BITS
+        << ") - " << ReservedMemory::FLAGS_SIZE << ", __ATOMIC_RELAXED); }\n"
+        << "static inline bool flagged(uint8_t* m, uint32_t a, uint32_t s) { return flag(m, a) || flag(m, a + s - 1); }\n"
+        << "static inline uint32_t rol(uint32_t v, uint32_t s) { return (v << (s & 31)) | (v >> (-s & 31)); }\n"
+        << "static inline uint32_t ror(uint32_t v, uint32_t s) { return (v >> (s & 31)) | (v << (-s & 31)); }\n"
+        << "static inline uint32_t orc_b(uint32_t v) { uint32_t h = (((v & 0x7f7f7f7fu) + 0x7f7f7f7fu) | v) & 0x80808080u; "
+           "return (h - (h >> 7)) | h; }\n\n"
+        << "struct SimAotBlock { uint32_t pc; uint32_t (*native)(uint32_t*, uint8_t*); };\n\n";
+
+    for (const auto& block : blocks) {
+
+        std::set<uint8_t> used, written;
+        for (const auto& in : block.instrs) {
+            for (uint8_t r : {in.rs1, in.rs2, in.rd}) {
+                if (r != 0 && r != REG_ZERO_SINK)
+                    used.insert(r);
+            }
+            if (in.rd != REG_ZERO_SINK)
+                written.insert(in.rd);
+        }
+
+        out << "extern \"C\" uint32_t " << function_name(block.pc) << "(uint32_t* x, uint8_t* m) {\n";
+        for (uint8_t r : used)
+            out << "    uint32_t " << reg(r) << " = x[" << int(r) << "];\n";
+        out << "    uint32_t next = " << hex(block.end_pc) << ";\n";
+
+        uint32_t pc = block.pc;
+        for (const auto& in : block.instrs) {
+            std::string code = statement(in, pc);
+            if (!code.empty())
+                out << "    " << code << "\n";
+            pc += in.length;
+        }
+
+        out << "exit:\n";
+        for (uint8_t r : written)
+            out << "    x[" << int(r) << "] = " << reg(r) << ";\n";
+        out << "    return next;\n}\n\n";
+    }
+
+    out << "extern \"C\" const SimAotBlock sim_aot_blocks[] = {\n";
+    for (const auto& block : blocks)
+        out << "    {" << hex(block.pc) << ", " << function_name(block.pc) << "},\n";
+    out << "};\n\n"
+        << "extern \"C\" const uint32_t sim_aot_blocks_num = " << blocks.size() << ";\n"
+        << "extern \"C\" const uint64_t sim_aot_text_hash = " << text_hash << "ull;\n";
+}
+
+// runs the program of args[0] without a shell, so paths are passed as they are
+bool run_command(const std::vector<std::string>& args) {
+#ifdef HAS_AOT
+    std::vector<char*> argv;
+    for (const auto& arg : args)
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid < 0)
+        return false;
+    if (pid == 0) {
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            return false;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#else
+    (void)args;
+    return false;
+#endif
+}
+
+} // namespace
+
+size_t aot_compile(const std::string& elf_filename, const std::string& out_so) {
+
+    ELFIO::elfio reader;
+    load_guest_elf(reader, elf_filename);
+
+    Text text(reader);
+    std::vector<StaticBlock> blocks = discover(reader, text);
+
+    std::string source = out_so + ".cpp";
+    {
+        std::ofstream out(source);
+        if (!out.is_open()) {
+            throw std::runtime_error("Can't write " + source);
+        }
+        generate(out, blocks, aot_text_hash(reader));
+    }
+
+    const char* cxx = std::getenv("SIM_AOT_CXX");
+    std::vector<std::string> command = { cxx ? cxx : "c++", "-std=c++17", "-O2", "-shared", "-fPIC",
+                                         "-o", out_so, source };
+
+    if (!run_command(command)) {
+        std::string line;
+        for (const auto& arg : command)
+            line += (line.empty() ? "" : " ") + arg;
+        throw std::runtime_error("Compilation failed: " + line);
+    }
+
+    return blocks.size();
+}
+
+void AotLibrary::invalidate(uint32_t begin, uint32_t end) {
+    // a block covers at most MAX_BLOCK_LENGTH instructions after its pc
+    uint32_t first = begin - std::min<uint32_t>(begin, 4 * BlockCache::MAX_BLOCK_LENGTH);
+
+    for (auto it = blocks.begin(); it != blocks.end();) {
+        if (it->first >= first && it->first < end)
+            it = blocks.erase(it);
+        else
+            ++it;
+    }
+}
+
+#ifdef HAS_AOT
+
+AotLibrary::~AotLibrary() {
+    if (library)
+        dlclose(library);
+}
+
+void AotLibrary::open(const std::string& path, uint64_t text_hash) {
+
+    // dlopen searches the library path for names without a slash
+    std::string file = path.find('/') == std::string::npos ? "./" + path : path;
+
+    void* handle = dlopen(file.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        throw std::runtime_error("Can't load " + path + ": " + dlerror());
+    }
+
+    auto hash = static_cast<const uint64_t*>(dlsym(handle, "sim_aot_text_hash"));
+    auto table = static_cast<const AotBlock*>(dlsym(handle, "sim_aot_blocks"));
+    auto num = static_cast<const uint32_t*>(dlsym(handle, "sim_aot_blocks_num"));
+
+    if (!hash || !table || !num || *hash != text_hash) {
+        dlclose(handle);
+        throw std::runtime_error(path + " is not a translation of this ELF");
+    }
+
+    if (library)
+        dlclose(library);
+    library = handle;
+
+    blocks.clear();
+    for (uint32_t i = 0; i < *num; ++i)
+        blocks[table[i].pc] = table[i].native;
+}
+
+#else
+
+AotLibrary::~AotLibrary() {}
+
+void AotLibrary::open(const std::string& path, uint64_t) {
+    throw std::runtime_error("Can't load " + path + ": shared objects are not supported on this platform");
+}
+
+#endif
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+#include "block_cache.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAS_AOT
+#endif
+
+namespace ELFIO {
+class elfio;
+}
+
+// Hash of the executable PT_LOAD segments, ties a translated library to its ELF
+uint64_t aot_text_hash(const ELFIO::elfio& reader);
+
+// Static translation of an ELF: every basic block reachable from the entry point
+// and function symbols is translated to C++, compiled by the host compiler
+// ($SIM_AOT_CXX or c++, a program name without arguments) into the shared object out_so.
+// Returns the number of translated blocks.
+size_t aot_compile(const std::string& elf_filename, const std::string& out_so);
+
+// Shared object produced by aot_compile, blocks are looked up by their start pc
+class AotLibrary final {
+
+public:
+
+    AotLibrary() = default;
+    ~AotLibrary();
+
+    AotLibrary(const AotLibrary&) = delete;
+    AotLibrary& operator=(const AotLibrary&) = delete;
+
+public:
+
+    // throws if the library can't be loaded or was built for another ELF
+    void open(const std::string& path, uint64_t text_hash);
+
+    NativeBlock find(uint32_t pc) const {
+        if (blocks.empty())
+            return nullptr;
+        auto it = blocks.find(pc);
+        return it == blocks.end() ? nullptr : it->second;
+    }
+
+    size_t size() const { return blocks.size(); }
+
+    // code in [begin, end) was modified, blocks which may cover it are not used any more
+    void invalidate(uint32_t begin, uint32_t end);
+
+private:
+
+    void* library = nullptr;
+    std::unordered_map<uint32_t, NativeBlock> blocks;
+};
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "opdefs.hpp"
+
+// translated block, takes register file and guest memory base, returns next pc
+using NativeBlock = uint32_t (*)(uint32_t* registers, uint8_t* memory);
+
+// Decoded basic block, its instructions are stored contiguously in the arena of BlockCache
+struct Block {
+    uint32_t pc = 1;        // guest address of the first instruction, odd value means empty slot
+    uint32_t end_pc = 1;    // guest address after the last instruction
+    uint32_t first = 0;     // index of the first instruction in the arena
+    uint32_t length = 0;    // number of guest instructions
+    uint32_t size = 0;      // number of entries in the arena, less than length if pairs were fused
+
+    // Successors patched the first time an exit is taken: next[1] is the fall-through block,
+    // next[0] the taken branch or jump target, for JALR it works as a one-entry target cache.
+    // A link is valid only while the pc of the linked block matches the new pc,
+    // so evicted or flushed blocks are never entered through stale links.
+    Block* next[2] = {};
+
+    // tiering: executions in the interpreter and the translated code, if any
+    uint32_t exec_count = 0;
+    NativeBlock native = nullptr;
+
+    static constexpr int link_index(const Block& block, uint32_t next_pc) {
+        return next_pc == block.end_pc;
+    }
+};
+
+// Direct-mapped cache of decoded blocks indexed by pc >> 1,
+// with compressed instructions a block may start at any halfword.
+// Instructions of all blocks are appended to one preallocated arena,
+// when it runs out the whole cache is flushed. Blocks evicted by a conflict
+// keep their arena space until the next flush.
+// Every guest page remembers the blocks decoded from it, so a store to code
+// invalidates just the blocks it overlaps.
+class BlockCache final {
+
+public:
+
+    static constexpr uint32_t INVALID_PC = 1;
+
+    static constexpr size_t BLOCKS_NUM = 1 << 15;
+    static constexpr size_t ARENA_SIZE = 1 << 20;
+
+    // longer straight-line code is split in several blocks
+    static constexpr size_t MAX_BLOCK_LENGTH = 256;
+
+    static constexpr uint32_t PAGE_BITS = 12;
+
+public:
+
+    BlockCache() : blocks(BLOCKS_NUM) {
+        // only reserved, pages are touched as blocks are decoded
+        arena.reserve(ARENA_SIZE);
+    }
+
+public:
+
+    Block* find(uint32_t pc) {
+        Block& block = blocks[(pc >> 1) % BLOCKS_NUM];
+        return block.pc == pc ? &block : nullptr;
+    }
+
+    // starts a new block in the slot of pc, replacing the block cached there
+    Block& open(uint32_t pc) {
+        // room for the longest block and its terminator
+        if (arena.size() + MAX_BLOCK_LENGTH + 1 > arena.capacity()) {
+            flush();
+        }
+
+        Block& block = blocks[(pc >> 1) % BLOCKS_NUM];
+        block.pc = pc;
+        block.end_pc = pc;
+        block.first = static_cast<uint32_t>(arena.size());
+        block.length = 0;
+        block.size = 0;
+        block.next[0] = block.next[1] = &unlinked;
+        block.exec_count = 0;
+        block.native = nullptr;
+        return block;
+    }
+
+    void append(Block& block, const Instruction& instr) {
+        arena.push_back(instr);
+        ++block.length;
+        ++block.size;
+        block.end_pc += instr.length;
+    }
+
+    // drops the tail of the last opened block after its entries were rewritten in place
+    void shrink(Block& block, uint32_t size) {
+        block.size = size;
+        arena.resize(block.first + size);
+    }
+
+    // entry placed after the last instruction of a block, not counted in its length
+    void terminate(const Instruction& terminator) {
+        arena.push_back(terminator);
+    }
+
+    const Instruction* instructions(const Block& block) const {
+        return arena.data() + block.first;
+    }
+
+    Instruction* instructions(const Block& block) {
+        return arena.data() + block.first;
+    }
+
+    // guest instructions of the block from pc to its end
+    uint32_t length_from(const Block& block, uint32_t pc) const {
+        uint32_t length = block.length;
+        for (const Instruction* in = instructions(block); block.pc + in->offset < pc; ++in)
+            length -= in->first_length ? 2 : 1;
+        return length;
+    }
+
+    // native code of all blocks is gone, they are interpreted and counted again
+    void drop_native() {
+        for (auto& block : blocks) {
+            block.exec_count = 0;
+            block.native = nullptr;
+        }
+    }
+
+    // records the pages the block was decoded from, calls new_page(page) for every page
+    template <typename NewPage>
+    void track(const Block& block, NewPage&& new_page) {
+        for (uint32_t page = block.pc >> PAGE_BITS; page <= (block.end_pc - 1) >> PAGE_BITS; ++page) {
+            auto& pcs = code_pages[page];
+            if (std::find(pcs.begin(), pcs.end(), block.pc) == pcs.end())
+                pcs.push_back(block.pc);
+            new_page(page);
+        }
+    }
+
+    // Drops the blocks overlapping [addr, addr + size), links to them die with their pc.
+    // Entries of evicted blocks are dropped on the way, calls released_page(page)
+    // for every page which is left without blocks.
+    template <typename ReleasedPage>
+    void invalidate(uint32_t addr, uint32_t size, ReleasedPage&& released_page) {
+        uint64_t end = uint64_t(addr) + size;
+
+        for (uint32_t page = addr >> PAGE_BITS; page <= (end - 1) >> PAGE_BITS; ++page) {
+            auto it = code_pages.find(page);
+            if (it == code_pages.end()) {
+                released_page(page);
+                continue;
+            }
+
+            auto& pcs = it->second;
+            pcs.erase(std::remove_if(pcs.begin(), pcs.end(), [&](uint32_t pc) {
+                Block* block = find(pc);
+                if (!block)
+                    return true;
+                if (block->pc < end && addr < block->end_pc) {
+                    block->pc = INVALID_PC;
+                    return true;
+                }
+                return false;
+            }), pcs.end());
+
+            if (pcs.empty()) {
+                code_pages.erase(it);
+                released_page(page);
+            }
+        }
+    }
+
+    void flush() {
+        for (auto& block : blocks) {
+            block.pc = INVALID_PC;
+        }
+        arena.clear();
+        code_pages.clear();
+    }
+
+private:
+
+    // target of links which were never patched, never matches any pc
+    static inline Block unlinked = {};
+
+    std::vector<Block> blocks;
+    std::vector<Instruction> arena;
+
+    // guest page -> start pcs of the blocks decoded from it
+    std::unordered_map<uint32_t, std::vector<uint32_t>> code_pages;
+};
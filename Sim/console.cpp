@@ -0,0 +1,78 @@
+#include "console.hpp"
+
+#include <cstring>
+#include <utility>
+
+#include "syscalls.hpp"
+
+#ifdef HAS_HOST_SYSCALLS
+#include <unistd.h>
+#else
+#include <cstdio>
+#endif
+
+// partial writes are retried, failures are dropped as stdio drops them
+static void write_all(int fd, const char* data, size_t size) {
+#ifdef HAS_HOST_SYSCALLS
+    while (size) {
+        ssize_t done = ::write(fd, data, size);
+        if (done <= 0)
+            return;
+        data += done;
+        size -= static_cast<size_t>(done);
+    }
+#else
+    std::fwrite(data, 1, size, fd == 2 ? stderr : stdout);
+#endif
+}
+
+Console::Console(ConsoleBuffering buffering, Sink sink) :
+    sink(std::move(sink)),
+    buffer(std::make_unique<char[]>(CAPACITY))
+{
+    if (buffering == ConsoleBuffering::Auto) {
+#ifdef HAS_HOST_SYSCALLS
+        buffering = isatty(1) ? ConsoleBuffering::Line : ConsoleBuffering::Full;
+#else
+        buffering = ConsoleBuffering::Line;
+#endif
+    }
+    line_buffered = buffering == ConsoleBuffering::Line;
+}
+
+Console::~Console() {
+    flush();
+}
+
+void Console::write(int fd, const uint8_t* data, size_t size) {
+
+    if (sink) {
+        sink(fd, reinterpret_cast<const char*>(data), size);
+        return;
+    }
+
+    if (fd != buffered_fd) {
+        flush();
+        buffered_fd = fd;
+    }
+
+    if (used + size > CAPACITY)
+        flush();
+
+    const char* chars = reinterpret_cast<const char*>(data);
+    if (size >= CAPACITY) {
+        write_all(fd, chars, size);
+        return;
+    }
+
+    std::memcpy(buffer.get() + used, chars, size);
+    used += size;
+
+    if (line_buffered && std::memchr(chars, '\n', size))
+        flush();
+}
+
+void Console::flush() {
+    write_all(buffered_fd, buffer.get(), used);
+    used = 0;
+}
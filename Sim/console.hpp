@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+enum class ConsoleBuffering {
+    Auto,   // Line on a terminal, Full otherwise, as C stdio does
+    Line,   // also flushed at every newline
+    Full,   // flushed when full, before the guest reads stdin and when the hart halts
+};
+
+// Guest writes to the console, host descriptors 1 and 2, gathered in one host buffer,
+// so guests printing a little at a time cost a host write per CAPACITY bytes instead of
+// one per write call. Switching between the descriptors flushes, which keeps their order.
+// With a sink the output goes there as it is written instead, e.g. to keep guests running
+// side by side apart.
+class Console final {
+
+public:
+
+    static constexpr size_t CAPACITY = 64 * 1024;
+
+    using Sink = std::function<void(int fd, const char* data, size_t size)>;
+
+public:
+
+    explicit Console(ConsoleBuffering buffering = ConsoleBuffering::Auto, Sink sink = {});
+    ~Console();
+
+    Console(const Console&) = delete;
+    Console& operator=(const Console&) = delete;
+
+public:
+
+    // writes larger than the buffer go to the host right away
+    void write(int fd, const uint8_t* data, size_t size);
+    void flush();
+
+private:
+
+    Sink sink;
+    std::unique_ptr<char[]> buffer;
+    size_t used = 0;
+    int buffered_fd = 1;
+    bool line_buffered = false;
+};
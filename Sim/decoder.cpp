@@ -0,0 +1,752 @@
+#include "decoder.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <thread>
+
+#include "helper.hpp"
+
+namespace {
+
+// operand layout of an encoding
+// FP is R with the rounding mode in imm, R4 adds rs3, CSR has the CSR in imm and uimm in imm2.
+// V is vd, vs1 or rs1, vs2 or rs2 and the mask flag in imm2, VI the same with simm5 in imm and rs1 = x0,
+// VSTORE has vs3 in rs3, VSET and VSETI have vtype in imm and the AVL in imm2.
+enum class Format { R, I, SHIFT, S, B, U, J, SYSTEM, FP, R4, CSR, V, VI, VSTORE, VSET, VSETI };
+
+struct Encoding {
+    Opcode id;
+    uint32_t mask;
+    uint32_t match;
+    Format format;
+};
+
+constexpr uint32_t MASK_OPCODE = get_mask<6, 0>();
+constexpr uint32_t MASK_FUNCT3 = MASK_OPCODE | get_mask<14, 12>();
+constexpr uint32_t MASK_FUNCT7 = MASK_FUNCT3 | get_mask<31, 25>();
+constexpr uint32_t MASK_ALL = ~0u;
+
+// funct3 of most floating point instructions is the rounding mode, some of them select by rs2
+constexpr uint32_t MASK_FP = MASK_OPCODE | get_mask<31, 25>();
+constexpr uint32_t MASK_FP_RS2 = MASK_FP | get_mask<24, 20>();
+constexpr uint32_t MASK_FUNCT7_RS2 = MASK_FUNCT7 | get_mask<24, 20>();
+constexpr uint32_t MASK_FMT = MASK_OPCODE | get_mask<26, 25>();
+
+// atomics select by funct5, aq and rl are left out
+constexpr uint32_t MASK_AMO = MASK_FUNCT3 | get_mask<31, 27>();
+constexpr uint32_t MASK_AMO_RS2 = MASK_AMO | get_mask<24, 20>();
+
+// vector instructions select by funct6, vm is an operand; loads and stores by nf, mew, mop and lumop
+constexpr uint32_t MASK_FUNCT6 = MASK_FUNCT3 | get_mask<31, 26>();
+constexpr uint32_t MASK_VMV = MASK_FUNCT6 | get_mask<25, 20>();
+constexpr uint32_t MASK_VMV_X_S = MASK_FUNCT6 | get_mask<25, 25>() | get_mask<19, 15>();
+constexpr uint32_t MASK_VMEM = MASK_FUNCT3 | get_mask<31, 26>();
+constexpr uint32_t MASK_VMEM_UNIT = MASK_VMEM | get_mask<24, 20>();
+constexpr uint32_t MASK_VSETVLI = MASK_FUNCT3 | get_mask<31, 31>();
+constexpr uint32_t MASK_VSETIVLI = MASK_FUNCT3 | get_mask<31, 30>();
+
+// When several encodings share a key of the decode table the more specific one goes first
+constexpr Encoding encodings[] = {
+    {Opcode::LUI,   MASK_OPCODE, 0x00000037, Format::U},
+    {Opcode::AUIPC, MASK_OPCODE, 0x00000017, Format::U},
+    {Opcode::JAL,   MASK_OPCODE, 0x0000006f, Format::J},
+    {Opcode::JALR,  MASK_FUNCT3, 0x00000067, Format::I},
+
+    {Opcode::BEQ,   MASK_FUNCT3, 0x00000063, Format::B},
+    {Opcode::BNE,   MASK_FUNCT3, 0x00001063, Format::B},
+    {Opcode::BLT,   MASK_FUNCT3, 0x00004063, Format::B},
+    {Opcode::BGE,   MASK_FUNCT3, 0x00005063, Format::B},
+    {Opcode::BLTU,  MASK_FUNCT3, 0x00006063, Format::B},
+    {Opcode::BGEU,  MASK_FUNCT3, 0x00007063, Format::B},
+
+    {Opcode::LB,    MASK_FUNCT3, 0x00000003, Format::I},
+    {Opcode::LH,    MASK_FUNCT3, 0x00001003, Format::I},
+    {Opcode::LW,    MASK_FUNCT3, 0x00002003, Format::I},
+    {Opcode::LBU,   MASK_FUNCT3, 0x00004003, Format::I},
+    {Opcode::LHU,   MASK_FUNCT3, 0x00005003, Format::I},
+
+    {Opcode::SB,    MASK_FUNCT3, 0x00000023, Format::S},
+    {Opcode::SH,    MASK_FUNCT3, 0x00001023, Format::S},
+    {Opcode::SW,    MASK_FUNCT3, 0x00002023, Format::S},
+
+    {Opcode::ADDI,  MASK_FUNCT3, 0x00000013, Format::I},
+    {Opcode::SLTI,  MASK_FUNCT3, 0x00002013, Format::I},
+    {Opcode::SLTIU, MASK_FUNCT3, 0x00003013, Format::I},
+    {Opcode::XORI,  MASK_FUNCT3, 0x00004013, Format::I},
+    {Opcode::ORI,   MASK_FUNCT3, 0x00006013, Format::I},
+    {Opcode::ANDI,  MASK_FUNCT3, 0x00007013, Format::I},
+    {Opcode::SLLI,  MASK_FUNCT7, 0x00001013, Format::SHIFT},
+    {Opcode::SRLI,  MASK_FUNCT7, 0x00005013, Format::SHIFT},
+    {Opcode::SRAI,  MASK_FUNCT7, 0x40005013, Format::SHIFT},
+
+    {Opcode::ADD,   MASK_FUNCT7, 0x00000033, Format::R},
+    {Opcode::SUB,   MASK_FUNCT7, 0x40000033, Format::R},
+    {Opcode::SLL,   MASK_FUNCT7, 0x00001033, Format::R},
+    {Opcode::SLT,   MASK_FUNCT7, 0x00002033, Format::R},
+    {Opcode::SLTU,  MASK_FUNCT7, 0x00003033, Format::R},
+    {Opcode::XOR,   MASK_FUNCT7, 0x00004033, Format::R},
+    {Opcode::SRL,   MASK_FUNCT7, 0x00005033, Format::R},
+    {Opcode::SRA,   MASK_FUNCT7, 0x40005033, Format::R},
+    {Opcode::OR,    MASK_FUNCT7, 0x00006033, Format::R},
+    {Opcode::AND,   MASK_FUNCT7, 0x00007033, Format::R},
+
+    {Opcode::MUL,    MASK_FUNCT7, 0x02000033, Format::R},
+    {Opcode::MULH,   MASK_FUNCT7, 0x02001033, Format::R},
+    {Opcode::MULHSU, MASK_FUNCT7, 0x02002033, Format::R},
+    {Opcode::MULHU,  MASK_FUNCT7, 0x02003033, Format::R},
+    {Opcode::DIV,    MASK_FUNCT7, 0x02004033, Format::R},
+    {Opcode::DIVU,   MASK_FUNCT7, 0x02005033, Format::R},
+    {Opcode::REM,    MASK_FUNCT7, 0x02006033, Format::R},
+    {Opcode::REMU,   MASK_FUNCT7, 0x02007033, Format::R},
+
+    // Zba, Zbb and Zbs, the unary ones take rd and rs1 of the I format
+    {Opcode::SH1ADD, MASK_FUNCT7, 0x20002033, Format::R},
+    {Opcode::SH2ADD, MASK_FUNCT7, 0x20004033, Format::R},
+    {Opcode::SH3ADD, MASK_FUNCT7, 0x20006033, Format::R},
+    {Opcode::ANDN,   MASK_FUNCT7, 0x40007033, Format::R},
+    {Opcode::ORN,    MASK_FUNCT7, 0x40006033, Format::R},
+    {Opcode::XNOR,   MASK_FUNCT7, 0x40004033, Format::R},
+    {Opcode::MIN,    MASK_FUNCT7, 0x0a004033, Format::R},
+    {Opcode::MINU,   MASK_FUNCT7, 0x0a005033, Format::R},
+    {Opcode::MAX,    MASK_FUNCT7, 0x0a006033, Format::R},
+    {Opcode::MAXU,   MASK_FUNCT7, 0x0a007033, Format::R},
+    {Opcode::ROL,    MASK_FUNCT7, 0x60001033, Format::R},
+    {Opcode::ROR,    MASK_FUNCT7, 0x60005033, Format::R},
+    {Opcode::RORI,   MASK_FUNCT7, 0x60005013, Format::SHIFT},
+    {Opcode::CLZ,    MASK_FUNCT7_RS2, 0x60001013, Format::I},
+    {Opcode::CTZ,    MASK_FUNCT7_RS2, 0x60101013, Format::I},
+    {Opcode::CPOP,   MASK_FUNCT7_RS2, 0x60201013, Format::I},
+    {Opcode::SEXT_B, MASK_FUNCT7_RS2, 0x60401013, Format::I},
+    {Opcode::SEXT_H, MASK_FUNCT7_RS2, 0x60501013, Format::I},
+    {Opcode::ZEXT_H, MASK_FUNCT7_RS2, 0x08004033, Format::I},
+    {Opcode::ORC_B,  MASK_FUNCT7_RS2, 0x28705013, Format::I},
+    {Opcode::REV8,   MASK_FUNCT7_RS2, 0x69805013, Format::I},
+    {Opcode::BCLR,   MASK_FUNCT7, 0x48001033, Format::R},
+    {Opcode::BEXT,   MASK_FUNCT7, 0x48005033, Format::R},
+    {Opcode::BINV,   MASK_FUNCT7, 0x68001033, Format::R},
+    {Opcode::BSET,   MASK_FUNCT7, 0x28001033, Format::R},
+    {Opcode::BCLRI,  MASK_FUNCT7, 0x48001013, Format::SHIFT},
+    {Opcode::BEXTI,  MASK_FUNCT7, 0x48005013, Format::SHIFT},
+    {Opcode::BINVI,  MASK_FUNCT7, 0x68001013, Format::SHIFT},
+    {Opcode::BSETI,  MASK_FUNCT7, 0x28001013, Format::SHIFT},
+
+    {Opcode::LR_W,      MASK_AMO_RS2, 0x1000202f, Format::R},
+    {Opcode::SC_W,      MASK_AMO, 0x1800202f, Format::R},
+    {Opcode::AMOSWAP_W, MASK_AMO, 0x0800202f, Format::R},
+    {Opcode::AMOADD_W,  MASK_AMO, 0x0000202f, Format::R},
+    {Opcode::AMOXOR_W,  MASK_AMO, 0x2000202f, Format::R},
+    {Opcode::AMOAND_W,  MASK_AMO, 0x6000202f, Format::R},
+    {Opcode::AMOOR_W,   MASK_AMO, 0x4000202f, Format::R},
+    {Opcode::AMOMIN_W,  MASK_AMO, 0x8000202f, Format::R},
+    {Opcode::AMOMAX_W,  MASK_AMO, 0xa000202f, Format::R},
+    {Opcode::AMOMINU_W, MASK_AMO, 0xc000202f, Format::R},
+    {Opcode::AMOMAXU_W, MASK_AMO, 0xe000202f, Format::R},
+
+    {Opcode::FLW,       MASK_FUNCT3, 0x00002007, Format::I},
+    {Opcode::FLD,       MASK_FUNCT3, 0x00003007, Format::I},
+    {Opcode::FSW,       MASK_FUNCT3, 0x00002027, Format::S},
+    {Opcode::FSD,       MASK_FUNCT3, 0x00003027, Format::S},
+
+    {Opcode::FMADD_S,   MASK_FMT, 0x00000043, Format::R4},
+    {Opcode::FMADD_D,   MASK_FMT, 0x02000043, Format::R4},
+    {Opcode::FMSUB_S,   MASK_FMT, 0x00000047, Format::R4},
+    {Opcode::FMSUB_D,   MASK_FMT, 0x02000047, Format::R4},
+    {Opcode::FNMSUB_S,  MASK_FMT, 0x0000004b, Format::R4},
+    {Opcode::FNMSUB_D,  MASK_FMT, 0x0200004b, Format::R4},
+    {Opcode::FNMADD_S,  MASK_FMT, 0x0000004f, Format::R4},
+    {Opcode::FNMADD_D,  MASK_FMT, 0x0200004f, Format::R4},
+
+    {Opcode::FADD_S,    MASK_FP, 0x00000053, Format::FP},
+    {Opcode::FADD_D,    MASK_FP, 0x02000053, Format::FP},
+    {Opcode::FSUB_S,    MASK_FP, 0x08000053, Format::FP},
+    {Opcode::FSUB_D,    MASK_FP, 0x0a000053, Format::FP},
+    {Opcode::FMUL_S,    MASK_FP, 0x10000053, Format::FP},
+    {Opcode::FMUL_D,    MASK_FP, 0x12000053, Format::FP},
+    {Opcode::FDIV_S,    MASK_FP, 0x18000053, Format::FP},
+    {Opcode::FDIV_D,    MASK_FP, 0x1a000053, Format::FP},
+    {Opcode::FSQRT_S,   MASK_FP_RS2, 0x58000053, Format::FP},
+    {Opcode::FSQRT_D,   MASK_FP_RS2, 0x5a000053, Format::FP},
+
+    {Opcode::FSGNJ_S,   MASK_FUNCT7, 0x20000053, Format::R},
+    {Opcode::FSGNJN_S,  MASK_FUNCT7, 0x20001053, Format::R},
+    {Opcode::FSGNJX_S,  MASK_FUNCT7, 0x20002053, Format::R},
+    {Opcode::FSGNJ_D,   MASK_FUNCT7, 0x22000053, Format::R},
+    {Opcode::FSGNJN_D,  MASK_FUNCT7, 0x22001053, Format::R},
+    {Opcode::FSGNJX_D,  MASK_FUNCT7, 0x22002053, Format::R},
+    {Opcode::FMIN_S,    MASK_FUNCT7, 0x28000053, Format::R},
+    {Opcode::FMAX_S,    MASK_FUNCT7, 0x28001053, Format::R},
+    {Opcode::FMIN_D,    MASK_FUNCT7, 0x2a000053, Format::R},
+    {Opcode::FMAX_D,    MASK_FUNCT7, 0x2a001053, Format::R},
+
+    {Opcode::FCVT_S_D,  MASK_FP_RS2, 0x40100053, Format::FP},
+    {Opcode::FCVT_D_S,  MASK_FP_RS2, 0x42000053, Format::FP},
+    {Opcode::FCVT_W_S,  MASK_FP_RS2, 0xc0000053, Format::FP},
+    {Opcode::FCVT_WU_S, MASK_FP_RS2, 0xc0100053, Format::FP},
+    {Opcode::FCVT_W_D,  MASK_FP_RS2, 0xc2000053, Format::FP},
+    {Opcode::FCVT_WU_D, MASK_FP_RS2, 0xc2100053, Format::FP},
+    {Opcode::FCVT_S_W,  MASK_FP_RS2, 0xd0000053, Format::FP},
+    {Opcode::FCVT_S_WU, MASK_FP_RS2, 0xd0100053, Format::FP},
+    {Opcode::FCVT_D_W,  MASK_FP_RS2, 0xd2000053, Format::FP},
+    {Opcode::FCVT_D_WU, MASK_FP_RS2, 0xd2100053, Format::FP},
+
+    {Opcode::FLE_S,     MASK_FUNCT7, 0xa0000053, Format::R},
+    {Opcode::FLT_S,     MASK_FUNCT7, 0xa0001053, Format::R},
+    {Opcode::FEQ_S,     MASK_FUNCT7, 0xa0002053, Format::R},
+    {Opcode::FLE_D,     MASK_FUNCT7, 0xa2000053, Format::R},
+    {Opcode::FLT_D,     MASK_FUNCT7, 0xa2001053, Format::R},
+    {Opcode::FEQ_D,     MASK_FUNCT7, 0xa2002053, Format::R},
+    {Opcode::FMV_X_W,   MASK_FUNCT7_RS2, 0xe0000053, Format::R},
+    {Opcode::FCLASS_S,  MASK_FUNCT7_RS2, 0xe0001053, Format::R},
+    {Opcode::FCLASS_D,  MASK_FUNCT7_RS2, 0xe2001053, Format::R},
+    {Opcode::FMV_W_X,   MASK_FUNCT7_RS2, 0xf0000053, Format::R},
+
+    // FENCE.TSO and PAUSE are FENCE encodings and execute as a full FENCE, FENCE.I is Zifencei
+    {Opcode::FENCE, MASK_FUNCT3, 0x0000000f, Format::I},
+    {Opcode::FENCE_I, MASK_FUNCT3, 0x0000100f, Format::I},
+
+    {Opcode::ECALL,  MASK_ALL,   0x00000073, Format::SYSTEM},
+    {Opcode::EBREAK, MASK_ALL,   0x00100073, Format::SYSTEM},
+
+    {Opcode::CSRRW,  MASK_FUNCT3, 0x00001073, Format::CSR},
+    {Opcode::CSRRS,  MASK_FUNCT3, 0x00002073, Format::CSR},
+    {Opcode::CSRRC,  MASK_FUNCT3, 0x00003073, Format::CSR},
+    {Opcode::CSRRWI, MASK_FUNCT3, 0x00005073, Format::CSR},
+    {Opcode::CSRRSI, MASK_FUNCT3, 0x00006073, Format::CSR},
+    {Opcode::CSRRCI, MASK_FUNCT3, 0x00007073, Format::CSR},
+
+    // V subset, .vi forms decode to .vx ones reading x0 plus the immediate
+    {Opcode::VSETVLI,      MASK_VSETVLI, 0x00007057, Format::VSET},
+    {Opcode::VSETIVLI,     MASK_VSETIVLI, 0xc0007057, Format::VSETI},
+    {Opcode::VSETVL,       MASK_FUNCT7, 0x80007057, Format::VSET},
+    {Opcode::VLE8_V,       MASK_VMEM_UNIT, 0x00000007, Format::V},
+    {Opcode::VLE16_V,      MASK_VMEM_UNIT, 0x00005007, Format::V},
+    {Opcode::VLE32_V,      MASK_VMEM_UNIT, 0x00006007, Format::V},
+    {Opcode::VLSE8_V,      MASK_VMEM, 0x08000007, Format::V},
+    {Opcode::VLSE16_V,     MASK_VMEM, 0x08005007, Format::V},
+    {Opcode::VLSE32_V,     MASK_VMEM, 0x08006007, Format::V},
+    {Opcode::VSE8_V,       MASK_VMEM_UNIT, 0x00000027, Format::VSTORE},
+    {Opcode::VSE16_V,      MASK_VMEM_UNIT, 0x00005027, Format::VSTORE},
+    {Opcode::VSE32_V,      MASK_VMEM_UNIT, 0x00006027, Format::VSTORE},
+    {Opcode::VSSE8_V,      MASK_VMEM, 0x08000027, Format::VSTORE},
+    {Opcode::VSSE16_V,     MASK_VMEM, 0x08005027, Format::VSTORE},
+    {Opcode::VSSE32_V,     MASK_VMEM, 0x08006027, Format::VSTORE},
+    {Opcode::VADD_VV,      MASK_FUNCT6, 0x00000057, Format::V},
+    {Opcode::VADD_VX,      MASK_FUNCT6, 0x00004057, Format::V},
+    {Opcode::VADD_VX,      MASK_FUNCT6, 0x00003057, Format::VI},
+    {Opcode::VSUB_VV,      MASK_FUNCT6, 0x08000057, Format::V},
+    {Opcode::VSUB_VX,      MASK_FUNCT6, 0x08004057, Format::V},
+    {Opcode::VRSUB_VX,     MASK_FUNCT6, 0x0c004057, Format::V},
+    {Opcode::VRSUB_VX,     MASK_FUNCT6, 0x0c003057, Format::VI},
+    {Opcode::VMINU_VV,     MASK_FUNCT6, 0x10000057, Format::V},
+    {Opcode::VMINU_VX,     MASK_FUNCT6, 0x10004057, Format::V},
+    {Opcode::VMIN_VV,      MASK_FUNCT6, 0x14000057, Format::V},
+    {Opcode::VMIN_VX,      MASK_FUNCT6, 0x14004057, Format::V},
+    {Opcode::VMAXU_VV,     MASK_FUNCT6, 0x18000057, Format::V},
+    {Opcode::VMAXU_VX,     MASK_FUNCT6, 0x18004057, Format::V},
+    {Opcode::VMAX_VV,      MASK_FUNCT6, 0x1c000057, Format::V},
+    {Opcode::VMAX_VX,      MASK_FUNCT6, 0x1c004057, Format::V},
+    {Opcode::VAND_VV,      MASK_FUNCT6, 0x24000057, Format::V},
+    {Opcode::VAND_VX,      MASK_FUNCT6, 0x24004057, Format::V},
+    {Opcode::VAND_VX,      MASK_FUNCT6, 0x24003057, Format::VI},
+    {Opcode::VOR_VV,       MASK_FUNCT6, 0x28000057, Format::V},
+    {Opcode::VOR_VX,       MASK_FUNCT6, 0x28004057, Format::V},
+    {Opcode::VOR_VX,       MASK_FUNCT6, 0x28003057, Format::VI},
+    {Opcode::VXOR_VV,      MASK_FUNCT6, 0x2c000057, Format::V},
+    {Opcode::VXOR_VX,      MASK_FUNCT6, 0x2c004057, Format::V},
+    {Opcode::VXOR_VX,      MASK_FUNCT6, 0x2c003057, Format::VI},
+    {Opcode::VMSEQ_VV,     MASK_FUNCT6, 0x60000057, Format::V},
+    {Opcode::VMSEQ_VX,     MASK_FUNCT6, 0x60004057, Format::V},
+    {Opcode::VMSEQ_VX,     MASK_FUNCT6, 0x60003057, Format::VI},
+    {Opcode::VMSNE_VV,     MASK_FUNCT6, 0x64000057, Format::V},
+    {Opcode::VMSNE_VX,     MASK_FUNCT6, 0x64004057, Format::V},
+    {Opcode::VMSNE_VX,     MASK_FUNCT6, 0x64003057, Format::VI},
+    {Opcode::VMSLTU_VV,    MASK_FUNCT6, 0x68000057, Format::V},
+    {Opcode::VMSLTU_VX,    MASK_FUNCT6, 0x68004057, Format::V},
+    {Opcode::VMSLT_VV,     MASK_FUNCT6, 0x6c000057, Format::V},
+    {Opcode::VMSLT_VX,     MASK_FUNCT6, 0x6c004057, Format::V},
+    {Opcode::VMSLEU_VV,    MASK_FUNCT6, 0x70000057, Format::V},
+    {Opcode::VMSLEU_VX,    MASK_FUNCT6, 0x70004057, Format::V},
+    {Opcode::VMSLEU_VX,    MASK_FUNCT6, 0x70003057, Format::VI},
+    {Opcode::VMSLE_VV,     MASK_FUNCT6, 0x74000057, Format::V},
+    {Opcode::VMSLE_VX,     MASK_FUNCT6, 0x74004057, Format::V},
+    {Opcode::VMSLE_VX,     MASK_FUNCT6, 0x74003057, Format::VI},
+    {Opcode::VMSGTU_VX,    MASK_FUNCT6, 0x78004057, Format::V},
+    {Opcode::VMSGTU_VX,    MASK_FUNCT6, 0x78003057, Format::VI},
+    {Opcode::VMSGT_VX,     MASK_FUNCT6, 0x7c004057, Format::V},
+    {Opcode::VMSGT_VX,     MASK_FUNCT6, 0x7c003057, Format::VI},
+    {Opcode::VMUL_VV,      MASK_FUNCT6, 0x94002057, Format::V},
+    {Opcode::VMUL_VX,      MASK_FUNCT6, 0x94006057, Format::V},
+    {Opcode::VREDSUM_VS,   MASK_FUNCT6, 0x00002057, Format::V},
+    {Opcode::VREDAND_VS,   MASK_FUNCT6, 0x04002057, Format::V},
+    {Opcode::VREDOR_VS,    MASK_FUNCT6, 0x08002057, Format::V},
+    {Opcode::VREDXOR_VS,   MASK_FUNCT6, 0x0c002057, Format::V},
+    {Opcode::VREDMINU_VS,  MASK_FUNCT6, 0x10002057, Format::V},
+    {Opcode::VREDMIN_VS,   MASK_FUNCT6, 0x14002057, Format::V},
+    {Opcode::VREDMAXU_VS,  MASK_FUNCT6, 0x18002057, Format::V},
+    {Opcode::VREDMAX_VS,   MASK_FUNCT6, 0x1c002057, Format::V},
+    {Opcode::VMV_V_V,      MASK_VMV, 0x5e000057, Format::V},
+    {Opcode::VMV_V_X,      MASK_VMV, 0x5e004057, Format::V},
+    {Opcode::VMV_V_X,      MASK_VMV, 0x5e003057, Format::VI},
+    {Opcode::VMV_X_S,      MASK_VMV_X_S, 0x42002057, Format::V},
+    {Opcode::VMV_S_X,      MASK_VMV, 0x42006057, Format::V},
+};
+
+constexpr size_t ENCODINGS_NUM = sizeof(encodings) / sizeof(encodings[0]);
+constexpr uint8_t NO_ENCODING = 0xff;
+static_assert(ENCODINGS_NUM < NO_ENCODING);
+
+// Key of the decode table: opcode[6:2], funct3 and funct7 of the word.
+// 32-bit encodings always have opcode[1:0] = 0b11, it is checked by the match.
+constexpr size_t KEY_BITS = 15;
+
+constexpr uint32_t key(uint32_t word) {
+    return slice<6, 2>(word) | slice<14, 12>(word) << 5 | slice<31, 25>(word) << 8;
+}
+
+constexpr bool matches(const Encoding& encoding, uint32_t word) {
+    return (word & encoding.mask) == encoding.match;
+}
+
+// index of the first encoding agreeing with the key bits, or NO_ENCODING
+constexpr std::array<uint8_t, 1 << KEY_BITS> decode_table = [] {
+
+    std::array<uint8_t, 1 << KEY_BITS> table{};
+    for (auto& entry : table)
+        entry = NO_ENCODING;
+
+    // every key the encoding leaves free, earlier encodings overwrite later ones
+    for (size_t i = ENCODINGS_NUM; i-- > 0;) {
+        uint32_t base = key(encodings[i].match);
+        uint32_t free = (table.size() - 1) & ~key(encodings[i].mask);
+
+        uint32_t bits = 0;
+        do {
+            table[base | bits] = static_cast<uint8_t>(i);
+            bits = (bits - free) & free;
+        } while (bits);
+    }
+
+    return table;
+}();
+
+static_assert(encodings[decode_table[key(0x40005033)]].id == Opcode::SRA);
+static_assert(!matches(encodings[decode_table[key(0x00000000)]], 0x00000000));
+static_assert(encodings[decode_table[key(0x02b57543)]].id == Opcode::FMADD_D);
+static_assert(encodings[decode_table[key(0x02208057)]].id == Opcode::VADD_VV);
+static_assert(encodings[decode_table[key(0x60101013)]].id == Opcode::CLZ);
+static_assert(encodings[decode_table[key(0x0655202f)]].id == Opcode::AMOADD_W);
+
+constexpr int32_t sign_extend(uint32_t value, unsigned bits) {
+    return static_cast<int32_t>(value << (32 - bits)) >> (32 - bits);
+}
+
+// 32-bit encodings the compressed instructions expand to
+
+constexpr uint32_t encode_r(uint32_t match, uint32_t rd, uint32_t rs1, uint32_t rs2) {
+    return match | rd << 7 | rs1 << 15 | rs2 << 20;
+}
+
+constexpr uint32_t encode_i(uint32_t match, uint32_t rd, uint32_t rs1, int32_t imm) {
+    return match | rd << 7 | rs1 << 15 | static_cast<uint32_t>(imm) << 20;
+}
+
+constexpr uint32_t encode_s(uint32_t match, uint32_t rs1, uint32_t rs2, int32_t imm) {
+    uint32_t bits = static_cast<uint32_t>(imm);
+    return match | slice<4, 0>(bits) << 7 | rs1 << 15 | rs2 << 20 | slice<11, 5>(bits) << 25;
+}
+
+constexpr uint32_t encode_b(uint32_t match, uint32_t rs1, uint32_t rs2, int32_t imm) {
+    uint32_t bits = static_cast<uint32_t>(imm);
+    return match | slice<11, 11>(bits) << 7 | slice<4, 1>(bits) << 8 | rs1 << 15 | rs2 << 20 |
+           slice<10, 5>(bits) << 25 | slice<12, 12>(bits) << 31;
+}
+
+constexpr uint32_t encode_j(uint32_t match, uint32_t rd, int32_t imm) {
+    uint32_t bits = static_cast<uint32_t>(imm);
+    return match | rd << 7 | slice<19, 12>(bits) << 12 | slice<11, 11>(bits) << 20 |
+           slice<10, 1>(bits) << 21 | slice<20, 20>(bits) << 31;
+}
+
+constexpr uint32_t MATCH_ADDI = 0x00000013;
+constexpr uint32_t MATCH_LW   = 0x00002003;
+constexpr uint32_t MATCH_SW   = 0x00002023;
+constexpr uint32_t MATCH_FLW  = 0x00002007;
+constexpr uint32_t MATCH_FSW  = 0x00002027;
+constexpr uint32_t MATCH_FLD  = 0x00003007;
+constexpr uint32_t MATCH_FSD  = 0x00003027;
+constexpr uint32_t MATCH_JAL  = 0x0000006f;
+constexpr uint32_t MATCH_JALR = 0x00000067;
+constexpr uint32_t MATCH_BEQ  = 0x00000063;
+constexpr uint32_t MATCH_BNE  = 0x00001063;
+constexpr uint32_t MATCH_LUI  = 0x00000037;
+constexpr uint32_t MATCH_SLLI = 0x00001013;
+constexpr uint32_t MATCH_SRLI = 0x00005013;
+constexpr uint32_t MATCH_SRAI = 0x40005013;
+constexpr uint32_t MATCH_ANDI = 0x00007013;
+constexpr uint32_t MATCH_ADD  = 0x00000033;
+constexpr uint32_t MATCH_SUB  = 0x40000033;
+constexpr uint32_t MATCH_XOR  = 0x00004033;
+constexpr uint32_t MATCH_OR   = 0x00006033;
+constexpr uint32_t MATCH_AND  = 0x00007033;
+constexpr uint32_t MATCH_EBREAK = 0x00100073;
+
+// reserved and unsupported encodings, decodes to NONE
+constexpr uint32_t ILLEGAL = 0;
+
+// x8-x15 addressed by the 3-bit register fields
+constexpr uint32_t reg_prime(uint32_t field) {
+    return field + 8;
+}
+
+// RV32C instruction to its 32-bit equivalent
+constexpr uint32_t expand_compressed(uint32_t half) {
+
+    uint32_t rd = slice<11, 7>(half);
+    uint32_t rs2 = slice<6, 2>(half);
+    uint32_t rd_prime = reg_prime(slice<4, 2>(half));
+    uint32_t rs1_prime = reg_prime(slice<9, 7>(half));
+
+    int32_t imm6 = sign_extend(slice<12, 12>(half) << 5 | slice<6, 2>(half), 6);
+    int32_t jump = sign_extend(slice<12, 12>(half) << 11 | slice<11, 11>(half) << 4 | slice<10, 9>(half) << 8 |
+                               slice<8, 8>(half) << 10 | slice<7, 7>(half) << 6 | slice<6, 6>(half) << 7 |
+                               slice<5, 3>(half) << 1 | slice<2, 2>(half) << 5, 12);
+    int32_t branch = sign_extend(slice<12, 12>(half) << 8 | slice<11, 10>(half) << 3 | slice<6, 5>(half) << 6 |
+                                 slice<4, 3>(half) << 1 | slice<2, 2>(half) << 5, 9);
+    int32_t word_offset = static_cast<int32_t>(slice<12, 10>(half) << 3 | slice<6, 6>(half) << 2 | slice<5, 5>(half) << 6);
+    int32_t double_offset = static_cast<int32_t>(slice<12, 10>(half) << 3 | slice<6, 5>(half) << 6);
+    int32_t word_sp_load = static_cast<int32_t>(slice<12, 12>(half) << 5 | slice<6, 4>(half) << 2 | slice<3, 2>(half) << 6);
+    int32_t double_sp_load = static_cast<int32_t>(slice<12, 12>(half) << 5 | slice<6, 5>(half) << 3 | slice<4, 2>(half) << 6);
+    int32_t word_sp_store = static_cast<int32_t>(slice<12, 9>(half) << 2 | slice<8, 7>(half) << 6);
+    int32_t double_sp_store = static_cast<int32_t>(slice<12, 10>(half) << 3 | slice<9, 7>(half) << 6);
+
+    switch (slice<1, 0>(half) << 3 | slice<15, 13>(half)) {
+
+    // quadrant 0
+    case 0b00'000: {
+        int32_t imm = static_cast<int32_t>(slice<12, 11>(half) << 4 | slice<10, 7>(half) << 6 |
+                                           slice<6, 6>(half) << 2 | slice<5, 5>(half) << 3);
+        return imm ? encode_i(MATCH_ADDI, rd_prime, 2, imm) : ILLEGAL;             // C.ADDI4SPN
+    }
+    case 0b00'001: return encode_i(MATCH_FLD, rd_prime, rs1_prime, double_offset);  // C.FLD
+    case 0b00'010: return encode_i(MATCH_LW, rd_prime, rs1_prime, word_offset);     // C.LW
+    case 0b00'011: return encode_i(MATCH_FLW, rd_prime, rs1_prime, word_offset);    // C.FLW
+    case 0b00'101: return encode_s(MATCH_FSD, rs1_prime, rd_prime, double_offset);  // C.FSD
+    case 0b00'110: return encode_s(MATCH_SW, rs1_prime, rd_prime, word_offset);     // C.SW
+    case 0b00'111: return encode_s(MATCH_FSW, rs1_prime, rd_prime, word_offset);    // C.FSW
+
+    // quadrant 1
+    case 0b01'000: return encode_i(MATCH_ADDI, rd, rd, imm6);                       // C.ADDI, C.NOP
+    case 0b01'001: return encode_j(MATCH_JAL, 1, jump);                             // C.JAL
+    case 0b01'010: return encode_i(MATCH_ADDI, rd, 0, imm6);                        // C.LI
+    case 0b01'011:
+        if (rd == 2) {
+            int32_t imm = sign_extend(slice<12, 12>(half) << 9 | slice<6, 6>(half) << 4 | slice<5, 5>(half) << 6 |
+                                      slice<4, 3>(half) << 7 | slice<2, 2>(half) << 5, 10);
+            return imm ? encode_i(MATCH_ADDI, 2, 2, imm) : ILLEGAL;                 // C.ADDI16SP
+        }
+        return imm6 ? MATCH_LUI | rd << 7 | static_cast<uint32_t>(imm6) << 12 : ILLEGAL;  // C.LUI
+    case 0b01'100:
+        switch (slice<11, 10>(half)) {
+        case 0b00: return slice<12, 12>(half) ? ILLEGAL : encode_i(MATCH_SRLI, rs1_prime, rs1_prime, imm6);    // C.SRLI
+        case 0b01: return slice<12, 12>(half) ? ILLEGAL : encode_i(MATCH_SRAI, rs1_prime, rs1_prime, imm6);    // C.SRAI
+        case 0b10: return encode_i(MATCH_ANDI, rs1_prime, rs1_prime, imm6);         // C.ANDI
+        default:
+            if (slice<12, 12>(half))
+                return ILLEGAL;
+            constexpr uint32_t ops[] = {MATCH_SUB, MATCH_XOR, MATCH_OR, MATCH_AND};
+            return encode_r(ops[slice<6, 5>(half)], rs1_prime, rs1_prime, rd_prime);    // C.SUB ... C.AND
+        }
+    case 0b01'101: return encode_j(MATCH_JAL, 0, jump);                             // C.J
+    case 0b01'110: return encode_b(MATCH_BEQ, rs1_prime, 0, branch);                // C.BEQZ
+    case 0b01'111: return encode_b(MATCH_BNE, rs1_prime, 0, branch);                // C.BNEZ
+
+    // quadrant 2
+    case 0b10'000: return slice<12, 12>(half) ? ILLEGAL : encode_i(MATCH_SLLI, rd, rd, imm6);  // C.SLLI
+    case 0b10'001: return encode_i(MATCH_FLD, rd, 2, double_sp_load);               // C.FLDSP
+    case 0b10'010: return rd ? encode_i(MATCH_LW, rd, 2, word_sp_load) : ILLEGAL;   // C.LWSP
+    case 0b10'011: return encode_i(MATCH_FLW, rd, 2, word_sp_load);                 // C.FLWSP
+    case 0b10'100:
+        if (!slice<12, 12>(half)) {
+            if (rs2)
+                return encode_r(MATCH_ADD, rd, 0, rs2);                             // C.MV
+            return rd ? encode_i(MATCH_JALR, 0, rd, 0) : ILLEGAL;                   // C.JR
+        }
+        if (rs2)
+            return encode_r(MATCH_ADD, rd, rd, rs2);                                // C.ADD
+        return rd ? encode_i(MATCH_JALR, 1, rd, 0) : MATCH_EBREAK;                  // C.JALR, C.EBREAK
+    case 0b10'101: return encode_s(MATCH_FSD, 2, rs2, double_sp_store);             // C.FSDSP
+    case 0b10'110: return encode_s(MATCH_SW, 2, rs2, word_sp_store);                // C.SWSP
+    case 0b10'111: return encode_s(MATCH_FSW, 2, rs2, word_sp_store);               // C.FSWSP
+
+    default:
+        return ILLEGAL;
+    }
+}
+
+static_assert(expand_compressed(0x4501) == 0x00000513);    // c.li a0, 0
+static_assert(expand_compressed(0x8082) == 0x00008067);    // c.ret
+static_assert(expand_compressed(0x1141) == 0xff010113);    // c.addi sp, sp, -16
+
+} // namespace
+
+Instruction decode(uint32_t word) {
+
+    // compressed instructions are decoded as their 32-bit equivalents
+    if (slice<1, 0>(word) != 0b11) {
+        uint32_t expanded = expand_compressed(word & 0xffff);
+        Instruction instr = expanded == ILLEGAL ? Instruction{} : decode(expanded);
+        instr.length = 2;
+        return instr;
+    }
+
+    const Encoding* encoding = nullptr;
+
+    uint8_t index = decode_table[key(word)];
+    if (index != NO_ENCODING && matches(encodings[index], word)) {
+        encoding = &encodings[index];
+    }
+    else if (index != NO_ENCODING) {
+        // key shared with a more specific encoding, e.g. EBREAK behind ECALL
+        for (size_t i = index + 1; i < ENCODINGS_NUM && !encoding; ++i) {
+            if (matches(encodings[i], word))
+                encoding = &encodings[i];
+        }
+    }
+
+    Instruction instr{};
+    if (!encoding)
+        return instr;
+
+    instr.id = encoding->id;
+
+    switch (encoding->format) {
+    case Format::R:
+        instr.rd = slice<11, 7>(word);
+        instr.rs1 = slice<19, 15>(word);
+        instr.rs2 = slice<24, 20>(word);
+        break;
+    case Format::I:
+        instr.rd = slice<11, 7>(word);
+        instr.rs1 = slice<19, 15>(word);
+        instr.imm = sign_extend(slice<31, 20>(word), 12);
+        break;
+    case Format::SHIFT:
+        instr.rd = slice<11, 7>(word);
+        instr.rs1 = slice<19, 15>(word);
+        instr.imm = slice<24, 20>(word);
+        break;
+    case Format::S:
+        instr.rs1 = slice<19, 15>(word);
+        instr.rs2 = slice<24, 20>(word);
+        instr.imm = sign_extend(slice<31, 25>(word) << 5 | slice<11, 7>(word), 12);
+        break;
+    case Format::B:
+        instr.rs1 = slice<19, 15>(word);
+        instr.rs2 = slice<24, 20>(word);
+        instr.imm = sign_extend(slice<31, 31>(word) << 12 | slice<7, 7>(word) << 11 |
+                                slice<30, 25>(word) << 5 | slice<11, 8>(word) << 1, 13);
+        break;
+    case Format::U:
+        instr.rd = slice<11, 7>(word);
+        instr.imm = static_cast<int32_t>(word & get_mask<31, 12>());
+        break;
+    case Format::J:
+        instr.rd = slice<11, 7>(word);
+        instr.imm = sign_extend(slice<31, 31>(word) << 20 | slice<19, 12>(word) << 12 |
+                                slice<20, 20>(word) << 11 | slice<30, 21>(word) << 1, 21);
+        break;
+    case Format::SYSTEM:
+        break;
+    case Format::FP:
+        instr.rd = slice<11, 7>(word);
+        instr.rs1 = slice<19, 15>(word);
+        instr.rs2 = slice<24, 20>(word);
+        instr.imm = slice<14, 12>(word);
+        break;
+    case Format::R4:
+        instr.rd = slice<11, 7>(word);
+        instr.rs1 = slice<19, 15>(word);
+        instr.rs2 = slice<24, 20>(word);
+        instr.rs3 = slice<31, 27>(word);
+        instr.imm = slice<14, 12>(word);
+        break;
+    case Format::CSR:
+        instr.rd = slice<11, 7>(word);
+        instr.rs1 = slice<19, 15>(word);
+        instr.imm = slice<31, 20>(word);
+        instr.imm2 = slice<19, 15>(word);
+        break;
+    case Format::V:
+        instr.rd = slice<11, 7>(word);
+        instr.rs1 = slice<19, 15>(word);
+        instr.rs2 = slice<24, 20>(word);
+        instr.imm2 = !slice<25, 25>(word);
+        break;
+    case Format::VI:
+        instr.rd = slice<11, 7>(word);
+        instr.rs2 = slice<24, 20>(word);
+        instr.imm = sign_extend(slice<19, 15>(word), 5);
+        instr.imm2 = !slice<25, 25>(word);
+        break;
+    case Format::VSTORE:
+        instr.rs3 = slice<11, 7>(word);
+        instr.rs1 = slice<19, 15>(word);
+        instr.rs2 = slice<24, 20>(word);
+        instr.imm2 = !slice<25, 25>(word);
+        break;
+    case Format::VSET:
+        instr.rd = slice<11, 7>(word);
+        instr.rs1 = slice<19, 15>(word);
+        instr.rs2 = slice<24, 20>(word);
+        instr.imm = slice<30, 20>(word);
+        instr.imm2 = instr.rs1 ? AVL_RS1 : instr.rd ? AVL_VLMAX : AVL_KEEP;
+        break;
+    case Format::VSETI:
+        instr.rd = slice<11, 7>(word);
+        instr.imm = slice<29, 20>(word);
+        instr.imm2 = slice<19, 15>(word);
+        break;
+    }
+
+    return instr;
+}
+
+bool is_end_of_block(Opcode opcode) {
+
+    switch (opcode) {
+    case Opcode::NONE:
+    case Opcode::BEQ:
+    case Opcode::BGE:
+    case Opcode::BGEU:
+    case Opcode::BLT:
+    case Opcode::BLTU:
+    case Opcode::BNE:
+    case Opcode::EBREAK:
+    case Opcode::ECALL:
+    case Opcode::FENCE_I:
+    case Opcode::JAL:
+    case Opcode::JALR:
+    case Opcode::SBREAK:
+    case Opcode::SCALL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool is_atomic(Opcode opcode) {
+
+    switch (opcode) {
+#define ATOMIC_CASE(name) case Opcode::name:
+    ATOMIC_OPCODE_LIST(ATOMIC_CASE)
+#undef ATOMIC_CASE
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool is_float(Opcode opcode) {
+
+    switch (opcode) {
+#define FLOAT_CASE(name) case Opcode::name:
+    FLOAT_OPCODE_LIST(FLOAT_CASE)
+#undef FLOAT_CASE
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool is_vector(Opcode opcode) {
+
+    switch (opcode) {
+#define VECTOR_CASE(name) case Opcode::name:
+    VECTOR_OPCODE_LIST(VECTOR_CASE)
+#undef VECTOR_CASE
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool writes_float_register(Opcode opcode) {
+
+    switch (opcode) {
+    case Opcode::FCLASS_D:
+    case Opcode::FCLASS_S:
+    case Opcode::FCVT_W_D:
+    case Opcode::FCVT_W_S:
+    case Opcode::FCVT_WU_D:
+    case Opcode::FCVT_WU_S:
+    case Opcode::FEQ_D:
+    case Opcode::FEQ_S:
+    case Opcode::FLE_D:
+    case Opcode::FLE_S:
+    case Opcode::FLT_D:
+    case Opcode::FLT_S:
+    case Opcode::FMV_X_W:
+    case Opcode::FSD:
+    case Opcode::FSW:
+        return false;
+    default:
+        return is_float(opcode);
+    }
+}
+
+bool writes_vector_register(Opcode opcode) {
+
+    switch (opcode) {
+    case Opcode::VMV_X_S:
+    case Opcode::VSE16_V:
+    case Opcode::VSE32_V:
+    case Opcode::VSE8_V:
+    case Opcode::VSETIVLI:
+    case Opcode::VSETVL:
+    case Opcode::VSETVLI:
+    case Opcode::VSSE16_V:
+    case Opcode::VSSE32_V:
+    case Opcode::VSSE8_V:
+        return false;
+    default:
+        return is_vector(opcode);
+    }
+}
+
+void DecodedText::add_segment(uint32_t base, const uint8_t* data, size_t size, unsigned threads) {
+
+    Segment segment = {base, std::vector<Instruction>(size / 2)};
+    auto& instrs = segment.instrs;
+
+    auto decode_range = [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) {
+            uint32_t word = 0;
+            std::memcpy(&word, data + 2 * i, std::min<size_t>(sizeof(word), size - 2 * i));
+            instrs[i] = decode(word);
+        }
+    };
+
+    // below that threads cost more than they save
+    constexpr size_t MIN_CHUNK = 1 << 16;
+    size_t chunks = std::clamp<size_t>(instrs.size() / MIN_CHUNK, 1, std::max(threads, 1u));
+    size_t chunk = (instrs.size() + chunks - 1) / chunks;
+
+    std::vector<std::thread> workers;
+    for (size_t first = chunk; first < instrs.size(); first += chunk)
+        workers.emplace_back(decode_range, first, std::min(first + chunk, instrs.size()));
+
+    decode_range(0, std::min(chunk, instrs.size()));
+
+    for (auto& worker : workers)
+        worker.join();
+
+    segments.push_back(std::move(segment));
+}
+
+size_t DecodedText::size() const {
+    size_t size = 0;
+    for (const auto& segment : segments)
+        size += segment.instrs.size();
+    return size;
+}
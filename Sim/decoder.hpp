@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "opdefs.hpp"
+
+// word is fetched at the pc of the instruction, a compressed one takes its lower half
+Instruction decode(uint32_t word);
+
+bool is_end_of_block(Opcode opcode);
+
+// A instructions
+bool is_atomic(Opcode opcode);
+
+// F and D instructions
+bool is_float(Opcode opcode);
+
+// V subset
+bool is_vector(Opcode opcode);
+
+// rd of these is a floating point register, f0 is an ordinary register unlike x0
+bool writes_float_register(Opcode opcode);
+
+// rd of these is a vector register, v0 as well
+bool writes_vector_register(Opcode opcode);
+
+// Decodes the basic block starting at pc: up to the first instruction which ends a block,
+// or max_length instructions. Block cache and static translation split code with it,
+// so their blocks always start and end at the same addresses.
+// decode_at(addr) returns the decoded instruction, push(instr) receives every instruction.
+// Returns true if the block ends with an instruction ending a block, false if it was cut,
+// at max_length or before cut_pc.
+template <typename DecodeAt, typename Push>
+bool decode_block(uint32_t pc, size_t max_length, DecodeAt&& decode_at, Push&& push, uint32_t cut_pc = 1) {
+
+    for (size_t length = 0; length < max_length; ++length) {
+        if (length && pc == cut_pc)
+            return false;
+
+        Instruction instr = decode_at(pc);
+        pc += instr.length;
+        push(instr);
+
+        if (is_end_of_block(instr.id))
+            return true;
+    }
+
+    return false;
+}
+
+// Executable segments decoded at load time, one instruction per 2-byte slot,
+// as with compressed instructions any halfword may start one
+class DecodedText final {
+
+public:
+
+    // large segments are split between threads
+    void add_segment(uint32_t base, const uint8_t* data, size_t size, unsigned threads = 1);
+
+    // nullptr outside of the decoded segments
+    const Instruction* find(uint32_t pc) const {
+        return const_cast<DecodedText*>(this)->find(pc);
+    }
+
+    Instruction* find(uint32_t pc) {
+        for (auto& segment : segments) {
+            uint32_t offset = pc - segment.base;
+            if (offset < segment.instrs.size() * 2 && offset % 2 == 0)
+                return &segment.instrs[offset >> 1];
+        }
+        return nullptr;
+    }
+
+    size_t size() const;
+
+private:
+
+    struct Segment {
+        uint32_t base;
+        std::vector<Instruction> instrs;
+    };
+
+    std::vector<Segment> segments;
+};
@@ -0,0 +1,17 @@
+#include "elf.hpp"
+
+#include <stdexcept>
+
+#include <elfio.hpp>
+
+void load_guest_elf(ELFIO::elfio& reader, const std::string& elf_filename) {
+
+    if (!reader.load(elf_filename)) {
+        throw std::invalid_argument("Can't open " + elf_filename);
+    }
+
+    if (reader.get_class() != ELFIO::ELFCLASS32 || reader.get_encoding() != ELFIO::ELFDATA2LSB ||
+        reader.get_machine() != ELFIO::EM_RISCV) {
+        throw std::invalid_argument(elf_filename + " is not a 32-bit little-endian RISC-V ELF");
+    }
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <string>
+
+namespace ELFIO {
+class elfio;
+}
+
+// Loads the ELF of a guest into reader, throws if it can't be read
+// or isn't a 32-bit little-endian RISC-V one
+void load_guest_elf(ELFIO::elfio& reader, const std::string& elf_filename);
@@ -0,0 +1,170 @@
+#include "farm.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+std::vector<FarmJob> read_manifest(std::istream& in) {
+
+    std::vector<FarmJob> jobs;
+
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+
+        FarmJob job;
+        if (!(fields >> job.elf_filename) || job.elf_filename[0] == '#')
+            continue;
+        if (!(fields >> job.budget))
+            throw std::invalid_argument("Manifest line without a budget: " + line);
+
+        std::string arg;
+        while (fields >> arg)
+            job.args.push_back(arg);
+
+        jobs.push_back(std::move(job));
+    }
+
+    return jobs;
+}
+
+Farm::Farm(const SimOptions& options, unsigned threads, std::chrono::milliseconds timeout) :
+    options(options),
+    threads_num(threads ? threads : std::max(std::thread::hardware_concurrency(), 1u)),
+    timeout(timeout)
+{
+    // decoded once per ELF and shared by its jobs
+    this->options.predecode = true;
+}
+
+namespace {
+
+// jobs of one worker, the owner takes them from the front, thieves from the back
+struct WorkQueue {
+    std::mutex mutex;
+    std::deque<size_t> jobs;
+};
+
+bool take(std::deque<size_t>& jobs, std::mutex& mutex, bool front, size_t& job) {
+    std::lock_guard lock(mutex);
+    if (jobs.empty())
+        return false;
+
+    if (front) {
+        job = jobs.front();
+        jobs.pop_front();
+    } else {
+        job = jobs.back();
+        jobs.pop_back();
+    }
+    return true;
+}
+
+} // namespace
+
+size_t Farm::run(const std::vector<FarmJob>& jobs, std::ostream& out) {
+
+    size_t workers_num = std::min<size_t>(threads_num, std::max<size_t>(jobs.size(), 1));
+    std::unique_ptr<WorkQueue[]> queues(new WorkQueue[workers_num]);
+    for (size_t i = 0; i < jobs.size(); ++i)
+        queues[i % workers_num].jobs.push_back(i);
+
+    std::mutex texts_mutex;
+    std::unordered_map<std::string, std::shared_ptr<DecodedText>> texts;
+
+    std::mutex out_mutex;
+    size_t halted_num = 0;
+
+    auto run_job = [&](size_t index) {
+        const FarmJob& job = jobs[index];
+        std::ostringstream record;
+        record << "job " << index << " " << job.elf_filename << ": ";
+
+        // the guest output of a job stays in its record, the jobs run side by side
+        std::string output;
+        auto write_output = [&] {
+            if (!output.empty())
+                record << "output " << output.size() << " bytes\n" << output << "\n";
+        };
+
+        try {
+            SimOptions job_options = options;
+            job_options.args = job.args;
+            job_options.console_sink = [&output](int, const char* data, size_t size) { output.append(data, size); };
+            {
+                std::lock_guard lock(texts_mutex);
+                auto it = texts.find(job.elf_filename);
+                if (it != texts.end())
+                    job_options.decoded_text = it->second;
+            }
+
+            Sim sim(job.elf_filename, job_options);
+            if (!job_options.decoded_text) {
+                std::lock_guard lock(texts_mutex);
+                texts.emplace(job.elf_filename, sim.text());
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            RunLimits limits;
+            if (job.budget)
+                limits.budget = job.budget;
+            if (timeout.count())
+                limits.deadline = start + timeout;
+            RunResult result = sim.run(limits);
+            auto finish = std::chrono::steady_clock::now();
+            double seconds = std::chrono::duration<double>(finish - start).count();
+
+            if (result.status == RunStatus::Halted)
+                record << "halted, exit code " << static_cast<int32_t>(sim.exit_code());
+            else if (result.status == RunStatus::DeadlineExpired)
+                record << "timed out";
+            else
+                record << "budget exhausted";
+            record << ", " << result.instr_count << " instructions, " << result.instr_count / (seconds * 1000000) << " MIPS\n";
+            sim.dump_registers(record);
+            write_output();
+
+            std::lock_guard lock(out_mutex);
+            halted_num += result.status == RunStatus::Halted;
+            out << record.str();
+        }
+        catch (std::exception& e) {
+            record << "failed, " << e.what() << "\n";
+            write_output();
+            std::lock_guard lock(out_mutex);
+            out << record.str();
+        }
+    };
+
+    auto work = [&](size_t self) {
+        size_t job = 0;
+        for (;;) {
+            bool found = take(queues[self].jobs, queues[self].mutex, true, job);
+            for (size_t i = 1; !found && i < workers_num; ++i) {
+                WorkQueue& victim = queues[(self + i) % workers_num];
+                found = take(victim.jobs, victim.mutex, false, job);
+            }
+
+            // nothing is queued after the start, so empty queues stay empty
+            if (!found)
+                return;
+            run_job(job);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < workers_num; ++i)
+        workers.emplace_back(work, i);
+
+    work(0);
+
+    for (auto& worker : workers)
+        worker.join();
+
+    return halted_num;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Sim.hpp"
+
+struct FarmJob {
+    std::string elf_filename;
+
+    // guest command line after the ELF name
+    std::vector<std::string> args;
+
+    // instructions, 0 for none, checked at block boundaries like the limit of Sim::run
+    size_t budget = 0;
+};
+
+// Manifest of a batch run, one job per line: <elf> <budget> [args...].
+// Empty lines and lines starting with # are skipped.
+std::vector<FarmJob> read_manifest(std::istream& in);
+
+// Batch runs of many small programs. Every job gets a Sim of its own, the paged backend
+// keeps it to the memory the job touches. Jobs are dealt to the worker threads up front,
+// a worker which runs out of them steals from the others. Budgets and the timeout keep
+// a guest which never exits from holding its worker.
+// Jobs of the same ELF share its decoded executable segments.
+class Farm final {
+
+public:
+
+    // threads 0 uses every host thread, a job which runs longer than timeout is abandoned,
+    // timeout 0 for none
+    Farm(const SimOptions& options, unsigned threads = 0, std::chrono::milliseconds timeout = {});
+
+public:
+
+    // Runs all jobs, writes a record of every job to out as soon as it finishes:
+    // job index, ELF, status, exit code, instructions, MIPS and registers, then
+    // "output <n> bytes" and the n bytes the guest wrote to stdout and stderr, if any.
+    // Returns the number of jobs which halted.
+    size_t run(const std::vector<FarmJob>& jobs, std::ostream& out);
+
+private:
+
+    SimOptions options;
+    unsigned threads_num;
+    std::chrono::milliseconds timeout;
+};
@@ -0,0 +1,60 @@
+#include "fpu.hpp"
+
+namespace {
+
+uint32_t collect_host_flags() {
+    int raised = std::fetestexcept(FE_ALL_EXCEPT);
+    std::feclearexcept(FE_ALL_EXCEPT);
+
+    uint32_t flags = 0;
+    if (raised & FE_INVALID)
+        flags |= Fpu::NV;
+    if (raised & FE_DIVBYZERO)
+        flags |= Fpu::DZ;
+    if (raised & FE_OVERFLOW)
+        flags |= Fpu::OF;
+    if (raised & FE_UNDERFLOW)
+        flags |= Fpu::UF;
+    if (raised & FE_INEXACT)
+        flags |= Fpu::NX;
+    return flags;
+}
+
+}
+
+Fpu::HostScope::HostScope(Fpu& fpu) : fpu(fpu) {
+    std::fegetenv(&host_env);
+    std::feclearexcept(FE_ALL_EXCEPT);
+    std::fesetround(host_rounding(fpu.rounding));
+}
+
+Fpu::HostScope::~HostScope() {
+    fpu.flags |= collect_host_flags();
+    std::fesetenv(&host_env);
+}
+
+uint32_t Fpu::fflags() {
+    flags |= collect_host_flags();
+    return flags;
+}
+
+void Fpu::set_fflags(uint32_t value) {
+    std::feclearexcept(FE_ALL_EXCEPT);
+    flags = value & 0x1f;
+}
+
+void Fpu::set_frm(uint32_t value) {
+    rounding = value & 0x7;
+    if (rounding <= RMM)
+        std::fesetround(host_rounding(rounding));
+}
+
+// RMM runs in round to nearest even and is corrected by the operations
+int Fpu::host_rounding(uint32_t mode) {
+    switch (mode) {
+    case RTZ: return FE_TOWARDZERO;
+    case RDN: return FE_DOWNWARD;
+    case RUP: return FE_UPWARD;
+    default:  return FE_TONEAREST;
+    }
+}
@@ -0,0 +1,434 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cfenv>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#include "helper.hpp"
+
+// Floating point unit of the F and D extensions on top of host floating point.
+//
+// Registers are 64-bit, single-precision values are NaN-boxed in them. Arithmetic runs
+// as plain host operations in the host rounding mode, which follows frm while the guest
+// runs. Instructions with a static rounding mode different from frm switch it for their
+// operation, RMM has no host equivalent and is derived from round to nearest even.
+//
+// Exception flags are lazy: the host accumulates them in its own status register and
+// they are added to fflags only when the guest reads fflags or the run ends. Instructions
+// emulated in software (comparisons, conversions to integers, ...) raise theirs directly.
+// Tininess for UF is detected the way the host does it.
+class Fpu final {
+
+public:
+
+    // rounding modes of the rm field and frm
+    static constexpr uint32_t RNE = 0;
+    static constexpr uint32_t RTZ = 1;
+    static constexpr uint32_t RDN = 2;
+    static constexpr uint32_t RUP = 3;
+    static constexpr uint32_t RMM = 4;
+    static constexpr uint32_t DYN = 7;
+
+    // fflags
+    static constexpr uint32_t NX = 1;
+    static constexpr uint32_t UF = 2;
+    static constexpr uint32_t OF = 4;
+    static constexpr uint32_t DZ = 8;
+    static constexpr uint32_t NV = 16;
+
+    // CSR numbers
+    static constexpr uint32_t CSR_FFLAGS = 0x001;
+    static constexpr uint32_t CSR_FRM = 0x002;
+    static constexpr uint32_t CSR_FCSR = 0x003;
+
+    // upper half of a register holding a single-precision value
+    static constexpr uint64_t BOX = 0xffffffff00000000ull;
+
+    enum class SignInjection { COPY, NEGATE, XOR };
+
+public:
+
+    // Host floating point environment follows the guest one while the scope lives,
+    // the host environment is restored after it
+    class HostScope final {
+
+    public:
+
+        explicit HostScope(Fpu& fpu);
+        ~HostScope();
+
+        HostScope(const HostScope&) = delete;
+        HostScope& operator=(const HostScope&) = delete;
+
+    private:
+
+        Fpu& fpu;
+        std::fenv_t host_env;
+    };
+
+public:
+
+    uint32_t fflags();
+    void set_fflags(uint32_t value);
+
+    uint32_t frm() const { return rounding; }
+    void set_frm(uint32_t value);
+
+public:
+
+    template <typename T> uint64_t add(uint64_t a, uint64_t b, uint32_t rm) {
+        return result(compute<T>(rm, [](T x, T y) { return x + y; }, two_sum_error<T>, unbox<T>(a), unbox<T>(b)));
+    }
+
+    template <typename T> uint64_t sub(uint64_t a, uint64_t b, uint32_t rm) {
+        return result(compute<T>(rm, [](T x, T y) { return x - y; },
+                                 [](T r, T x, T y) { return two_sum_error<T>(r, x, -y); }, unbox<T>(a), unbox<T>(b)));
+    }
+
+    template <typename T> uint64_t mul(uint64_t a, uint64_t b, uint32_t rm) {
+        return result(compute<T>(rm, [](T x, T y) { return x * y; },
+                                 [](T r, T x, T y) { return std::fma(x, y, -r); }, unbox<T>(a), unbox<T>(b)));
+    }
+
+    // quotients and square roots are never halfway between two values, RMM rounds as RNE
+    template <typename T> uint64_t div(uint64_t a, uint64_t b, uint32_t rm) {
+        return result(compute<T>(rm, [](T x, T y) { return x / y; }, no_error<T>, unbox<T>(a), unbox<T>(b)));
+    }
+
+    template <typename T> uint64_t sqrt(uint64_t a, uint32_t rm) {
+        return result(compute<T>(rm, [](T x) { return std::sqrt(x); }, no_error<T>, unbox<T>(a)));
+    }
+
+    // (-)a * b (-) c with a single rounding
+    template <typename T> uint64_t fma(uint64_t a, uint64_t b, uint64_t c, uint32_t rm, bool negate_product, bool negate_addend) {
+        T x = unbox<T>(a), y = unbox<T>(b), z = unbox<T>(c);
+        if (negate_product)
+            x = -x;
+        if (negate_addend)
+            z = -z;
+
+        T r = compute<T>(rm, [](T x, T y, T z) { return std::fma(x, y, z); }, fma_error<T>, x, y, z);
+
+        // inf * 0 is invalid even if the addend is a quiet NaN
+        if (is_nan(r) && ((std::isinf(x) && y == 0) || (x == 0 && std::isinf(y))))
+            flags |= NV;
+        return result(r);
+    }
+
+    template <typename T> uint64_t sign_inject(uint64_t a, uint64_t b, SignInjection kind) {
+        constexpr auto sign = sign_mask<T>();
+        auto x = bits(unbox<T>(a));
+        auto y = bits(unbox<T>(b));
+        switch (kind) {
+        case SignInjection::COPY:   y &= sign; break;
+        case SignInjection::NEGATE: y = ~y & sign; break;
+        case SignInjection::XOR:    y = (x ^ y) & sign; break;
+        }
+        return box(std::bit_cast<T>((x & ~sign) | y));
+    }
+
+    template <typename T> uint64_t min(uint64_t a, uint64_t b) {
+        return min_max<T>(a, b, true);
+    }
+
+    template <typename T> uint64_t max(uint64_t a, uint64_t b) {
+        return min_max<T>(a, b, false);
+    }
+
+    // FEQ signals only for signaling NaNs, FLT and FLE for any NaN
+    template <typename T> uint32_t eq(uint64_t a, uint64_t b) {
+        T x = unbox<T>(a), y = unbox<T>(b);
+        if (is_nan(x) || is_nan(y)) {
+            if (is_signaling(x) || is_signaling(y))
+                flags |= NV;
+            return 0;
+        }
+        return x == y;
+    }
+
+    template <typename T> uint32_t lt(uint64_t a, uint64_t b) {
+        T x = unbox<T>(a), y = unbox<T>(b);
+        if (is_nan(x) || is_nan(y)) {
+            flags |= NV;
+            return 0;
+        }
+        return x < y;
+    }
+
+    template <typename T> uint32_t le(uint64_t a, uint64_t b) {
+        T x = unbox<T>(a), y = unbox<T>(b);
+        if (is_nan(x) || is_nan(y)) {
+            flags |= NV;
+            return 0;
+        }
+        return x <= y;
+    }
+
+    template <typename T> static uint32_t classify(uint64_t a);
+
+    // FCVT.W[U], out of range values and NaNs saturate and raise NV
+    template <typename T, typename Int> uint32_t to_int(uint64_t a, uint32_t rm);
+
+    // FCVT from W[U]
+    template <typename T, typename Int> uint64_t from_int(uint32_t value, uint32_t rm) {
+        return result(compute<T>(rm, [](Int x) { return static_cast<T>(x); },
+                                 [](T r, Int x) { return static_cast<double>(int64_t(x) - static_cast<int64_t>(r)); },
+                                 static_cast<Int>(value)));
+    }
+
+    // FCVT.S.D and FCVT.D.S
+    template <typename To, typename From> uint64_t convert(uint64_t a, uint32_t rm) {
+        return result(compute<To>(rm, [](From x) { return static_cast<To>(x); },
+                                  [](To r, From x) { return static_cast<double>(x) - static_cast<double>(r); },
+                                  unbox<From>(a)));
+    }
+
+public:
+
+    std::array<uint64_t, REG_NUM> registers = {};
+
+private:
+
+    template <typename T> using Bits = std::conditional_t<sizeof(T) == 4, uint32_t, uint64_t>;
+
+    template <typename T> static constexpr Bits<T> sign_mask() {
+        return Bits<T>(1) << (sizeof(T) * 8 - 1);
+    }
+
+    template <typename T> static constexpr Bits<T> exponent_mask() {
+        return std::bit_cast<Bits<T>>(std::numeric_limits<T>::infinity());
+    }
+
+    template <typename T> static constexpr Bits<T> quiet_bit() {
+        return Bits<T>(1) << (std::numeric_limits<T>::digits - 2);
+    }
+
+    template <typename T> static Bits<T> bits(T value) {
+        return std::bit_cast<Bits<T>>(value);
+    }
+
+    // NaN checks look at the bits, host comparisons could raise host flags
+    template <typename T> static bool is_nan(T value) {
+        return (bits(value) & ~sign_mask<T>()) > exponent_mask<T>();
+    }
+
+    template <typename T> static bool is_signaling(T value) {
+        return is_nan(value) && !(bits(value) & quiet_bit<T>());
+    }
+
+    template <typename T> static T canonical_nan() {
+        return std::bit_cast<T>(Bits<T>(exponent_mask<T>() | quiet_bit<T>()));
+    }
+
+    // single-precision values which are not properly NaN-boxed read as the canonical NaN
+    template <typename T> static T unbox(uint64_t raw) {
+        if constexpr (sizeof(T) == 4) {
+            if ((raw & BOX) != BOX)
+                return canonical_nan<T>();
+            return std::bit_cast<T>(static_cast<uint32_t>(raw));
+        } else {
+            return std::bit_cast<T>(raw);
+        }
+    }
+
+    template <typename T> static uint64_t box(T value) {
+        if constexpr (sizeof(T) == 4)
+            return BOX | std::bit_cast<uint32_t>(value);
+        else
+            return std::bit_cast<uint64_t>(value);
+    }
+
+    // NaN results are always the canonical NaN
+    template <typename T> static uint64_t result(T value) {
+        return box(is_nan(value) ? canonical_nan<T>() : value);
+    }
+
+    // exact value of x + y minus its rounded value r, in RNE
+    template <typename T> static T two_sum_error(T r, T x, T y) {
+        T y_part = r - x;
+        return (x - (r - y_part)) + (y - y_part);
+    }
+
+    // exact x * y + z is r + error + rest (Boldo and Muller, ErrFma), a tie needs rest = 0
+    template <typename T> static T fma_error(T r, T x, T y, T z) {
+        T product = x * y;
+        T product_error = std::fma(x, y, -product);
+        T sum = z + product_error;
+        T sum_error = two_sum_error<T>(sum, z, product_error);
+        T high = product + sum;
+        T high_error = two_sum_error<T>(high, product, sum);
+        T g = (high - r) + high_error;
+        T error = g + sum_error;
+        T rest = sum_error - (error - g);
+        return rest == 0 ? error : 0;
+    }
+
+    template <typename T> static constexpr auto no_error = [](auto...) { return T(0); };
+
+    // keeps the compiler from moving an operation across a rounding mode change
+    template <typename T> static T opaque(T value) {
+        volatile T copy = value;
+        return copy;
+    }
+
+    // Operation in the rounding mode rm. error(r, args...) is the exact error of r rounded
+    // to nearest even, or 0 if r can't be a tie. RMM moves r away from zero when it was
+    // halfway between two values, the error terms leave the host flags as they were.
+    template <typename T, typename Op, typename Error, typename... Args>
+    T compute(uint32_t rm, Op op, Error error, Args... args) {
+        if ((rm == DYN || rm == rounding) && rounding < RMM) [[likely]]
+            return op(args...);
+
+        uint32_t mode = rm == DYN ? rounding : rm;
+        if (mode > RMM)
+            throw std::invalid_argument("Invalid rounding mode: " + std::to_string(mode));
+
+        std::fesetround(host_rounding(mode));
+        T r = opaque(op(opaque(args)...));
+        if (mode == RMM) {
+            int raised = std::fetestexcept(FE_ALL_EXCEPT);
+            r = ties_away(r, opaque(error(r, args...)));
+            if (std::fetestexcept(FE_ALL_EXCEPT) != raised) {
+                std::feclearexcept(FE_ALL_EXCEPT);
+                std::feraiseexcept(raised);
+            }
+        }
+        std::fesetround(host_rounding(rounding));
+        return r;
+    }
+
+    template <typename T, typename E> static T ties_away(T r, E error);
+
+    template <typename T> uint64_t min_max(uint64_t a, uint64_t b, bool min);
+
+    static int host_rounding(uint32_t mode);
+
+private:
+
+    uint32_t rounding = RNE;
+
+    // raised by the instructions emulated in software, host flags are collected lazily
+    uint32_t flags = 0;
+};
+
+// Neighbour of r on the side of the exact value r + error, taken if r was a tie
+// resolved toward zero. Everything here is exact, so no host flags are raised.
+template <typename T, typename E>
+T Fpu::ties_away(T r, E error) {
+    if (error == 0 || std::isinf(r) || is_nan(r))
+        return r;
+
+    bool away = r == 0 || (error > 0) == (r > 0);
+    Bits<T> neighbour_bits = r == 0 ? (std::signbit(error) ? sign_mask<T>() : 0) | 1 : away ? bits(r) + 1 : bits(r) - 1;
+    T neighbour = std::bit_cast<T>(neighbour_bits);
+
+    if (std::isinf(neighbour) || std::fabs(E(neighbour) - E(r)) != 2 * std::fabs(error))
+        return r;
+    return away ? neighbour : r;
+}
+
+// FMIN and FMAX: a NaN operand is ignored unless both are NaNs, -0 is less than +0
+template <typename T>
+uint64_t Fpu::min_max(uint64_t a, uint64_t b, bool min) {
+    T x = unbox<T>(a), y = unbox<T>(b);
+
+    if (is_signaling(x) || is_signaling(y))
+        flags |= NV;
+
+    if (is_nan(x) && is_nan(y))
+        return box(canonical_nan<T>());
+    if (is_nan(x))
+        return box(y);
+    if (is_nan(y))
+        return box(x);
+
+    if (x == y) {
+        // equal zeroes differ only in sign
+        bool x_negative = bits(x) & sign_mask<T>();
+        return box(x_negative == min ? x : y);
+    }
+    return box((x < y) == min ? x : y);
+}
+
+// FCLASS: one bit of -inf, -normal, -subnormal, -0, +0, +subnormal, +normal, +inf, sNaN, qNaN
+template <typename T>
+uint32_t Fpu::classify(uint64_t a) {
+    T x = unbox<T>(a);
+    bool negative = bits(x) & sign_mask<T>();
+
+    if (is_nan(x))
+        return is_signaling(x) ? 1u << 8 : 1u << 9;
+
+    auto magnitude = bits(x) & ~sign_mask<T>();
+    unsigned index;
+    if (magnitude == exponent_mask<T>())
+        index = 0;
+    else if (magnitude == 0)
+        index = 3;
+    else if (!(magnitude & exponent_mask<T>()))
+        index = 2;
+    else
+        index = 1;
+
+    return 1u << (negative ? index : 7 - index);
+}
+
+// Rounds in software on the bits of the value, host conversions would raise host flags
+// and can't round to nearest with ties away from zero
+template <typename T, typename Int>
+uint32_t Fpu::to_int(uint64_t a, uint32_t rm) {
+    T x = unbox<T>(a);
+
+    uint32_t mode = rm == DYN ? rounding : rm;
+    if (mode > RMM)
+        throw std::invalid_argument("Invalid rounding mode: " + std::to_string(mode));
+
+    constexpr Int int_min = std::numeric_limits<Int>::min();
+    constexpr Int int_max = std::numeric_limits<Int>::max();
+
+    if (is_nan(x)) {
+        flags |= NV;
+        return static_cast<uint32_t>(int_max);
+    }
+
+    // exact, every float is a double
+    double value = x;
+    double rounded = value;
+
+    if (std::fabs(value) < 0x1p52) {
+        // integral part by clearing the fraction bits
+        uint64_t value_bits = std::bit_cast<uint64_t>(value);
+        int exponent = static_cast<int>((value_bits >> 52) & 0x7ff) - 1023;
+        uint64_t fraction_mask = exponent < 0 ? ~sign_mask<double>() : (uint64_t(1) << (52 - exponent)) - 1;
+        double whole = std::bit_cast<double>(value_bits & ~fraction_mask);
+        double fraction = value - whole;
+
+        double step = value < 0 ? -1.0 : 1.0;
+        bool odd = static_cast<int64_t>(whole) & 1;
+
+        switch (mode) {
+        case RTZ: rounded = whole; break;
+        case RDN: rounded = fraction < 0 ? whole - 1 : whole; break;
+        case RUP: rounded = fraction > 0 ? whole + 1 : whole; break;
+        case RMM: rounded = std::fabs(fraction) >= 0.5 ? whole + step : whole; break;
+        default:
+            rounded = std::fabs(fraction) > 0.5 || (std::fabs(fraction) == 0.5 && odd) ? whole + step : whole;
+            break;
+        }
+    }
+
+    if (rounded < static_cast<double>(int_min) || rounded > static_cast<double>(int_max)) {
+        flags |= NV;
+        return static_cast<uint32_t>(value < 0 ? int_min : int_max);
+    }
+
+    if (rounded != value)
+        flags |= NX;
+    return static_cast<uint32_t>(static_cast<Int>(rounded));
+}
@@ -0,0 +1,142 @@
+#include "fusion.hpp"
+
+namespace {
+
+Opcode fused_branch(Opcode branch) {
+    switch (branch) {
+    case Opcode::BEQ:   return Opcode::ADDI_BEQ;
+    case Opcode::BNE:   return Opcode::ADDI_BNE;
+    case Opcode::BLT:   return Opcode::ADDI_BLT;
+    case Opcode::BGE:   return Opcode::ADDI_BGE;
+    case Opcode::BLTU:  return Opcode::ADDI_BLTU;
+    case Opcode::BGEU:  return Opcode::ADDI_BGEU;
+    default:            return Opcode::NONE;
+    }
+}
+
+Opcode unfused_branch(Opcode fused) {
+    switch (fused) {
+    case Opcode::ADDI_BEQ:  return Opcode::BEQ;
+    case Opcode::ADDI_BNE:  return Opcode::BNE;
+    case Opcode::ADDI_BLT:  return Opcode::BLT;
+    case Opcode::ADDI_BGE:  return Opcode::BGE;
+    case Opcode::ADDI_BLTU: return Opcode::BLTU;
+    case Opcode::ADDI_BGEU: return Opcode::BGEU;
+    default:                return Opcode::NONE;
+    }
+}
+
+// Writes to x0 are already redirected to REG_ZERO_SINK, which is never a source,
+// so a pair matched by its registers never fuses through x0.
+bool fuse(const Instruction& first, const Instruction& second, Instruction& fused) {
+
+    fused = {};
+    fused.length = first.length + second.length;
+    fused.first_length = first.length;
+
+    switch (first.id) {
+    case Opcode::LUI:
+        if (second.id != Opcode::ADDI || second.rs1 != first.rd || second.rd != first.rd)
+            return false;
+        fused.id = Opcode::LUI_ADDI;
+        fused.rd = first.rd;
+        fused.imm = first.imm + second.imm;
+        fused.imm2 = second.imm;
+        return true;
+
+    case Opcode::AUIPC:
+        if ((second.id != Opcode::LW && second.id != Opcode::JALR) || second.rs1 != first.rd)
+            return false;
+        fused.id = second.id == Opcode::LW ? Opcode::AUIPC_LW : Opcode::AUIPC_JALR;
+        fused.rs3 = first.rd;
+        fused.imm = first.imm;
+        fused.rd = second.rd;
+        fused.imm2 = second.imm;
+        return true;
+
+    case Opcode::ADDI:
+        fused.id = fused_branch(second.id);
+        if (fused.id == Opcode::NONE)
+            return false;
+        fused.rd = first.rd;
+        fused.rs1 = first.rs1;
+        fused.imm = first.imm;
+        fused.rs3 = second.rs1;
+        fused.rs2 = second.rs2;
+        fused.imm2 = first.length + second.imm;
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+} // namespace
+
+size_t fuse_block(Instruction* instrs, size_t length) {
+
+    size_t size = 0;
+    for (size_t i = 0; i < length; ++i) {
+        Instruction fused;
+        if (i + 1 < length && fuse(instrs[i], instrs[i + 1], fused)) {
+            instrs[size] = fused;
+            ++i;
+        } else {
+            instrs[size] = instrs[i];
+        }
+        ++size;
+    }
+
+    return size;
+}
+
+size_t unfuse(const Instruction& instr, Instruction* parts) {
+
+    Instruction& first = parts[0];
+    Instruction& second = parts[1];
+    first = second = {};
+    first.length = instr.first_length;
+    second.length = instr.length - instr.first_length;
+
+    switch (instr.id) {
+    case Opcode::LUI_ADDI:
+        first.id = Opcode::LUI;
+        first.rd = instr.rd;
+        first.imm = instr.imm - instr.imm2;
+        second.id = Opcode::ADDI;
+        second.rd = second.rs1 = instr.rd;
+        second.imm = instr.imm2;
+        return 2;
+
+    case Opcode::AUIPC_LW:
+    case Opcode::AUIPC_JALR:
+        first.id = Opcode::AUIPC;
+        first.rd = instr.rs3;
+        first.imm = instr.imm;
+        second.id = instr.id == Opcode::AUIPC_LW ? Opcode::LW : Opcode::JALR;
+        second.rd = instr.rd;
+        second.rs1 = instr.rs3;
+        second.imm = instr.imm2;
+        return 2;
+
+    case Opcode::ADDI_BEQ:
+    case Opcode::ADDI_BNE:
+    case Opcode::ADDI_BLT:
+    case Opcode::ADDI_BGE:
+    case Opcode::ADDI_BLTU:
+    case Opcode::ADDI_BGEU:
+        first.id = Opcode::ADDI;
+        first.rd = instr.rd;
+        first.rs1 = instr.rs1;
+        first.imm = instr.imm;
+        second.id = unfused_branch(instr.id);
+        second.rs1 = instr.rs3;
+        second.rs2 = instr.rs2;
+        second.imm = instr.imm2 - instr.first_length;
+        return 2;
+
+    default:
+        first = instr;
+        return 1;
+    }
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+
+#include "opdefs.hpp"
+
+// Superinstructions: common pairs of a decoded block are rewritten into one fused entry,
+// so the interpreter dispatches once per pair. Guest state after a fused entry is exactly
+// the state after both instructions, only the number of dispatches changes.
+//
+// Operand layout of the fused entries:
+//   LUI_ADDI    rd,  imm = value of the pair, imm2 = ADDI immediate (LUI rd; ADDI rd, rd)
+//   AUIPC_LW    rs3 = AUIPC rd, imm = AUIPC immediate; rd, imm2 = LW rd and offset from rs3
+//   AUIPC_JALR  rs3 = AUIPC rd, imm = AUIPC immediate; rd, imm2 = JALR rd and offset from rs3
+//   ADDI_Bxx    rd, rs1, imm of ADDI; rs3, rs2 = operands of the branch, imm2 = its target - pc of the pair
+// length covers both instructions, first_length the first of them.
+
+// Fuses pairs of instrs in place, returns the new number of entries
+size_t fuse_block(Instruction* instrs, size_t length);
+
+// Guest instructions of an entry, 1 or 2 of them are written to parts
+size_t unfuse(const Instruction& instr, Instruction* parts);
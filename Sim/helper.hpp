@@ -3,6 +3,8 @@
 #include <cassert>
 
 #define REG_NUM 32
+// extra register slot, receives writes to x0 in cached blocks
+#define REG_ZERO_SINK REG_NUM
 
 #define OPCODE_MASK 0b1111111
 #define OPCODE_SHIFT 0
@@ -24,3 +26,17 @@ constexpr uint32_t slice(uint32_t word) {
   static_assert(msb >= lsb, "Error : illegal bits range");
   return (word & get_mask<msb, lsb>()) >> lsb;
 }
+
+// compilers emit bswap for it
+constexpr uint32_t byte_swap(uint32_t word) {
+  return (word >> 24) | ((word >> 8) & 0xff00) | ((word << 8) & 0xff0000) | (word << 24);
+}
+
+// orc.b: every nonzero byte to 0xff, the high bit of every byte tells if it is nonzero
+constexpr uint32_t or_combine_bytes(uint32_t word) {
+  uint32_t high = (((word & 0x7f7f7f7f) + 0x7f7f7f7f) | word) & 0x80808080;
+  return (high - (high >> 7)) | high;
+}
+
+static_assert(byte_swap(0x11223344) == 0x44332211);
+static_assert(or_combine_bytes(0x00801001) == 0x00ffffff);
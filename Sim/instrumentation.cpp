@@ -0,0 +1,43 @@
+#include "instrumentation.hpp"
+
+#include <charconv>
+
+void CountingInstrumentation::dump(std::ostream& out) const {
+    out << "Blocks: " << blocks << '\n'
+        << "Instructions: " << instructions << '\n'
+        << "Loads: " << loads << '\n'
+        << "Stores: " << stores << '\n'
+        << "Branches: " << branches << ", taken: " << taken_branches << '\n';
+}
+
+TracingInstrumentation::TracingInstrumentation(std::ostream& out) :
+    out(out)
+{
+    buffer.reserve(CAPACITY);
+}
+
+TracingInstrumentation::~TracingInstrumentation() {
+    flush();
+}
+
+void TracingInstrumentation::flush() {
+    out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    buffer.clear();
+}
+
+void TracingInstrumentation::event(char kind, uint32_t addr, uint32_t value, bool hex_value) {
+
+    static constexpr size_t MAX_LINE = 32;
+    if (buffer.size() + MAX_LINE > CAPACITY)
+        flush();
+
+    char line[MAX_LINE];
+    char* end = line;
+    *end++ = kind;
+    *end++ = ' ';
+    end = std::to_chars(end, line + MAX_LINE, addr, 16).ptr;
+    *end++ = ' ';
+    end = std::to_chars(end, line + MAX_LINE, value, hex_value ? 16 : 10).ptr;
+    *end++ = '\n';
+    buffer.append(line, end);
+}
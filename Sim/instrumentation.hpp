@@ -0,0 +1,121 @@
+#pragma once
+
+#include <concepts>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+
+// Instrumentation policies of Sim::run. The engines are instantiated for every policy, the hooks
+// are plain inline calls, so the uninstrumented engine has none at all and the others pay only
+// for what their hooks do. Hooks:
+//   block(pc, length)            - a block of length guest instructions starts at pc
+//   memory(addr, size, store)    - a load or store, LR, SC or AMO, before it is done; a vector
+//                                  unit-stride access is one of the range, others one per element
+//   branch(pc, target, taken)    - a conditional branch or a jump at pc, taken to target or not
+// Instrumented runs stay in the interpreter, translated blocks of the JIT and AOT have no hooks.
+
+template <typename T>
+concept InstrumentationPolicy = requires(T& policy, uint32_t value, bool flag) {
+    { T::enabled } -> std::convertible_to<bool>;
+    policy.block(value, value);
+    policy.memory(value, value, flag);
+    policy.branch(value, value, flag);
+};
+
+struct NoInstrumentation {
+    static constexpr bool enabled = false;
+
+    void block(uint32_t, uint32_t) {}
+    void memory(uint32_t, uint32_t, bool) {}
+    void branch(uint32_t, uint32_t, bool) {}
+};
+
+struct CountingInstrumentation {
+    static constexpr bool enabled = true;
+
+    uint64_t blocks = 0;
+    uint64_t instructions = 0;
+    uint64_t loads = 0;
+    uint64_t stores = 0;
+    uint64_t branches = 0;
+    uint64_t taken_branches = 0;
+
+    void block(uint32_t, uint32_t length) {
+        ++blocks;
+        instructions += length;
+    }
+
+    void memory(uint32_t, uint32_t, bool store) {
+        ++(store ? stores : loads);
+    }
+
+    void branch(uint32_t, uint32_t, bool taken) {
+        ++branches;
+        taken_branches += taken;
+    }
+
+    void dump(std::ostream& out) const;
+};
+
+// One line per event, formatted into a buffer of its own and written to out when it fills
+// and on destruction:
+//   B <pc> <length>
+//   L|S <addr> <size>
+//   J|N <pc> <target>      taken or not
+class TracingInstrumentation final {
+
+public:
+
+    static constexpr bool enabled = true;
+    static constexpr size_t CAPACITY = 64 * 1024;
+
+public:
+
+    explicit TracingInstrumentation(std::ostream& out);
+    ~TracingInstrumentation();
+
+    TracingInstrumentation(const TracingInstrumentation&) = delete;
+    TracingInstrumentation& operator=(const TracingInstrumentation&) = delete;
+
+public:
+
+    void block(uint32_t pc, uint32_t length) { event('B', pc, length, false); }
+    void memory(uint32_t addr, uint32_t size, bool store) { event(store ? 'S' : 'L', addr, size, false); }
+    void branch(uint32_t pc, uint32_t target, bool taken) { event(taken ? 'J' : 'N', pc, target, true); }
+
+    void flush();
+
+private:
+
+    void event(char kind, uint32_t addr, uint32_t value, bool hex_value);
+
+private:
+
+    std::ostream& out;
+    std::string buffer;
+};
+
+// Custom hooks, the unset ones are skipped
+struct CallbackInstrumentation {
+    static constexpr bool enabled = true;
+
+    std::function<void(uint32_t pc, uint32_t length)> on_block;
+    std::function<void(uint32_t addr, uint32_t size, bool store)> on_memory;
+    std::function<void(uint32_t pc, uint32_t target, bool taken)> on_branch;
+
+    void block(uint32_t pc, uint32_t length) {
+        if (on_block)
+            on_block(pc, length);
+    }
+
+    void memory(uint32_t addr, uint32_t size, bool store) {
+        if (on_memory)
+            on_memory(addr, size, store);
+    }
+
+    void branch(uint32_t pc, uint32_t target, bool taken) {
+        if (on_branch)
+            on_branch(pc, target, taken);
+    }
+};
@@ -0,0 +1,1017 @@
+#include "jit_x86_64.hpp"
+
+#ifdef HAS_JIT
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <vector>
+
+#include "decoder.hpp"
+#include "fusion.hpp"
+#include "helper.hpp"
+#include "memory.hpp"
+
+namespace {
+
+enum Reg : uint8_t {
+    RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+// argument registers of the native block
+constexpr Reg REGS_BASE = RDI;
+constexpr Reg MEM_BASE = RSI;
+
+// host registers which may hold guest registers, callee-saved ones first
+constexpr std::array<Reg, 10> allocatable = {RBX, RBP, R12, R13, R14, R15, R8, R9, R10, R11};
+
+constexpr bool callee_saved(Reg reg) {
+    return reg == RBX || reg == RBP || reg >= R12;
+}
+
+// x86 condition codes
+enum Cond : uint8_t {
+    CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7, CC_L = 0xC, CC_GE = 0xD, CC_G = 0xF,
+};
+
+// optional instructions of the host used by the bit manipulation extensions
+struct HostFeatures {
+    bool lzcnt;
+    bool bmi1;
+    bool bmi2;
+    bool popcnt;
+};
+
+const HostFeatures host = {
+    __builtin_cpu_supports("lzcnt") != 0,
+    __builtin_cpu_supports("bmi") != 0,
+    __builtin_cpu_supports("bmi2") != 0,
+    __builtin_cpu_supports("popcnt") != 0,
+};
+
+// F3 0F xx forms of lzcnt, tzcnt and popcnt
+constexpr uint8_t COUNT_LZCNT = 0xBD;
+constexpr uint8_t COUNT_TZCNT = 0xBC;
+constexpr uint8_t COUNT_POPCNT = 0xB8;
+
+// 0F xx forms of bts, btr and btc with a register bit offset
+constexpr uint8_t BIT_SET = 0xAB;
+constexpr uint8_t BIT_CLEAR = 0xB3;
+constexpr uint8_t BIT_INVERT = 0xBB;
+
+// ALU opcodes of the "op r/m32, r32" form and /digit of the "op r/m32, imm32" form
+struct AluOp {
+    uint8_t rr;
+    uint8_t digit;
+};
+
+constexpr AluOp ALU_ADD = {0x01, 0};
+constexpr AluOp ALU_OR  = {0x09, 1};
+constexpr AluOp ALU_AND = {0x21, 4};
+constexpr AluOp ALU_SUB = {0x29, 5};
+constexpr AluOp ALU_XOR = {0x31, 6};
+constexpr AluOp ALU_CMP = {0x39, 7};
+
+class Emitter final {
+
+public:
+
+    // bytes past capacity are counted but not written
+    Emitter(uint8_t* out, size_t capacity) : begin(out), capacity(capacity) {}
+
+    size_t size() const { return length; }
+    bool fits() const { return length <= capacity; }
+
+    void byte(uint8_t b) {
+        if (length < capacity)
+            begin[length] = b;
+        ++length;
+    }
+
+    void dword(uint32_t d) {
+        for (int i = 0; i < 4; ++i)
+            byte(static_cast<uint8_t>(d >> (8 * i)));
+    }
+
+    void rex(bool r, bool b) {
+        if (r || b)
+            byte(0x40 | (r << 2) | b);
+    }
+
+    void modrm(uint8_t mod, uint8_t reg, uint8_t rm) {
+        byte((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    // op r/m32(dst), r32(src)
+    void alu_rr(AluOp op, Reg dst, Reg src) {
+        rex(src >= R8, dst >= R8);
+        byte(op.rr);
+        modrm(0b11, src, dst);
+    }
+
+    // op r/m32(dst), imm32
+    void alu_ri(AluOp op, Reg dst, int32_t imm) {
+        rex(false, dst >= R8);
+        byte(0x81);
+        modrm(0b11, op.digit, dst);
+        dword(imm);
+    }
+
+    void mov_rr(Reg dst, Reg src) {
+        rex(src >= R8, dst >= R8);
+        byte(0x89);
+        modrm(0b11, src, dst);
+    }
+
+    void mov_ri(Reg dst, uint32_t imm) {
+        rex(false, dst >= R8);
+        byte(0xB8 + (dst & 7));
+        dword(imm);
+    }
+
+    void zero(Reg dst) {
+        alu_rr(ALU_XOR, dst, dst);
+    }
+
+    // mov r32, [base + disp32]
+    void load_disp(Reg dst, Reg base, int32_t disp) {
+        rex(dst >= R8, base >= R8);
+        byte(0x8B);
+        modrm(0b10, dst, base);
+        dword(disp);
+    }
+
+    // mov [base + disp32], r32
+    void store_disp(Reg base, int32_t disp, Reg src) {
+        rex(src >= R8, base >= R8);
+        byte(0x89);
+        modrm(0b10, src, base);
+        dword(disp);
+    }
+
+    // ModRM and SIB of [MEM_BASE + RAX]
+    void mem_operand(Reg reg) {
+        modrm(0b00, reg, 0b100);
+        byte((RAX << 3) | MEM_BASE);
+    }
+
+    // loads from [MEM_BASE + RAX] with zero or sign extension to 32 bits
+    void load_mem(Reg dst, uint8_t size, bool sign) {
+        if (size == 4) {
+            rex(dst >= R8, false);
+            byte(0x8B);
+        } else {
+            rex(dst >= R8, false);
+            byte(0x0F);
+            byte((size == 1 ? 0xB6 : 0xB7) | (sign ? 0x08 : 0));
+        }
+        mem_operand(dst);
+    }
+
+    // stores low size bytes of src (RCX) to [MEM_BASE + RAX]
+    void store_mem(Reg src, uint8_t size) {
+        if (size == 2)
+            byte(0x66);
+        byte(size == 1 ? 0x88 : 0x89);
+        mem_operand(src);
+    }
+
+    // rol/ror/shl/shr/sar r32, cl: digit 0/1/4/5/7
+    void shift_cl(uint8_t digit, Reg dst) {
+        rex(false, dst >= R8);
+        byte(0xD3);
+        modrm(0b11, digit, dst);
+    }
+
+    // rol/ror/shl/shr/sar r32, imm8: digit 0/1/4/5/7
+    void shift_ri(uint8_t digit, Reg dst, uint8_t imm) {
+        rex(false, dst >= R8);
+        byte(0xC1);
+        modrm(0b11, digit, dst);
+        byte(imm);
+    }
+
+    // dst = condition ? 1 : 0, dst must be RAX, RCX or RDX
+    void setcc(Cond cond, Reg dst) {
+        byte(0x0F);
+        byte(0x90 + cond);
+        modrm(0b11, 0, dst);
+        byte(0x0F);
+        byte(0xB6);
+        modrm(0b11, dst, dst);
+    }
+
+    void cmov(Cond cond, Reg dst, Reg src) {
+        rex(dst >= R8, src >= R8);
+        byte(0x0F);
+        byte(0x40 + cond);
+        modrm(0b11, dst, src);
+    }
+
+    // 3-byte VEX prefix of the 32-bit BMI forms, map 2 is 0F38 and 3 is 0F3A,
+    // pp 0 is no prefix and 3 is F2, vvvv is the second source
+    void vex(uint8_t map, uint8_t pp, Reg reg, Reg vvvv, Reg rm) {
+        byte(0xC4);
+        byte(((reg < R8) << 7) | (1 << 6) | ((rm < R8) << 5) | map);
+        byte(((~vvvv & 0xF) << 3) | pp);
+    }
+
+    // andn r32(dst), r32(a), r/m32(b): dst = ~a & b
+    void andn(Reg dst, Reg a, Reg b) {
+        vex(2, 0, dst, a, b);
+        byte(0xF2);
+        modrm(0b11, dst, b);
+    }
+
+    // rorx r32(dst), r/m32(src), imm8
+    void rorx(Reg dst, Reg src, uint8_t imm) {
+        vex(3, 3, dst, RAX, src);
+        byte(0xF0);
+        modrm(0b11, dst, src);
+        byte(imm);
+    }
+
+    // lzcnt/tzcnt/popcnt r32(dst), r/m32(src)
+    void count(uint8_t op, Reg dst, Reg src) {
+        byte(0xF3);
+        rex(dst >= R8, src >= R8);
+        byte(0x0F);
+        byte(op);
+        modrm(0b11, dst, src);
+    }
+
+    // bts/btr/btc r/m32(dst), r32(bit), the bit offset is taken modulo 32
+    void bit_rr(uint8_t op, Reg dst, Reg bit) {
+        rex(bit >= R8, dst >= R8);
+        byte(0x0F);
+        byte(op);
+        modrm(0b11, bit, dst);
+    }
+
+    void bswap(Reg reg) {
+        rex(false, reg >= R8);
+        byte(0x0F);
+        byte(0xC8 + (reg & 7));
+    }
+
+    void mfence() {
+        byte(0x0F);
+        byte(0xAE);
+        byte(0xF0);
+    }
+
+    void not_r(Reg reg) {
+        rex(false, reg >= R8);
+        byte(0xF7);
+        modrm(0b11, 2, reg);
+    }
+
+    // movsx/movzx r32, r8/r16 of the same register, which must be RAX, RCX or RDX
+    void extend(Reg reg, uint8_t size, bool sign) {
+        byte(0x0F);
+        byte((size == 1 ? 0xB6 : 0xB7) | (sign ? 0x08 : 0));
+        modrm(0b11, reg, reg);
+    }
+
+    // imul r32(dst), r/m32(src)
+    void imul_rr(Reg dst, Reg src) {
+        rex(dst >= R8, src >= R8);
+        byte(0x0F);
+        byte(0xAF);
+        modrm(0b11, dst, src);
+    }
+
+    // 64-bit forms on the scratch registers, for the high half of products
+    void imul64_rr(Reg dst, Reg src) {
+        byte(0x48);
+        byte(0x0F);
+        byte(0xAF);
+        modrm(0b11, dst, src);
+    }
+
+    // movsxd r64, r32
+    void sign_extend64(Reg reg) {
+        byte(0x48);
+        byte(0x63);
+        modrm(0b11, reg, reg);
+    }
+
+    void shr64_32(Reg reg) {
+        byte(0x48);
+        byte(0xC1);
+        modrm(0b11, 5, reg);
+        byte(32);
+    }
+
+    void test_rr(Reg dst, Reg src) {
+        rex(src >= R8, dst >= R8);
+        byte(0x85);
+        modrm(0b11, src, dst);
+    }
+
+    // EDX:EAX / r32, digit 6 for div, 7 for idiv
+    void divide(uint8_t digit, Reg divisor) {
+        rex(false, divisor >= R8);
+        byte(0xF7);
+        modrm(0b11, digit, divisor);
+    }
+
+    // sign extends EAX into EDX
+    void cdq() { byte(0x99); }
+
+    void push(Reg reg) {
+        rex(false, reg >= R8);
+        byte(0x50 + (reg & 7));
+    }
+
+    void pop(Reg reg) {
+        rex(false, reg >= R8);
+        byte(0x58 + (reg & 7));
+    }
+
+    void ret() { byte(0xC3); }
+
+    // cmp byte [MEM_BASE + index + disp32], 0
+    void cmp_mem_byte_zero(Reg index, int32_t disp) {
+        rex(false, false);
+        byte(0x80);
+        modrm(0b10, 7, 0b100);
+        byte(((index & 7) << 3) | MEM_BASE);
+        dword(disp);
+        byte(0);
+    }
+
+    // jcc rel32 / jmp rel32 to a label which is bound later, returns the position to patch
+    size_t jcc_forward(Cond cond) {
+        byte(0x0F);
+        byte(0x80 + cond);
+        dword(0);
+        return size();
+    }
+
+    size_t jmp_forward() {
+        byte(0xE9);
+        dword(0);
+        return size();
+    }
+
+    // binds the jump ending at position to the current position
+    void bind(size_t position) {
+        int32_t rel = static_cast<int32_t>(size() - position);
+        if (position <= capacity)
+            std::memcpy(begin + position - 4, &rel, sizeof(rel));
+    }
+
+private:
+
+    uint8_t* begin;
+    size_t capacity;
+    size_t length = 0;
+};
+
+// bytes [low, high) from the base register, their first and last pages are checked
+struct StoreCheck {
+    int32_t low;
+    int32_t high;
+};
+
+// Translation of one block, guest registers are either bound to a host register
+// or accessed in the register file, x0 reads as zero and REG_ZERO_SINK writes are dropped.
+class Translator final {
+
+public:
+
+    Translator(uint8_t* out, size_t capacity) : emit(out, capacity) {}
+
+    size_t size() const { return emit.size(); }
+    bool fits() const { return emit.fits(); }
+
+    bool translate(const Block& block, const Instruction* instrs);
+
+private:
+
+    bool supported(Opcode id) const;
+    void allocate(const Instruction* instrs, uint32_t length);
+
+    void prologue();
+    void epilogue(bool all_registers = false);
+
+    void read(Reg dst, uint8_t guest);
+    void write(uint8_t guest, Reg src);
+    void write_imm(uint8_t guest, uint32_t imm);
+
+    void alu(AluOp op, const Instruction& in);
+    void alu_imm(AluOp op, const Instruction& in);
+    void alu_imm(AluOp op, const Instruction& in, int32_t imm);
+    void set_if(Cond cond, const Instruction& in, bool with_imm);
+    void shift(uint8_t digit, const Instruction& in);
+    void shift_imm(uint8_t digit, const Instruction& in);
+    void mul(const Instruction& in);
+    void shift_add(uint8_t amount, const Instruction& in);
+    void logic_not(const Instruction& in);
+    void min_max(Cond take_rs2, const Instruction& in);
+    void count(uint8_t op, const Instruction& in);
+    void extend(uint8_t size, bool sign, const Instruction& in);
+    void or_combine(const Instruction& in);
+    void bit(uint8_t op, const Instruction& in);
+    void bit_extract(const Instruction& in, bool with_imm);
+    void divide(const Instruction& in);
+    void load(const Instruction& in, uint8_t size, bool sign);
+    void plan_store_checks(const Instruction* instrs, uint32_t length);
+    void store(const Instruction& in, uint8_t size, uint32_t pc, const std::optional<StoreCheck>& check);
+    void address(const Instruction& in);
+    void branch(Cond cond, const Instruction& in, uint32_t pc);
+
+private:
+
+    Emitter emit;
+
+    // host register of every guest register, RSP if it lives in the register file
+    std::array<Reg, REG_NUM + 1> binding = {};
+    std::array<bool, REG_NUM + 1> dirty = {};
+    std::array<Reg, allocatable.size()> saved = {};
+    size_t saved_num = 0;
+
+    // page flags check done before a store, if any
+    std::vector<std::optional<StoreCheck>> store_checks;
+
+    // stores to flagged pages leave the block: jump to patch and pc of the store
+    std::vector<std::pair<size_t, uint32_t>> flagged_exits;
+};
+
+bool Translator::supported(Opcode id) const {
+    switch (id) {
+    case Opcode::NONE:
+    case Opcode::EBREAK:
+    case Opcode::ECALL:
+    case Opcode::PAUSE:
+    case Opcode::SBREAK:
+    case Opcode::SCALL:
+    // floating point and vector state live in Fpu and Vpu
+    case Opcode::CSRRC:
+    case Opcode::CSRRCI:
+    case Opcode::CSRRS:
+    case Opcode::CSRRSI:
+    case Opcode::CSRRW:
+    case Opcode::CSRRWI:
+    // the reservation of LR/SC and code stored by other harts live in Sim
+    case Opcode::FENCE_I:
+        return false;
+    // counts without the host instructions are left to the interpreter
+    case Opcode::CLZ:
+        return host.lzcnt;
+    case Opcode::CTZ:
+        return host.bmi1;
+    case Opcode::CPOP:
+        return host.popcnt;
+    default:
+        return !is_atomic(id) && !is_float(id) && !is_vector(id);
+    }
+}
+
+// binds the most used guest registers of the block to host registers
+void Translator::allocate(const Instruction* instrs, uint32_t length) {
+
+    std::array<uint32_t, REG_NUM + 1> uses = {};
+    for (uint32_t i = 0; i < length; ++i) {
+        ++uses[instrs[i].rs1];
+        ++uses[instrs[i].rs2];
+        ++uses[instrs[i].rd];
+    }
+    uses[0] = uses[REG_ZERO_SINK] = 0;
+
+    std::array<uint8_t, REG_NUM + 1> order = {};
+    for (uint8_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](uint8_t a, uint8_t b) { return uses[a] > uses[b]; });
+
+    binding.fill(RSP);
+    for (size_t i = 0; i < allocatable.size() && uses[order[i]]; ++i) {
+        binding[order[i]] = allocatable[i];
+        if (callee_saved(allocatable[i]))
+            saved[saved_num++] = allocatable[i];
+    }
+}
+
+void Translator::prologue() {
+    for (size_t i = 0; i < saved_num; ++i)
+        emit.push(saved[i]);
+
+    for (uint8_t guest = 1; guest < REG_NUM; ++guest) {
+        if (binding[guest] != RSP)
+            emit.load_disp(binding[guest], REGS_BASE, guest * sizeof(uint32_t));
+    }
+}
+
+// next pc is in RAX
+void Translator::epilogue(bool all_registers) {
+    for (uint8_t guest = 1; guest < REG_NUM; ++guest) {
+        if (binding[guest] != RSP && (dirty[guest] || all_registers))
+            emit.store_disp(REGS_BASE, guest * sizeof(uint32_t), binding[guest]);
+    }
+
+    for (size_t i = saved_num; i > 0; --i)
+        emit.pop(saved[i - 1]);
+
+    emit.ret();
+}
+
+void Translator::read(Reg dst, uint8_t guest) {
+    if (guest == 0)
+        emit.zero(dst);
+    else if (binding[guest] != RSP)
+        emit.mov_rr(dst, binding[guest]);
+    else
+        emit.load_disp(dst, REGS_BASE, guest * sizeof(uint32_t));
+}
+
+void Translator::write(uint8_t guest, Reg src) {
+    if (guest == REG_ZERO_SINK || guest == 0)
+        return;
+
+    if (binding[guest] != RSP) {
+        emit.mov_rr(binding[guest], src);
+        dirty[guest] = true;
+    }
+    else
+        emit.store_disp(REGS_BASE, guest * sizeof(uint32_t), src);
+}
+
+void Translator::write_imm(uint8_t guest, uint32_t imm) {
+    emit.mov_ri(RAX, imm);
+    write(guest, RAX);
+}
+
+void Translator::alu(AluOp op, const Instruction& in) {
+    read(RAX, in.rs1);
+    read(RCX, in.rs2);
+    emit.alu_rr(op, RAX, RCX);
+    write(in.rd, RAX);
+}
+
+void Translator::alu_imm(AluOp op, const Instruction& in) {
+    alu_imm(op, in, in.imm);
+}
+
+void Translator::alu_imm(AluOp op, const Instruction& in, int32_t imm) {
+    read(RAX, in.rs1);
+    emit.alu_ri(op, RAX, imm);
+    write(in.rd, RAX);
+}
+
+void Translator::set_if(Cond cond, const Instruction& in, bool with_imm) {
+    read(RAX, in.rs1);
+    if (with_imm) {
+        emit.alu_ri(ALU_CMP, RAX, in.imm);
+    } else {
+        read(RCX, in.rs2);
+        emit.alu_rr(ALU_CMP, RAX, RCX);
+    }
+    emit.setcc(cond, RAX);
+    write(in.rd, RAX);
+}
+
+void Translator::shift(uint8_t digit, const Instruction& in) {
+    read(RAX, in.rs1);
+    read(RCX, in.rs2);
+    emit.shift_cl(digit, RAX);
+    write(in.rd, RAX);
+}
+
+void Translator::shift_imm(uint8_t digit, const Instruction& in) {
+    read(RAX, in.rs1);
+    emit.shift_ri(digit, RAX, static_cast<uint8_t>(in.imm));
+    write(in.rd, RAX);
+}
+
+void Translator::mul(const Instruction& in) {
+    read(RAX, in.rs1);
+    read(RCX, in.rs2);
+
+    if (in.id == Opcode::MUL) {
+        emit.imul_rr(RAX, RCX);
+    } else {
+        // 32-bit ops leave the upper halves cleared, sign extension where the operand is signed
+        if (in.id != Opcode::MULHU)
+            emit.sign_extend64(RAX);
+        if (in.id == Opcode::MULH)
+            emit.sign_extend64(RCX);
+        emit.imul64_rr(RAX, RCX);
+        emit.shr64_32(RAX);
+    }
+
+    write(in.rd, RAX);
+}
+
+void Translator::shift_add(uint8_t amount, const Instruction& in) {
+    read(RAX, in.rs1);
+    read(RCX, in.rs2);
+    emit.shift_ri(4, RAX, amount);
+    emit.alu_rr(ALU_ADD, RAX, RCX);
+    write(in.rd, RAX);
+}
+
+// andn, orn and xnor
+void Translator::logic_not(const Instruction& in) {
+    read(RAX, in.rs1);
+    read(RCX, in.rs2);
+
+    if (in.id == Opcode::ANDN && host.bmi1) {
+        emit.andn(RAX, RCX, RAX);
+    } else if (in.id == Opcode::XNOR) {
+        emit.alu_rr(ALU_XOR, RAX, RCX);
+        emit.not_r(RAX);
+    } else {
+        emit.not_r(RCX);
+        emit.alu_rr(in.id == Opcode::ANDN ? ALU_AND : ALU_OR, RAX, RCX);
+    }
+
+    write(in.rd, RAX);
+}
+
+void Translator::min_max(Cond take_rs2, const Instruction& in) {
+    read(RAX, in.rs1);
+    read(RCX, in.rs2);
+    emit.alu_rr(ALU_CMP, RAX, RCX);
+    emit.cmov(take_rs2, RAX, RCX);
+    write(in.rd, RAX);
+}
+
+// lzcnt and tzcnt give 32 for zero as clz and ctz do
+void Translator::count(uint8_t op, const Instruction& in) {
+    read(RAX, in.rs1);
+    emit.count(op, RAX, RAX);
+    write(in.rd, RAX);
+}
+
+void Translator::extend(uint8_t size, bool sign, const Instruction& in) {
+    read(RAX, in.rs1);
+    emit.extend(RAX, size, sign);
+    write(in.rd, RAX);
+}
+
+// same steps as or_combine_bytes
+void Translator::or_combine(const Instruction& in) {
+    read(RAX, in.rs1);
+    emit.mov_rr(RCX, RAX);
+    emit.alu_ri(ALU_AND, RCX, 0x7f7f7f7f);
+    emit.alu_ri(ALU_ADD, RCX, 0x7f7f7f7f);
+    emit.alu_rr(ALU_OR, RCX, RAX);
+    emit.alu_ri(ALU_AND, RCX, static_cast<int32_t>(0x80808080));
+    emit.mov_rr(RDX, RCX);
+    emit.shift_ri(5, RDX, 7);
+    emit.mov_rr(RAX, RCX);
+    emit.alu_rr(ALU_SUB, RAX, RDX);
+    emit.alu_rr(ALU_OR, RAX, RCX);
+    write(in.rd, RAX);
+}
+
+// bset, bclr and binv
+void Translator::bit(uint8_t op, const Instruction& in) {
+    read(RAX, in.rs1);
+    read(RCX, in.rs2);
+    emit.bit_rr(op, RAX, RCX);
+    write(in.rd, RAX);
+}
+
+void Translator::bit_extract(const Instruction& in, bool with_imm) {
+    read(RAX, in.rs1);
+    if (with_imm) {
+        emit.shift_ri(5, RAX, static_cast<uint8_t>(in.imm));
+    } else {
+        read(RCX, in.rs2);
+        emit.shift_cl(5, RAX);
+    }
+    emit.alu_ri(ALU_AND, RAX, 1);
+    write(in.rd, RAX);
+}
+
+// Division by zero and INT_MIN / -1 are handled before the host instruction, which would trap on them
+void Translator::divide(const Instruction& in) {
+    bool is_signed = in.id == Opcode::DIV || in.id == Opcode::REM;
+    bool is_rem = in.id == Opcode::REM || in.id == Opcode::REMU;
+
+    read(RAX, in.rs1);
+    read(RCX, in.rs2);
+
+    std::vector<size_t> to_done;
+
+    emit.test_rr(RCX, RCX);
+    size_t by_zero = emit.jcc_forward(CC_E);
+
+    size_t overflow = 0;
+    if (is_signed) {
+        emit.alu_ri(ALU_CMP, RCX, -1);
+        size_t regular = emit.jcc_forward(CC_NE);
+        emit.alu_ri(ALU_CMP, RAX, INT32_MIN);
+        overflow = emit.jcc_forward(CC_E);
+        emit.bind(regular);
+        emit.cdq();
+        emit.divide(7, RCX);
+    } else {
+        emit.zero(RDX);
+        emit.divide(6, RCX);
+    }
+    if (is_rem)
+        emit.mov_rr(RAX, RDX);
+    to_done.push_back(emit.jmp_forward());
+
+    // x / 0 = -1, x % 0 = x
+    emit.bind(by_zero);
+    if (!is_rem)
+        emit.mov_ri(RAX, ~0u);
+
+    // INT_MIN / -1 = INT_MIN, INT_MIN % -1 = 0
+    if (is_signed) {
+        to_done.push_back(emit.jmp_forward());
+        emit.bind(overflow);
+        if (is_rem)
+            emit.zero(RAX);
+    }
+
+    for (size_t position : to_done)
+        emit.bind(position);
+
+    write(in.rd, RAX);
+}
+
+// RAX = rs1 + imm, upper half of RAX is cleared by the 32-bit ops
+void Translator::address(const Instruction& in) {
+    read(RAX, in.rs1);
+    if (in.imm)
+        emit.alu_ri(ALU_ADD, RAX, in.imm);
+}
+
+void Translator::load(const Instruction& in, uint8_t size, bool sign) {
+    address(in);
+    emit.load_mem(RAX, size, sign);
+    write(in.rd, RAX);
+}
+
+static uint8_t store_size(Opcode id) {
+    switch (id) {
+    case Opcode::SB: return 1;
+    case Opcode::SH: return 2;
+    case Opcode::SW: return 4;
+    default:         return 0;
+    }
+}
+
+// Stores through the same base register, not written in between, share one page flags check
+// at the first of them while they fit in 4 KiB, so the pages of their first and last byte
+// are all the pages they touch.
+void Translator::plan_store_checks(const Instruction* instrs, uint32_t length) {
+
+    store_checks.assign(length, std::nullopt);
+
+    std::array<int64_t, REG_NUM + 1> first = {};
+    std::array<int64_t, REG_NUM + 1> low = {};
+    std::array<int64_t, REG_NUM + 1> high = {};
+    first.fill(-1);
+
+    for (uint32_t i = 0; i < length; ++i) {
+        const Instruction& in = instrs[i];
+
+        if (uint8_t size = store_size(in.id)) {
+            uint8_t base = in.rs1;
+            int64_t from = std::min<int64_t>(low[base], in.imm);
+            int64_t to = std::max<int64_t>(high[base], int64_t(in.imm) + size);
+
+            if (first[base] >= 0 && to - from <= PagedMemory::PAGE_SIZE) {
+                low[base] = from;
+                high[base] = to;
+            } else {
+                first[base] = i;
+                low[base] = in.imm;
+                high[base] = int64_t(in.imm) + size;
+            }
+            store_checks[first[base]] = StoreCheck{static_cast<int32_t>(low[base]), static_cast<int32_t>(high[base])};
+        }
+
+        first[in.rd] = -1;
+    }
+}
+
+// A store to a page with flags, e.g. holding code, leaves the block with pc | 1 before storing,
+// the interpreter continues from the store. The flags check is a plain byte load, which is
+// a relaxed atomic load on x86-64, as PageFlags reads them.
+void Translator::store(const Instruction& in, uint8_t size, uint32_t pc, const std::optional<StoreCheck>& check) {
+    if (check) {
+        read(RDX, in.rs1);
+        emit.mov_rr(RCX, RDX);
+        if (check->low)
+            emit.alu_ri(ALU_ADD, RDX, check->low);
+        emit.alu_ri(ALU_ADD, RCX, check->high - 1);
+        for (Reg page : {RDX, RCX}) {
+            emit.shift_ri(5, page, PageFlags::PAGE_BITS);
+            emit.cmp_mem_byte_zero(page, -static_cast<int32_t>(ReservedMemory::FLAGS_SIZE));
+            flagged_exits.emplace_back(emit.jcc_forward(CC_NE), pc);
+        }
+    }
+
+    address(in);
+    read(RCX, in.rs2);
+    emit.store_mem(RCX, size);
+}
+
+// RAX = condition ? pc + imm : next pc
+void Translator::branch(Cond cond, const Instruction& in, uint32_t pc) {
+    read(RAX, in.rs1);
+    read(RCX, in.rs2);
+    emit.alu_rr(ALU_CMP, RAX, RCX);
+    emit.mov_ri(RAX, pc + in.length);
+    emit.mov_ri(RDX, pc + in.imm);
+    emit.cmov(cond, RAX, RDX);
+}
+
+bool Translator::translate(const Block& block, const Instruction* instrs) {
+
+    for (uint32_t i = 0; i < block.length; ++i) {
+        if (!supported(instrs[i].id))
+            return false;
+    }
+
+    allocate(instrs, block.length);
+    plan_store_checks(instrs, block.length);
+    prologue();
+
+    uint32_t pc = block.pc;
+    bool exited = false;
+
+    for (uint32_t i = 0; i < block.length; pc += instrs[i++].length) {
+
+        const Instruction& in = instrs[i];
+
+        switch (in.id) {
+        case Opcode::ADD:   alu(ALU_ADD, in); break;
+        case Opcode::SUB:   alu(ALU_SUB, in); break;
+        case Opcode::XOR:   alu(ALU_XOR, in); break;
+        case Opcode::OR:    alu(ALU_OR, in); break;
+        case Opcode::AND:   alu(ALU_AND, in); break;
+        case Opcode::ADDI:  alu_imm(ALU_ADD, in); break;
+        case Opcode::XORI:  alu_imm(ALU_XOR, in); break;
+        case Opcode::ORI:   alu_imm(ALU_OR, in); break;
+        case Opcode::ANDI:  alu_imm(ALU_AND, in); break;
+        case Opcode::SLT:   set_if(CC_L, in, false); break;
+        case Opcode::SLTU:  set_if(CC_B, in, false); break;
+        case Opcode::SLTI:  set_if(CC_L, in, true); break;
+        case Opcode::SLTIU: set_if(CC_B, in, true); break;
+        case Opcode::SLL:   shift(4, in); break;
+        case Opcode::SRL:   shift(5, in); break;
+        case Opcode::SRA:   shift(7, in); break;
+        case Opcode::SLLI:  shift_imm(4, in); break;
+        case Opcode::SRLI:  shift_imm(5, in); break;
+        case Opcode::SRAI:  shift_imm(7, in); break;
+        case Opcode::MUL:
+        case Opcode::MULH:
+        case Opcode::MULHSU:
+        case Opcode::MULHU: mul(in); break;
+        case Opcode::DIV:
+        case Opcode::DIVU:
+        case Opcode::REM:
+        case Opcode::REMU:  divide(in); break;
+        case Opcode::SH1ADD: shift_add(1, in); break;
+        case Opcode::SH2ADD: shift_add(2, in); break;
+        case Opcode::SH3ADD: shift_add(3, in); break;
+        case Opcode::ANDN:
+        case Opcode::ORN:
+        case Opcode::XNOR:   logic_not(in); break;
+        case Opcode::MIN:    min_max(CC_G, in); break;
+        case Opcode::MINU:   min_max(CC_A, in); break;
+        case Opcode::MAX:    min_max(CC_L, in); break;
+        case Opcode::MAXU:   min_max(CC_B, in); break;
+        case Opcode::CLZ:    count(COUNT_LZCNT, in); break;
+        case Opcode::CTZ:    count(COUNT_TZCNT, in); break;
+        case Opcode::CPOP:   count(COUNT_POPCNT, in); break;
+        case Opcode::SEXT_B: extend(1, true, in); break;
+        case Opcode::SEXT_H: extend(2, true, in); break;
+        case Opcode::ZEXT_H: extend(2, false, in); break;
+        case Opcode::ROL:    shift(0, in); break;
+        case Opcode::ROR:    shift(1, in); break;
+        case Opcode::RORI:
+            if (host.bmi2) {
+                read(RAX, in.rs1);
+                emit.rorx(RAX, RAX, static_cast<uint8_t>(in.imm));
+                write(in.rd, RAX);
+            } else {
+                shift_imm(1, in);
+            }
+            break;
+        case Opcode::ORC_B:  or_combine(in); break;
+        case Opcode::REV8:
+            read(RAX, in.rs1);
+            emit.bswap(RAX);
+            write(in.rd, RAX);
+            break;
+        case Opcode::BSET:   bit(BIT_SET, in); break;
+        case Opcode::BCLR:   bit(BIT_CLEAR, in); break;
+        case Opcode::BINV:   bit(BIT_INVERT, in); break;
+        case Opcode::BEXT:   bit_extract(in, false); break;
+        case Opcode::BSETI:  alu_imm(ALU_OR, in, static_cast<int32_t>(1u << in.imm)); break;
+        case Opcode::BCLRI:  alu_imm(ALU_AND, in, static_cast<int32_t>(~(1u << in.imm))); break;
+        case Opcode::BINVI:  alu_imm(ALU_XOR, in, static_cast<int32_t>(1u << in.imm)); break;
+        case Opcode::BEXTI:  bit_extract(in, true); break;
+        case Opcode::LUI:   write_imm(in.rd, in.imm); break;
+        case Opcode::AUIPC: write_imm(in.rd, pc + in.imm); break;
+        case Opcode::LB:    load(in, 1, true); break;
+        case Opcode::LBU:   load(in, 1, false); break;
+        case Opcode::LH:    load(in, 2, true); break;
+        case Opcode::LHU:   load(in, 2, false); break;
+        case Opcode::LW:    load(in, 4, false); break;
+        case Opcode::SB:
+        case Opcode::SH:
+        case Opcode::SW:    store(in, store_size(in.id), pc, store_checks[i]); break;
+        // stores pass loads on x86-64, only the full fence needs an instruction
+        case Opcode::FENCE: emit.mfence(); break;
+        case Opcode::FENCE_TSO:
+            break;
+        case Opcode::BEQ:   branch(CC_E, in, pc); exited = true; break;
+        case Opcode::BNE:   branch(CC_NE, in, pc); exited = true; break;
+        case Opcode::BLT:   branch(CC_L, in, pc); exited = true; break;
+        case Opcode::BGE:   branch(CC_GE, in, pc); exited = true; break;
+        case Opcode::BLTU:  branch(CC_B, in, pc); exited = true; break;
+        case Opcode::BGEU:  branch(CC_AE, in, pc); exited = true; break;
+        case Opcode::JAL:
+            write_imm(in.rd, pc + in.length);
+            emit.mov_ri(RAX, pc + in.imm);
+            exited = true;
+            break;
+        case Opcode::JALR:
+            // target first, rd may be the same register as rs1
+            address(in);
+            emit.alu_ri(ALU_AND, RAX, ~1);
+            emit.mov_ri(RCX, pc + in.length);
+            write(in.rd, RCX);
+            exited = true;
+            break;
+        default:
+            return false;
+        }
+    }
+
+    // block cut at MAX_BLOCK_LENGTH continues at the next instruction
+    if (!exited)
+        emit.mov_ri(RAX, pc);
+
+    epilogue();
+
+    // registers written before the store may be clean or dirty, all of them are stored back
+    if (!flagged_exits.empty()) {
+        std::vector<size_t> to_exit;
+        for (auto [position, store_pc] : flagged_exits) {
+            emit.bind(position);
+            emit.mov_ri(RAX, store_pc | 1);
+            to_exit.push_back(emit.jmp_forward());
+        }
+        for (size_t position : to_exit)
+            emit.bind(position);
+        epilogue(true);
+    }
+
+    return true;
+}
+
+} // namespace
+
+Jit::~Jit() {
+    if (code)
+        munmap(code, code_size);
+}
+
+NativeBlock Jit::translate(const Block& block, const Instruction* instrs) {
+
+    if (!code) {
+        void* mapping = mmap(nullptr, code_size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED) {
+            throw std::runtime_error("Can't allocate JIT code buffer");
+        }
+        code = static_cast<uint8_t*>(mapping);
+    }
+
+    // fused entries are translated as their guest instructions
+    std::vector<Instruction> guest_instrs;
+    guest_instrs.reserve(block.length);
+    for (uint32_t i = 0; i < block.size; ++i) {
+        Instruction parts[2];
+        size_t parts_num = unfuse(instrs[i], parts);
+        guest_instrs.insert(guest_instrs.end(), parts, parts + parts_num);
+    }
+
+    Translator translator(code + used, code_size - used);
+    bool translated = translator.translate(block, guest_instrs.data());
+    out_of_space = translated && !translator.fits();
+    if (!translated || out_of_space)
+        return nullptr;
+
+    NativeBlock native = reinterpret_cast<NativeBlock>(code + used);
+    // keep entries aligned
+    used += (translator.size() + 15) & ~size_t(15);
+    return native;
+}
+
+#endif
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "block_cache.hpp"
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define HAS_JIT
+#endif
+
+// Translator of hot blocks into native x86-64 code (System V ABI).
+// Translated block is called as native(registers, memory base) and returns the next pc.
+// Guest registers used in the block are kept in host registers between its entry and exit.
+// Before a store to a page with flags the block returns the pc of the store | 1,
+// so the store and the rest of the block run in the interpreter.
+// Blocks with instructions the translator doesn't know are left to the interpreter.
+class Jit final {
+
+public:
+
+    // executions of a block before it gets translated, by default
+    static constexpr uint32_t HOT_THRESHOLD = 64;
+
+    static constexpr size_t CODE_SIZE = 32 << 20;
+
+public:
+
+    // code_size is rounded down to the alignment of the entries
+    explicit Jit(size_t code_size = CODE_SIZE) : code_size(code_size & ~size_t(15)) {}
+    ~Jit();
+
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+public:
+
+    // nullptr if the block can't be translated or its code doesn't fit in the rest of the buffer
+    NativeBlock translate(const Block& block, const Instruction* instrs);
+
+    // the last translated block didn't fit, native code of all blocks must be dropped before reset
+    bool full() const { return out_of_space; }
+    void reset() {
+        used = 0;
+        out_of_space = false;
+    }
+
+private:
+
+    uint8_t* code = nullptr;
+    size_t code_size;
+    size_t used = 0;
+    bool out_of_space = false;
+};
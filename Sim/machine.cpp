@@ -0,0 +1,104 @@
+#include "machine.hpp"
+
+#include <algorithm>
+#include <exception>
+#include <thread>
+
+// hart executing on this thread, stores to code are reported in the thread of the storing hart
+static thread_local const Sim* running_hart = nullptr;
+
+Machine::Machine(const std::string& elf_filename, unsigned harts_num, const SimOptions& options) :
+    memory_backend(options.memory_backend)
+{
+    if (!harts_num) {
+        throw std::invalid_argument("Machine needs at least one hart");
+    }
+
+    harts.push_back(std::make_unique<Sim>(elf_filename, options));
+    for (unsigned i = 1; i < harts_num; ++i) {
+        harts.push_back(std::make_unique<Sim>(*harts[0], i, options));
+    }
+
+    if (harts_num > 1) {
+        harts[0]->on_code_write([this](uint32_t addr, uint32_t size) {
+            for (auto& hart : harts)
+                hart->code_written(addr, size, hart.get() == running_hart);
+        });
+    }
+}
+
+std::vector<size_t> Machine::run(const RunLimits& limits) {
+
+    // page table and TLB of the paged backend are not shared between threads
+    if (harts.size() > 1 && memory_backend != MemoryBackend::Reserved) {
+        throw std::invalid_argument("Free-running harts need the reserved memory backend");
+    }
+
+    std::vector<size_t> instr_counts(harts.size());
+    std::vector<std::exception_ptr> errors(harts.size());
+
+    auto run_hart = [&](size_t i) {
+        running_hart = harts[i].get();
+        try {
+            instr_counts[i] = harts[i]->run(limits).instr_count;
+        }
+        catch (...) {
+            errors[i] = std::current_exception();
+        }
+        running_hart = nullptr;
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < harts.size(); ++i)
+        threads.emplace_back(run_hart, i);
+
+    run_hart(0);
+
+    for (auto& thread : threads)
+        thread.join();
+
+    for (auto& error : errors) {
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    return instr_counts;
+}
+
+std::vector<size_t> Machine::run_deterministic(size_t quantum, const RunLimits& limits) {
+
+    if (!quantum) {
+        throw std::invalid_argument("Quantum must be at least one instruction");
+    }
+
+    std::vector<size_t> instr_counts(harts.size());
+
+    bool timed = limits.deadline != std::chrono::steady_clock::time_point::max();
+
+    bool running = true;
+    while (running) {
+        running = false;
+        for (size_t i = 0; i < harts.size(); ++i) {
+            Sim& hart = *harts[i];
+            if (hart.halted() || instr_counts[i] >= limits.budget)
+                continue;
+
+            running_hart = &hart;
+            instr_counts[i] += hart.run(std::min(quantum, limits.budget - instr_counts[i]));
+            running |= !hart.halted() && instr_counts[i] < limits.budget;
+        }
+
+        if (limits.stop && limits.stop->load(std::memory_order_relaxed))
+            break;
+        if (timed && std::chrono::steady_clock::now() >= limits.deadline)
+            break;
+    }
+
+    running_hart = nullptr;
+    return instr_counts;
+}
+
+void Machine::load_aot(const std::string& path) {
+    for (auto& hart : harts)
+        hart->load_aot(path);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Sim.hpp"
+
+// Harts sharing one guest memory. They run either free on host threads of their own,
+// or interleaved in fixed quanta of instructions on one host thread, with the same results every run.
+// All of them start at the entry point and tell themselves apart by mhartid, also passed in a0.
+// Free-running harts need the reserved memory backend, which they address without any locking:
+// plain loads and stores are host loads and stores, atomics are host atomics.
+// Each hart decodes and translates code on its own, stores to code reach the other harts
+// through on_code_write and become visible to them at their next FENCE.I.
+class Machine final {
+
+public:
+
+    Machine(const std::string& elf_filename, unsigned harts_num, const SimOptions& options = {});
+
+public:
+
+    // Runs every hart until it halts or hits limits, hart 0 on the calling thread. Every hart has
+    // the whole budget, the deadline and the stop flag are common.
+    // Returns the instructions executed by every hart, rethrows the first exception of a hart
+    // after all of them stopped. A hart which throws stops alone.
+    std::vector<size_t> run(const RunLimits& limits = {});
+
+    // Deterministic schedule: runs the harts in turn on the calling thread, each for quantum
+    // instructions rounded up to the end of a block, until all of them halt. Smaller quanta
+    // interleave the harts more finely, larger ones switch less often and run faster.
+    // Every hart has the whole budget, the deadline and the stop flag are checked between quanta.
+    // Returns the instructions executed by every hart.
+    std::vector<size_t> run_deterministic(size_t quantum, const RunLimits& limits = {});
+
+    void load_aot(const std::string& path);
+
+    size_t harts_num() const { return harts.size(); }
+    Sim& hart(size_t i) { return *harts[i]; }
+
+private:
+
+    std::vector<std::unique_ptr<Sim>> harts;
+    MemoryBackend memory_backend;
+};
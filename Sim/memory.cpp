@@ -0,0 +1,199 @@
+#include "memory.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef HAS_RESERVED_MEMORY
+#include <sys/mman.h>
+#endif
+
+static const uint8_t zero_page[PagedMemory::PAGE_SIZE] = {};
+
+void PageFlags::set_code(uint32_t page, bool code) {
+    std::atomic_ref<uint8_t> flag(flags[page]);
+    if (code) {
+        flag.fetch_or(CODE, std::memory_order_relaxed);
+        if (page)
+            std::atomic_ref<uint8_t>(flags[page - 1]).fetch_or(NEXT_CODE, std::memory_order_relaxed);
+    } else {
+        flag.fetch_and(~CODE, std::memory_order_relaxed);
+        if (page)
+            std::atomic_ref<uint8_t>(flags[page - 1]).fetch_and(~NEXT_CODE, std::memory_order_relaxed);
+    }
+}
+
+void PageFlags::written(uint32_t addr, size_t size) const {
+    if (!code_write_hook || !size)
+        return;
+
+    uint32_t last = static_cast<uint32_t>((uint64_t(addr) + size - 1) >> PAGE_BITS);
+    for (uint32_t page = addr >> PAGE_BITS; page <= last; ++page) {
+        if ((*this)[page] & CODE) {
+            code_write_hook(addr, static_cast<uint32_t>(size));
+            return;
+        }
+    }
+}
+
+void PageFlags::watch_all() {
+    for (size_t page = 0; page < PAGES_NUM; ++page) {
+        // single hart, no other thread changes the flags meanwhile
+        std::atomic_ref<uint8_t> flag(flags[page]);
+        uint8_t watched = page + 1 < PAGES_NUM ? WATCHED | NEXT_WATCHED : WATCHED;
+        flag.store(flag.load(std::memory_order_relaxed) | watched, std::memory_order_relaxed);
+    }
+}
+
+void PageFlags::set_watched(uint32_t page, bool watched) {
+    std::atomic_ref<uint8_t> flag(flags[page]);
+    if (watched) {
+        flag.fetch_or(WATCHED, std::memory_order_relaxed);
+        if (page)
+            std::atomic_ref<uint8_t>(flags[page - 1]).fetch_or(NEXT_WATCHED, std::memory_order_relaxed);
+    } else {
+        flag.fetch_and(~WATCHED, std::memory_order_relaxed);
+        if (page)
+            std::atomic_ref<uint8_t>(flags[page - 1]).fetch_and(~NEXT_WATCHED, std::memory_order_relaxed);
+    }
+}
+
+void PageFlags::writing(uint32_t addr, size_t size) {
+    if (!first_write_hook || !size)
+        return;
+
+    uint32_t last = static_cast<uint32_t>((uint64_t(addr) + size - 1) >> PAGE_BITS);
+    for (uint32_t page = addr >> PAGE_BITS; page <= last; ++page) {
+        if ((*this)[page] & WATCHED) {
+            first_write_hook(page);
+            set_watched(page, false);
+        }
+        std::atomic_ref<uint8_t>(flags[page]).fetch_and(~NEXT_WATCHED, std::memory_order_relaxed);
+    }
+}
+
+PagedMemory::PagedMemory() :
+    flags_storage(std::make_unique<uint8_t[]>(PageFlags::PAGES_NUM)),
+    page_flags(flags_storage.get())
+{}
+
+void PagedMemory::set_code(uint32_t page, bool code) {
+    page_flags.set_code(page, code);
+
+    TlbEntry& entry = write_tlb[page % TLB_SIZE];
+    if (code && entry.tag == page << PAGE_BITS)
+        entry = {};
+}
+
+void PagedMemory::watch_all() {
+    page_flags.watch_all();
+    write_tlb = {};
+}
+
+void PagedMemory::set_watched(uint32_t page, bool watched) {
+    page_flags.set_watched(page, watched);
+
+    TlbEntry& entry = write_tlb[page % TLB_SIZE];
+    if (watched && entry.tag == page << PAGE_BITS)
+        entry = {};
+}
+
+const uint8_t* PagedMemory::read_page(uint32_t page) {
+
+    const auto& table = directory[page >> TABLE_BITS];
+    const uint8_t* host = zero_page;
+    if (table && (*table)[page % TABLE_SIZE]) {
+        host = (*table)[page % TABLE_SIZE].get();
+    }
+
+    fill(read_tlb[page % TLB_SIZE], page, host);
+    return host;
+}
+
+uint8_t* PagedMemory::write_page(uint32_t page) {
+
+    auto& table = directory[page >> TABLE_BITS];
+    if (!table) {
+        table = std::make_unique<Table>();
+    }
+
+    auto& host = (*table)[page % TABLE_SIZE];
+    if (!host) {
+        host = std::make_unique<uint8_t[]>(PAGE_SIZE);
+        ++pages_num;
+
+        // read TLB may still point to zero page
+        fill(read_tlb[page % TLB_SIZE], page, host.get());
+    }
+
+    if (!(page_flags[page] & (PageFlags::CODE | PageFlags::WATCHED)))
+        fill(write_tlb[page % TLB_SIZE], page, host.get());
+    return host.get();
+}
+
+void PagedMemory::read(uint32_t addr, void* dst, size_t size) {
+
+    uint8_t* out = static_cast<uint8_t*>(dst);
+    while (size) {
+        uint32_t offset = addr & PAGE_MASK;
+        size_t chunk = std::min<size_t>(size, PAGE_SIZE - offset);
+
+        std::memcpy(out, read_page(addr >> PAGE_BITS) + offset, chunk);
+
+        out += chunk;
+        addr += chunk;
+        size -= chunk;
+    }
+}
+
+void PagedMemory::write(uint32_t addr, const void* src, size_t size) {
+
+    uint32_t start = addr;
+    size_t total = size;
+    page_flags.writing(start, total);
+
+    const uint8_t* in = static_cast<const uint8_t*>(src);
+    while (size) {
+        uint32_t offset = addr & PAGE_MASK;
+        size_t chunk = std::min<size_t>(size, PAGE_SIZE - offset);
+
+        std::memcpy(write_page(addr >> PAGE_BITS) + offset, in, chunk);
+
+        in += chunk;
+        addr += chunk;
+        size -= chunk;
+    }
+
+    page_flags.written(start, total);
+}
+
+#ifdef HAS_RESERVED_MEMORY
+
+ReservedMemory::ReservedMemory() {
+
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+
+    void* mapping = mmap(nullptr, FLAGS_SIZE + RESERVED_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (mapping == MAP_FAILED) {
+        throw std::runtime_error("Can't reserve guest address space");
+    }
+
+    page_flags = PageFlags(static_cast<uint8_t*>(mapping));
+    base = static_cast<uint8_t*>(mapping) + FLAGS_SIZE;
+}
+
+ReservedMemory::~ReservedMemory() {
+    munmap(base - FLAGS_SIZE, FLAGS_SIZE + RESERVED_SIZE);
+}
+
+#else
+
+ReservedMemory::ReservedMemory() {
+    throw std::runtime_error("Reserved memory backend is not supported on this platform");
+}
+
+ReservedMemory::~ReservedMemory() {}
+
+#endif
@@ -0,0 +1,293 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAS_RESERVED_MEMORY
+#endif
+
+enum class MemoryBackend {
+    Paged,      // portable, page table lookup on every access
+    Reserved,   // whole guest space reserved up front, host commits pages on touch
+};
+
+#ifdef HAS_RESERVED_MEMORY
+constexpr MemoryBackend default_memory_backend = MemoryBackend::Reserved;
+#else
+constexpr MemoryBackend default_memory_backend = MemoryBackend::Paged;
+#endif
+
+// Read-modify-write the host has no atomic instruction for, e.g. AMOMIN
+template <typename Update>
+uint32_t fetch_update(std::atomic_ref<uint32_t>& word, Update update) {
+    uint32_t old = word.load(std::memory_order_relaxed);
+    while (!word.compare_exchange_weak(old, update(old))) {}
+    return old;
+}
+
+// Attribute byte of every guest page. Stores to a page with any attribute set
+// leave the fast path of the memory backend, so watching a page costs nothing
+// for the others.
+class PageFlags final {
+
+public:
+
+    static constexpr uint32_t PAGE_BITS = 12;
+    static constexpr size_t PAGES_NUM = size_t(1) << (32 - PAGE_BITS);
+
+    static constexpr uint8_t CODE = 1;          // cached blocks were decoded from the page
+    static constexpr uint8_t NEXT_CODE = 2;     // next page has CODE, catches stores crossing into it
+    static constexpr uint8_t WATCHED = 4;       // unchanged since the snapshot, see writing
+    static constexpr uint8_t NEXT_WATCHED = 8;  // next page has WATCHED, cleared once the page is written
+
+public:
+
+    explicit PageFlags(uint8_t* storage) : flags(storage) {}
+
+    // Flags are read and changed through atomic_ref, harts sharing the memory flag pages
+    // concurrently. Relaxed loads are plain byte loads on the hosts, translated code does those.
+    uint8_t operator[](uint32_t page) const { return std::atomic_ref<uint8_t>(flags[page]).load(std::memory_order_relaxed); }
+
+    void set_code(uint32_t page, bool code);
+
+    // called after a store which modified code, with its address and size
+    void written(uint32_t addr, size_t size) const;
+
+    std::function<void(uint32_t addr, uint32_t size)> code_write_hook;
+
+    // Dirty page tracking of snapshots, single hart only. Before the first store to a watched page
+    // first_write_hook gets the page while it still holds the snapshot content, and the page
+    // is no longer watched. Its NEXT_WATCHED is cleared as well, so its stores stay on the fast
+    // path: the fast paths check the pages of the first and the last byte of a store, the ones
+    // crossing into a watched page still leave it.
+    void watch_all();
+    void set_watched(uint32_t page, bool watched);
+
+    // called before a store to a page with flags, with its address and size
+    void writing(uint32_t addr, size_t size);
+
+    std::function<void(uint32_t page)> first_write_hook;
+
+private:
+
+    uint8_t* flags;
+};
+
+// Sparse guest memory: 4 KiB pages allocated on first write through a two-level page table.
+// Reads of untouched pages are served from a shared zero page.
+// Loads and stores first look into a small direct-mapped TLB, so aligned accesses
+// within recently used pages cost one compare and one add.
+class PagedMemory final {
+
+public:
+
+    static constexpr uint32_t PAGE_BITS = PageFlags::PAGE_BITS;
+    static constexpr uint32_t PAGE_SIZE = 1u << PAGE_BITS;
+    static constexpr uint32_t PAGE_MASK = PAGE_SIZE - 1;
+
+    static constexpr uint32_t TABLE_BITS = 10;
+    static constexpr uint32_t TABLE_SIZE = 1u << TABLE_BITS;
+
+    static constexpr uint32_t TLB_SIZE = 64;
+
+public:
+
+    PagedMemory();
+
+public:
+
+    template <typename T> T load(uint32_t addr) {
+        const TlbEntry& entry = read_tlb[(addr >> PAGE_BITS) % TLB_SIZE];
+        if (entry.tag == (addr & (~PAGE_MASK | (sizeof(T) - 1)))) {
+            T value;
+            std::memcpy(&value, reinterpret_cast<const uint8_t*>(entry.addend + addr), sizeof(T));
+            return value;
+        }
+        T value;
+        read(addr, &value, sizeof(T));
+        return value;
+    }
+
+    template <typename T> void store(uint32_t addr, T value) {
+        const TlbEntry& entry = write_tlb[(addr >> PAGE_BITS) % TLB_SIZE];
+        if (entry.tag == (addr & (~PAGE_MASK | (sizeof(T) - 1)))) {
+            std::memcpy(reinterpret_cast<uint8_t*>(entry.addend + addr), &value, sizeof(T));
+            return;
+        }
+        write(addr, &value, sizeof(T));
+    }
+
+    // slow paths, handle unaligned accesses, page crossing and TLB refill
+    void read(uint32_t addr, void* dst, size_t size);
+    void write(uint32_t addr, const void* src, size_t size);
+
+    // SC and AMOs: update(word) gets the aligned word at addr as std::atomic_ref<uint32_t>,
+    // returns its result. The word counts as written.
+    template <typename Update> uint32_t atomic(uint32_t addr, Update update) {
+        page_flags.writing(addr, sizeof(uint32_t));
+        uint8_t* host = write_page(addr >> PAGE_BITS) + (addr & PAGE_MASK);
+        std::atomic_ref<uint32_t> word(*reinterpret_cast<uint32_t*>(host));
+        uint32_t result = update(word);
+        page_flags.written(addr, sizeof(uint32_t));
+        return result;
+    }
+
+    // Host memory behind [addr, addr + size): chunk(host, size) for every piece within a page,
+    // so host I/O goes straight from and to guest memory. Host writes into writable pieces
+    // are reported with host_written once done.
+    template <typename Chunk> void host_chunks(uint32_t addr, size_t size, bool writable, Chunk&& chunk) {
+        if (writable)
+            page_flags.writing(addr, size);
+
+        while (size) {
+            uint32_t offset = addr & PAGE_MASK;
+            size_t piece = std::min<size_t>(size, PAGE_SIZE - offset);
+
+            uint32_t page = addr >> PAGE_BITS;
+            chunk(writable ? write_page(page) + offset : const_cast<uint8_t*>(read_page(page)) + offset, piece);
+
+            addr += piece;
+            size -= piece;
+        }
+    }
+
+    void host_written(uint32_t addr, size_t size) { page_flags.written(addr, size); }
+
+    size_t allocated_pages() const { return pages_num; }
+
+    // pages holding code or watched are kept out of the write TLB, so their stores take the slow path
+    void set_code(uint32_t page, bool code);
+    void on_code_write(std::function<void(uint32_t addr, uint32_t size)> hook) {
+        page_flags.code_write_hook = std::move(hook);
+    }
+
+    void watch_all();
+    void set_watched(uint32_t page, bool watched);
+    void on_first_write(std::function<void(uint32_t page)> hook) {
+        page_flags.first_write_hook = std::move(hook);
+    }
+
+private:
+
+    const uint8_t* read_page(uint32_t page);
+    uint8_t* write_page(uint32_t page);
+
+private:
+
+    using Table = std::array<std::unique_ptr<uint8_t[]>, TABLE_SIZE>;
+
+    std::array<std::unique_ptr<Table>, TABLE_SIZE> directory = {};
+    size_t pages_num = 0;
+
+    std::unique_ptr<uint8_t[]> flags_storage;
+    PageFlags page_flags;
+
+private:
+
+    // page base address, any address with low bits set never matches it
+    static constexpr uint32_t INVALID_TAG = 1;
+
+    struct TlbEntry {
+        uint32_t tag = INVALID_TAG;
+        // host address of the page minus guest address of the page
+        uintptr_t addend = 0;
+    };
+
+    void fill(TlbEntry& entry, uint32_t page, const uint8_t* host) {
+        entry.tag = page << PAGE_BITS;
+        entry.addend = reinterpret_cast<uintptr_t>(host) - (page << PAGE_BITS);
+    }
+
+    std::array<TlbEntry, TLB_SIZE> read_tlb = {};
+    std::array<TlbEntry, TLB_SIZE> write_tlb = {};
+};
+
+// Flat guest memory: the full 32-bit guest space is reserved with an anonymous mapping
+// which is never committed explicitly, the kernel backs pages with zeroes on first touch.
+// Guest address translation is a single add to the base pointer.
+// Page flags are placed right below the guest space, at data() - FLAGS_SIZE,
+// so translated code reaches them from the same base register.
+class ReservedMemory final {
+
+public:
+
+    // guard page after the guest space, so accesses at the very top don't fault
+    static constexpr size_t RESERVED_SIZE = (size_t(1) << 32) + PagedMemory::PAGE_SIZE;
+
+    static constexpr size_t FLAGS_SIZE = PageFlags::PAGES_NUM;
+
+public:
+
+    ReservedMemory();
+    ~ReservedMemory();
+
+    ReservedMemory(const ReservedMemory&) = delete;
+    ReservedMemory& operator=(const ReservedMemory&) = delete;
+
+public:
+
+    template <typename T> T load(uint32_t addr) {
+        T value;
+        std::memcpy(&value, base + addr, sizeof(T));
+        return value;
+    }
+
+    // the pages of the first and the last byte, a store crossing into a flagged page is caught
+    template <typename T> void store(uint32_t addr, T value) {
+        if (page_flags[addr >> PageFlags::PAGE_BITS] | page_flags[(addr + sizeof(T) - 1) >> PageFlags::PAGE_BITS]) [[unlikely]] {
+            write(addr, &value, sizeof(T));
+            return;
+        }
+        std::memcpy(base + addr, &value, sizeof(T));
+    }
+
+    void read(uint32_t addr, void* dst, size_t size) { std::memcpy(dst, base + addr, size); }
+    void write(uint32_t addr, const void* src, size_t size) {
+        page_flags.writing(addr, size);
+        std::memcpy(base + addr, src, size);
+        page_flags.written(addr, size);
+    }
+
+    template <typename Update> uint32_t atomic(uint32_t addr, Update update) {
+        bool flagged = page_flags[addr >> PageFlags::PAGE_BITS];
+        if (flagged) [[unlikely]]
+            page_flags.writing(addr, sizeof(uint32_t));
+        std::atomic_ref<uint32_t> word(*reinterpret_cast<uint32_t*>(base + addr));
+        uint32_t result = update(word);
+        if (flagged) [[unlikely]]
+            page_flags.written(addr, sizeof(uint32_t));
+        return result;
+    }
+
+    template <typename Chunk> void host_chunks(uint32_t addr, size_t size, bool writable, Chunk&& chunk) {
+        if (writable)
+            page_flags.writing(addr, size);
+        chunk(base + addr, size);
+    }
+
+    void host_written(uint32_t addr, size_t size) { page_flags.written(addr, size); }
+
+    uint8_t* data() { return base; }
+
+    void set_code(uint32_t page, bool code) { page_flags.set_code(page, code); }
+    void on_code_write(std::function<void(uint32_t addr, uint32_t size)> hook) {
+        page_flags.code_write_hook = std::move(hook);
+    }
+
+    void watch_all() { page_flags.watch_all(); }
+    void set_watched(uint32_t page, bool watched) { page_flags.set_watched(page, watched); }
+    void on_first_write(std::function<void(uint32_t page)> hook) {
+        page_flags.first_write_hook = std::move(hook);
+    }
+
+private:
+
+    uint8_t* base = nullptr;
+    PageFlags page_flags = PageFlags(nullptr);
+};
@@ -1,58 +1,284 @@
 #pragma once
 
 #include <ctype.h>
+#include <cstdint>
 
-enum class Opcode {
-
-    NONE = 0,
-    ADD,
-    ADDI,
-    AND,
-    ANDI,
-    AUIPC,
-    BEQ,
-    BGE,
-    BGEU,
-    BLT,
-    BLTU,
-    BNE,
-    EBREAK,
-    ECALL,
-    FENCE,
-    FENCE_TSO,
-    JAL,
-    JALR,
-    LB,
-    LBU,
-    LH,
-    LHU,
-    LUI,
-    LW,
-    OR,
-    ORI,
-    PAUSE,
-    SB,
-    SBREAK,
-    SCALL,
-    SH,
-    SLL,
-    SLT,
-    SLTI,
-    SLTIU,
-    SLTU,
-    SRA,
-    SRL,
-    SUB,
-    SW,
-    XOR,
-    XORI,
+// X-macro list of all opcodes, so that the enum and the handler tables
+// of the execution engines are always generated in the same order.
+#define OPCODE_LIST(OP) \
+    OP(NONE)            \
+    OP(ADD)             \
+    OP(ADDI)            \
+    OP(AND)             \
+    OP(ANDI)            \
+    OP(ANDN)            \
+    OP(AUIPC)           \
+    OP(BCLR)            \
+    OP(BCLRI)           \
+    OP(BEQ)             \
+    OP(BEXT)            \
+    OP(BEXTI)           \
+    OP(BGE)             \
+    OP(BGEU)            \
+    OP(BINV)            \
+    OP(BINVI)           \
+    OP(BLT)             \
+    OP(BLTU)            \
+    OP(BNE)             \
+    OP(BSET)            \
+    OP(BSETI)           \
+    OP(CLZ)             \
+    OP(CPOP)            \
+    OP(CSRRC)           \
+    OP(CSRRCI)          \
+    OP(CSRRS)           \
+    OP(CSRRSI)          \
+    OP(CSRRW)           \
+    OP(CSRRWI)          \
+    OP(CTZ)             \
+    OP(DIV)             \
+    OP(DIVU)            \
+    OP(EBREAK)          \
+    OP(ECALL)           \
+    OP(FENCE)           \
+    OP(FENCE_I)         \
+    OP(FENCE_TSO)       \
+    OP(JAL)             \
+    OP(JALR)            \
+    OP(LB)              \
+    OP(LBU)             \
+    OP(LH)              \
+    OP(LHU)             \
+    OP(LUI)             \
+    OP(LW)              \
+    OP(MAX)             \
+    OP(MAXU)            \
+    OP(MIN)             \
+    OP(MINU)            \
+    OP(MUL)             \
+    OP(MULH)            \
+    OP(MULHSU)          \
+    OP(MULHU)           \
+    OP(OR)              \
+    OP(ORC_B)           \
+    OP(ORI)             \
+    OP(ORN)             \
+    OP(PAUSE)           \
+    OP(REM)             \
+    OP(REMU)            \
+    OP(REV8)            \
+    OP(ROL)             \
+    OP(ROR)             \
+    OP(RORI)            \
+    OP(SB)              \
+    OP(SBREAK)          \
+    OP(SCALL)           \
+    OP(SEXT_B)          \
+    OP(SEXT_H)          \
+    OP(SH)              \
+    OP(SH1ADD)          \
+    OP(SH2ADD)          \
+    OP(SH3ADD)          \
+    OP(SLL)             \
+    OP(SLLI)            \
+    OP(SLT)             \
+    OP(SLTI)            \
+    OP(SLTIU)           \
+    OP(SLTU)            \
+    OP(SRA)             \
+    OP(SRAI)            \
+    OP(SRL)             \
+    OP(SRLI)            \
+    OP(SUB)             \
+    OP(SW)              \
+    OP(XNOR)            \
+    OP(XOR)             \
+    OP(XORI)            \
+    OP(ZEXT_H)          \
+    ATOMIC_OPCODE_LIST(OP) \
+    FLOAT_OPCODE_LIST(OP) \
+    VECTOR_OPCODE_LIST(OP) \
+    FUSED_OPCODE_LIST(OP)
+
+// A extension, sequentially consistent host atomics on guest memory
+#define ATOMIC_OPCODE_LIST(OP) \
+    OP(AMOADD_W)        \
+    OP(AMOAND_W)        \
+    OP(AMOMAXU_W)       \
+    OP(AMOMAX_W)        \
+    OP(AMOMINU_W)       \
+    OP(AMOMIN_W)        \
+    OP(AMOOR_W)         \
+    OP(AMOSWAP_W)       \
+    OP(AMOXOR_W)        \
+    OP(LR_W)            \
+    OP(SC_W)
+
+// F and D extensions, executed by Fpu (see fpu.hpp)
+#define FLOAT_OPCODE_LIST(OP) \
+    OP(FADD_D)          \
+    OP(FADD_S)          \
+    OP(FCLASS_D)        \
+    OP(FCLASS_S)        \
+    OP(FCVT_D_S)        \
+    OP(FCVT_D_W)        \
+    OP(FCVT_D_WU)       \
+    OP(FCVT_S_D)        \
+    OP(FCVT_S_W)        \
+    OP(FCVT_S_WU)       \
+    OP(FCVT_W_D)        \
+    OP(FCVT_W_S)        \
+    OP(FCVT_WU_D)       \
+    OP(FCVT_WU_S)       \
+    OP(FDIV_D)          \
+    OP(FDIV_S)          \
+    OP(FEQ_D)           \
+    OP(FEQ_S)           \
+    OP(FLD)             \
+    OP(FLE_D)           \
+    OP(FLE_S)           \
+    OP(FLT_D)           \
+    OP(FLT_S)           \
+    OP(FLW)             \
+    OP(FMADD_D)         \
+    OP(FMADD_S)         \
+    OP(FMAX_D)          \
+    OP(FMAX_S)          \
+    OP(FMIN_D)          \
+    OP(FMIN_S)          \
+    OP(FMSUB_D)         \
+    OP(FMSUB_S)         \
+    OP(FMUL_D)          \
+    OP(FMUL_S)          \
+    OP(FMV_W_X)         \
+    OP(FMV_X_W)         \
+    OP(FNMADD_D)        \
+    OP(FNMADD_S)        \
+    OP(FNMSUB_D)        \
+    OP(FNMSUB_S)        \
+    OP(FSD)             \
+    OP(FSGNJ_D)         \
+    OP(FSGNJ_S)         \
+    OP(FSGNJN_D)        \
+    OP(FSGNJN_S)        \
+    OP(FSGNJX_D)        \
+    OP(FSGNJX_S)        \
+    OP(FSQRT_D)         \
+    OP(FSQRT_S)         \
+    OP(FSUB_D)          \
+    OP(FSUB_S)          \
+    OP(FSW)
+
+// Subset of the V extension, executed by Vpu (see vpu.hpp)
+#define VECTOR_OPCODE_LIST(OP) \
+    OP(VADD_VV)         \
+    OP(VADD_VX)         \
+    OP(VAND_VV)         \
+    OP(VAND_VX)         \
+    OP(VLE16_V)         \
+    OP(VLE32_V)         \
+    OP(VLE8_V)          \
+    OP(VLSE16_V)        \
+    OP(VLSE32_V)        \
+    OP(VLSE8_V)         \
+    OP(VMAXU_VV)        \
+    OP(VMAXU_VX)        \
+    OP(VMAX_VV)         \
+    OP(VMAX_VX)         \
+    OP(VMINU_VV)        \
+    OP(VMINU_VX)        \
+    OP(VMIN_VV)         \
+    OP(VMIN_VX)         \
+    OP(VMSEQ_VV)        \
+    OP(VMSEQ_VX)        \
+    OP(VMSGTU_VX)       \
+    OP(VMSGT_VX)        \
+    OP(VMSLEU_VV)       \
+    OP(VMSLEU_VX)       \
+    OP(VMSLE_VV)        \
+    OP(VMSLE_VX)        \
+    OP(VMSLTU_VV)       \
+    OP(VMSLTU_VX)       \
+    OP(VMSLT_VV)        \
+    OP(VMSLT_VX)        \
+    OP(VMSNE_VV)        \
+    OP(VMSNE_VX)        \
+    OP(VMUL_VV)         \
+    OP(VMUL_VX)         \
+    OP(VMV_S_X)         \
+    OP(VMV_V_V)         \
+    OP(VMV_V_X)         \
+    OP(VMV_X_S)         \
+    OP(VOR_VV)          \
+    OP(VOR_VX)          \
+    OP(VREDAND_VS)      \
+    OP(VREDMAXU_VS)     \
+    OP(VREDMAX_VS)      \
+    OP(VREDMINU_VS)     \
+    OP(VREDMIN_VS)      \
+    OP(VREDOR_VS)       \
+    OP(VREDSUM_VS)      \
+    OP(VREDXOR_VS)      \
+    OP(VRSUB_VX)        \
+    OP(VSE16_V)         \
+    OP(VSE32_V)         \
+    OP(VSE8_V)          \
+    OP(VSETIVLI)        \
+    OP(VSETVL)          \
+    OP(VSETVLI)         \
+    OP(VSSE16_V)        \
+    OP(VSSE32_V)        \
+    OP(VSSE8_V)         \
+    OP(VSUB_VV)         \
+    OP(VSUB_VX)         \
+    OP(VXOR_VV)         \
+    OP(VXOR_VX)
+
+// Superinstructions, pairs of instructions fused in cached blocks (see fusion.hpp)
+#define FUSED_OPCODE_LIST(OP) \
+    OP(ADDI_BEQ)        \
+    OP(ADDI_BGE)        \
+    OP(ADDI_BGEU)       \
+    OP(ADDI_BLT)        \
+    OP(ADDI_BLTU)       \
+    OP(ADDI_BNE)        \
+    OP(AUIPC_JALR)      \
+    OP(AUIPC_LW)        \
+    OP(LUI_ADDI)
+
+enum class Opcode : uint8_t {
+
+#define OPCODE_ENUM(name) name,
+    OPCODE_LIST(OPCODE_ENUM)
+#undef OPCODE_ENUM
 };
 
+// imm2 of vsetvli and vsetvl, rs1 = x0 asks for VLMAX or, with rd = x0 too, keeps vl
+constexpr int32_t AVL_RS1 = 0;
+constexpr int32_t AVL_VLMAX = 1;
+constexpr int32_t AVL_KEEP = 2;
+
 struct Instruction {
 
     uint8_t rs1= {}, rs2 = {}, rs3 = {};
     uint8_t rd = {};
 
+    // immediate, rounding mode of floating point instructions, CSR of Zicsr instructions
     int32_t imm = {};
     Opcode id = Opcode::NONE;
-};
\ No newline at end of file
+
+    // bytes of guest code: 2 for compressed instructions, both parts of fused pairs,
+    // first_length is the first part of a fused pair and 0 for other instructions
+    uint8_t length : 4 = 4;
+    uint8_t first_length : 4 = 0;
+
+    // pc - pc of the block, set when the block is cached
+    uint16_t offset = 0;
+
+    // second immediate of fused instructions, uimm of Zicsr instructions,
+    // set for masked vector instructions, AVL of vsetvli, vsetivli and vsetvl
+    int32_t imm2 = {};
+
+    // label of the handler in the threaded engine, resolved when block is cached
+    const void* handler = nullptr;
+};
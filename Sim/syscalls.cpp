@@ -0,0 +1,306 @@
+#include "syscalls.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+#include "memory.hpp"
+
+#ifdef HAS_HOST_SYSCALLS
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// errno values of the guest ABI are the asm-generic ones, the same as on Linux hosts
+
+Syscalls::Syscalls(ConsoleBuffering console_buffering, Console::Sink console_sink) :
+    fds{0, 1, 2},
+    console(console_buffering, std::move(console_sink))
+{}
+
+Syscalls::~Syscalls() {
+#ifdef HAS_HOST_SYSCALLS
+    for (int fd : fds) {
+        if (fd > 2)
+            ::close(fd);
+    }
+#endif
+}
+
+template <typename Memory>
+Syscalls::Result Syscalls::handle(Memory& mem, uint32_t* x) {
+
+    uint32_t* a = x + 10;
+    int64_t result = 0;
+
+    switch (x[17]) {
+#ifdef HAS_HOST_SYSCALLS
+    case READ:            result = transfer(mem, a[0], a[1], a[2], true); break;
+    case WRITE:           result = transfer(mem, a[0], a[1], a[2], false); break;
+    case OPENAT:          result = openat(mem, a[0], a[1], a[2], a[3]); break;
+    case CLOSE:           result = close(a[0]); break;
+    case LSEEK:           result = lseek(a[0], static_cast<int32_t>(a[1]), a[2]); break;
+    case FSTAT:           result = fstat(mem, a[0], a[1]); break;
+    case CLOCK_GETTIME:
+    case CLOCK_GETTIME64: result = clock_gettime(mem, a[0], a[1]); break;
+    case GETTIMEOFDAY:    result = gettimeofday(mem, a[0], a[1]); break;
+#endif
+    case BRK:             result = brk(a[0]); break;
+    case EXIT:
+        flush_console();
+        return Result::Exit;
+    case EXIT_GROUP:
+        flush_console();
+        if (!group_exit.load(std::memory_order_relaxed)) {
+            group_exit_status = a[0];
+            group_exit.store(true, std::memory_order_release);
+        }
+        return Result::ExitGroup;
+    default:
+        return Result::Unknown;
+    }
+
+    a[0] = static_cast<uint32_t>(result);
+    return Result::Done;
+}
+
+template Syscalls::Result Syscalls::handle(PagedMemory& mem, uint32_t* x);
+template Syscalls::Result Syscalls::handle(ReservedMemory& mem, uint32_t* x);
+
+void Syscalls::start_heap(uint32_t start) {
+    std::lock_guard lock(mutex);
+    heap_start = heap_end = start;
+}
+
+void Syscalls::flush_console() {
+    std::lock_guard lock(mutex);
+    console.flush();
+}
+
+uint32_t Syscalls::program_break() {
+    std::lock_guard lock(mutex);
+    return heap_end;
+}
+
+void Syscalls::set_program_break(uint32_t addr) {
+    std::lock_guard lock(mutex);
+    heap_end = addr;
+}
+
+// Guest memory is there already, the break only moves. Anything below the start of the heap
+// queries it, as brk(0) of newlib and the C libraries does.
+int64_t Syscalls::brk(uint32_t addr) {
+    std::lock_guard lock(mutex);
+    if (addr >= heap_start)
+        heap_end = addr;
+    return heap_end;
+}
+
+int Syscalls::host_fd(uint32_t fd) {
+    std::lock_guard lock(mutex);
+    return fd < fds.size() ? fds[fd] : -1;
+}
+
+uint32_t Syscalls::add_fd(int host) {
+    std::lock_guard lock(mutex);
+    for (uint32_t fd = 0; fd < fds.size(); ++fd) {
+        if (fds[fd] < 0) {
+            fds[fd] = host;
+            return fd;
+        }
+    }
+    fds.push_back(host);
+    return static_cast<uint32_t>(fds.size() - 1);
+}
+
+#ifdef HAS_HOST_SYSCALLS
+
+template <typename Memory>
+int64_t Syscalls::transfer(Memory& mem, uint32_t fd, uint32_t addr, uint32_t size, bool to_guest) {
+
+    int host = host_fd(fd);
+    if (host < 0)
+        return -EBADF;
+
+    // the last piece stops at the top of the guest space
+    size = static_cast<uint32_t>(std::min<uint64_t>({size, MAX_TRANSFER, (uint64_t(1) << 32) - addr}));
+
+    if (!to_guest && (host == 1 || host == 2)) {
+        std::lock_guard lock(mutex);
+        mem.host_chunks(addr, size, false, [&](uint8_t* host_addr, size_t piece) {
+            console.write(host, host_addr, piece);
+        });
+        return size;
+    }
+
+    // a prompt written before shows up before the guest waits for input
+    if (to_guest && host == 0)
+        flush_console();
+
+    std::vector<iovec> iov;
+    mem.host_chunks(addr, size, to_guest, [&](uint8_t* host_addr, size_t piece) {
+        iov.push_back({host_addr, piece});
+    });
+
+    ssize_t done = to_guest ? ::readv(host, iov.data(), static_cast<int>(iov.size()))
+                            : ::writev(host, iov.data(), static_cast<int>(iov.size()));
+    if (done < 0)
+        return -errno;
+
+    if (to_guest && done)
+        mem.host_written(addr, static_cast<size_t>(done));
+    return done;
+}
+
+static int host_open_flags(uint32_t flags) {
+
+    static constexpr std::pair<uint32_t, int> flag_map[] = {
+        {0100, O_CREAT}, {0200, O_EXCL}, {0400, O_NOCTTY}, {01000, O_TRUNC}, {02000, O_APPEND},
+        {04000, O_NONBLOCK}, {0200000, O_DIRECTORY}, {0400000, O_NOFOLLOW}, {02000000, O_CLOEXEC},
+    };
+
+    int host = (flags & 3) == 2 ? O_RDWR : (flags & 3) == 1 ? O_WRONLY : O_RDONLY;
+    for (auto [guest_flag, host_flag] : flag_map) {
+        if (flags & guest_flag)
+            host |= host_flag;
+    }
+    return host;
+}
+
+template <typename Memory>
+int64_t Syscalls::openat(Memory& mem, uint32_t dir_fd, uint32_t path_addr, uint32_t flags, uint32_t mode) {
+
+    static constexpr int32_t GUEST_AT_FDCWD = -100;
+    static constexpr size_t PATH_MAX_LENGTH = 4096;
+
+    std::string path;
+    for (uint32_t addr = path_addr; char c = static_cast<char>(mem.template load<uint8_t>(addr)); ++addr) {
+        if (path.size() == PATH_MAX_LENGTH)
+            return -ENAMETOOLONG;
+        path.push_back(c);
+    }
+
+    int host_dir = AT_FDCWD;
+    if (static_cast<int32_t>(dir_fd) != GUEST_AT_FDCWD) {
+        host_dir = host_fd(dir_fd);
+        if (host_dir < 0)
+            return -EBADF;
+    }
+
+    int host = ::openat(host_dir, path.c_str(), host_open_flags(flags), static_cast<mode_t>(mode));
+    if (host < 0)
+        return -errno;
+    return add_fd(host);
+}
+
+// descriptors of the console only leave the table, the host keeps them
+int64_t Syscalls::close(uint32_t fd) {
+
+    int host;
+    {
+        std::lock_guard lock(mutex);
+        if (fd >= fds.size() || fds[fd] < 0)
+            return -EBADF;
+        host = fds[fd];
+        fds[fd] = -1;
+    }
+
+    if (host > 2 && ::close(host) < 0)
+        return -errno;
+    return 0;
+}
+
+int64_t Syscalls::lseek(uint32_t fd, int32_t offset, uint32_t whence) {
+
+    int host = host_fd(fd);
+    if (host < 0)
+        return -EBADF;
+
+    off_t position = ::lseek(host, offset, static_cast<int>(whence));
+    if (position < 0)
+        return -errno;
+    if (position > INT32_MAX)
+        return -EOVERFLOW;
+    return position;
+}
+
+// struct stat of the asm-generic ABI with 64-bit times, as newlib's kernel_stat
+template <typename Memory>
+int64_t Syscalls::fstat(Memory& mem, uint32_t fd, uint32_t addr) {
+
+    int host = host_fd(fd);
+    if (host < 0)
+        return -EBADF;
+
+    struct stat st;
+    if (::fstat(host, &st) < 0)
+        return -errno;
+
+    uint8_t guest[128] = {};
+    auto put = [&](size_t offset, auto value) { std::memcpy(guest + offset, &value, sizeof(value)); };
+    put(0, uint64_t(st.st_dev));
+    put(8, uint64_t(st.st_ino));
+    put(16, uint32_t(st.st_mode));
+    put(20, uint32_t(st.st_nlink));
+    put(24, uint32_t(st.st_uid));
+    put(28, uint32_t(st.st_gid));
+    put(32, uint64_t(st.st_rdev));
+    put(48, int64_t(st.st_size));
+    put(56, int32_t(st.st_blksize));
+    put(64, int64_t(st.st_blocks));
+    put(72, int64_t(st.st_atime));
+    put(88, int64_t(st.st_mtime));
+    put(104, int64_t(st.st_ctime));
+
+    mem.write(addr, guest, sizeof(guest));
+    return 0;
+}
+
+// timespec and timeval with 64-bit seconds, the second half of the 64-bit fraction
+// falls into the padding of the 32-bit one
+template <typename Memory>
+int64_t Syscalls::clock_gettime(Memory& mem, uint32_t clock, uint32_t addr) {
+
+    clockid_t host_clock;
+    switch (clock) {
+    case 0:  host_clock = CLOCK_REALTIME; break;
+    case 1:  host_clock = CLOCK_MONOTONIC; break;
+    case 2:  host_clock = CLOCK_PROCESS_CPUTIME_ID; break;
+    case 3:  host_clock = CLOCK_THREAD_CPUTIME_ID; break;
+    default: return -EINVAL;
+    }
+
+    timespec ts;
+    if (::clock_gettime(host_clock, &ts) < 0)
+        return -errno;
+
+    int64_t guest[2] = { int64_t(ts.tv_sec), int64_t(ts.tv_nsec) };
+    mem.write(addr, guest, sizeof(guest));
+    return 0;
+}
+
+template <typename Memory>
+int64_t Syscalls::gettimeofday(Memory& mem, uint32_t addr, uint32_t zone_addr) {
+
+    timeval tv;
+    if (::gettimeofday(&tv, nullptr) < 0)
+        return -errno;
+
+    if (addr) {
+        int64_t guest[2] = { int64_t(tv.tv_sec), int64_t(tv.tv_usec) };
+        mem.write(addr, guest, sizeof(guest));
+    }
+    if (zone_addr) {
+        uint32_t zone[2] = {};
+        mem.write(zone_addr, zone, sizeof(zone));
+    }
+    return 0;
+}
+
+#endif
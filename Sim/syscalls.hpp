@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "console.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAS_HOST_SYSCALLS
+#endif
+
+// Linux user-mode system calls of the guest on ECALL, with the numbers and structures of the
+// RISC-V Linux ABI, which newlib uses as well. They map onto host calls, guest buffers are
+// handed to them in place as iovecs over guest memory, except for writes to the console,
+// which are batched in Console. Guest file descriptors go through a table, so guests sharing
+// the process never close each other's files or the console. Harts of a machine share one.
+class Syscalls final {
+
+public:
+
+    static constexpr uint32_t OPENAT = 56;
+    static constexpr uint32_t CLOSE = 57;
+    static constexpr uint32_t LSEEK = 62;
+    static constexpr uint32_t READ = 63;
+    static constexpr uint32_t WRITE = 64;
+    static constexpr uint32_t FSTAT = 80;
+    static constexpr uint32_t EXIT = 93;
+    static constexpr uint32_t EXIT_GROUP = 94;
+    static constexpr uint32_t CLOCK_GETTIME = 113;
+    static constexpr uint32_t GETTIMEOFDAY = 169;
+    static constexpr uint32_t BRK = 214;
+    static constexpr uint32_t CLOCK_GETTIME64 = 403;
+
+    // reads and writes are cut there, the guest sees a short transfer and goes on with the rest
+    static constexpr uint32_t MAX_TRANSFER = 1u << 20;
+
+    enum class Result {
+        Done,       // a0 holds the result or -errno, the guest goes on after the ECALL
+        Exit,       // exit, a0 holds the status
+        ExitGroup,  // exit_group, every hart sharing the Syscalls halts, see group_exited
+        Unknown,    // not emulated, the hart halts at the ECALL as it did before
+    };
+
+public:
+
+    explicit Syscalls(ConsoleBuffering console_buffering = ConsoleBuffering::Auto, Console::Sink console_sink = {});
+    ~Syscalls();
+
+    Syscalls(const Syscalls&) = delete;
+    Syscalls& operator=(const Syscalls&) = delete;
+
+public:
+
+    // number in a7, arguments in a0-a5, result in a0
+    template <typename Memory> Result handle(Memory& mem, uint32_t* x);
+
+    // brk starts at the end of the loaded segments, the heap grows from there
+    void start_heap(uint32_t start);
+    uint32_t program_break();
+    void set_program_break(uint32_t addr);
+
+    void flush_console();
+
+    // exit_group was called, the other harts halt at their next slice or quantum
+    bool group_exited() const { return group_exit.load(std::memory_order_acquire); }
+    uint32_t group_exit_code() const { return group_exit_status; }
+
+private:
+
+    template <typename Memory> int64_t transfer(Memory& mem, uint32_t fd, uint32_t addr, uint32_t size, bool to_guest);
+    template <typename Memory> int64_t openat(Memory& mem, uint32_t dir_fd, uint32_t path_addr, uint32_t flags, uint32_t mode);
+    template <typename Memory> int64_t fstat(Memory& mem, uint32_t fd, uint32_t addr);
+    template <typename Memory> int64_t clock_gettime(Memory& mem, uint32_t clock, uint32_t addr);
+    template <typename Memory> int64_t gettimeofday(Memory& mem, uint32_t addr, uint32_t zone_addr);
+
+    int64_t close(uint32_t fd);
+    int64_t lseek(uint32_t fd, int32_t offset, uint32_t whence);
+    int64_t brk(uint32_t addr);
+
+    // host descriptor of a guest one, -1 if it isn't open
+    int host_fd(uint32_t fd);
+    uint32_t add_fd(int host);
+
+private:
+
+    std::mutex mutex;
+
+    // guest descriptor -> host descriptor, -1 for a free slot
+    std::vector<int> fds;
+
+    Console console;
+
+    uint32_t heap_start = 0;
+    uint32_t heap_end = 0;
+
+    // status written before the flag is released
+    uint32_t group_exit_status = 0;
+    std::atomic<bool> group_exit = false;
+};
@@ -0,0 +1,597 @@
+#include "vpu.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <type_traits>
+
+#ifdef HAS_AVX2
+#include <immintrin.h>
+#endif
+
+namespace {
+
+using Op = Vpu::Op;
+using Compare = Vpu::Compare;
+
+// d = a op b (or the scalar), masked-off elements stay if mask is set
+using ArithKernel = void (*)(uint8_t* d, const uint8_t* a, const uint8_t* b, uint32_t x, const uint8_t* mask, uint32_t n);
+// bit i of bits = a[i] compare b[i] (or the scalar), the rest of the last byte is unspecified
+using CompareKernel = void (*)(uint8_t* bits, const uint8_t* a, const uint8_t* b, uint32_t x, uint32_t n);
+// d[0] = b[0] op all active elements of a
+using ReduceKernel = void (*)(uint8_t* d, const uint8_t* a, const uint8_t* b, const uint8_t* mask, uint32_t n);
+// active elements of d = s
+using MergeKernel = void (*)(uint8_t* d, const uint8_t* s, const uint8_t* mask, uint32_t n);
+
+template <typename T>
+T get(const uint8_t* base, uint32_t i) {
+    T value;
+    std::memcpy(&value, base + i * sizeof(T), sizeof(T));
+    return value;
+}
+
+template <typename T>
+void put(uint8_t* base, uint32_t i, T value) {
+    std::memcpy(base + i * sizeof(T), &value, sizeof(T));
+}
+
+bool mask_bit(const uint8_t* mask, uint32_t i) {
+    return mask[i / 8] >> (i % 8) & 1;
+}
+
+template <typename T, Op op>
+T apply(T x, T y) {
+    using S = std::make_signed_t<T>;
+    if constexpr (op == Op::ADD)
+        return T(x + y);
+    else if constexpr (op == Op::SUB)
+        return T(x - y);
+    else if constexpr (op == Op::RSUB)
+        return T(y - x);
+    else if constexpr (op == Op::AND)
+        return x & y;
+    else if constexpr (op == Op::OR)
+        return x | y;
+    else if constexpr (op == Op::XOR)
+        return x ^ y;
+    else if constexpr (op == Op::MUL)
+        return T(uint32_t(x) * uint32_t(y));
+    else if constexpr (op == Op::MIN)
+        return S(x) < S(y) ? x : y;
+    else if constexpr (op == Op::MINU)
+        return x < y ? x : y;
+    else if constexpr (op == Op::MAX)
+        return S(x) > S(y) ? x : y;
+    else
+        return x > y ? x : y;
+}
+
+template <typename T, Compare compare>
+bool test(T x, T y) {
+    using S = std::make_signed_t<T>;
+    if constexpr (compare == Compare::EQ)
+        return x == y;
+    else if constexpr (compare == Compare::NE)
+        return x != y;
+    else if constexpr (compare == Compare::LT)
+        return S(x) < S(y);
+    else if constexpr (compare == Compare::LTU)
+        return x < y;
+    else if constexpr (compare == Compare::LE)
+        return S(x) <= S(y);
+    else if constexpr (compare == Compare::LEU)
+        return x <= y;
+    else if constexpr (compare == Compare::GT)
+        return S(x) > S(y);
+    else
+        return x > y;
+}
+
+// neutral element of a reduction
+template <typename T, Op op>
+constexpr T identity() {
+    using S = std::make_signed_t<T>;
+    if constexpr (op == Op::AND || op == Op::MINU)
+        return std::numeric_limits<T>::max();
+    else if constexpr (op == Op::MIN)
+        return T(std::numeric_limits<S>::max());
+    else if constexpr (op == Op::MAX)
+        return T(std::numeric_limits<S>::min());
+    else
+        return 0;
+}
+
+template <typename T, Op op, bool scalar>
+void arith_portable(uint8_t* d, const uint8_t* a, const uint8_t* b, uint32_t x, const uint8_t* mask, uint32_t n) {
+    for (uint32_t i = 0; i < n; ++i) {
+        if (mask && !mask_bit(mask, i))
+            continue;
+        put<T>(d, i, apply<T, op>(get<T>(a, i), scalar ? T(x) : get<T>(b, i)));
+    }
+}
+
+template <typename T, Compare compare, bool scalar>
+void compare_portable(uint8_t* bits, const uint8_t* a, const uint8_t* b, uint32_t x, uint32_t n) {
+    for (uint32_t i = 0; i < n; ++i) {
+        if (i % 8 == 0)
+            bits[i / 8] = 0;
+        if (test<T, compare>(get<T>(a, i), scalar ? T(x) : get<T>(b, i)))
+            bits[i / 8] |= 1 << (i % 8);
+    }
+}
+
+template <typename T, Op op>
+void reduce_portable(uint8_t* d, const uint8_t* a, const uint8_t* b, const uint8_t* mask, uint32_t n) {
+    T acc = get<T>(b, 0);
+    for (uint32_t i = 0; i < n; ++i) {
+        if (!mask || mask_bit(mask, i))
+            acc = apply<T, op>(acc, get<T>(a, i));
+    }
+    put<T>(d, 0, acc);
+}
+
+template <typename T>
+void merge_portable(uint8_t* d, const uint8_t* s, const uint8_t* mask, uint32_t n) {
+    for (uint32_t i = 0; i < n; ++i) {
+        if (mask_bit(mask, i))
+            put<T>(d, i, get<T>(s, i));
+    }
+}
+
+#ifdef HAS_AVX2
+
+// The kernels process whole 32 byte chunks of a group, which never leave the register file
+// since groups are whole registers. Lanes past vl and masked-off ones are blended back.
+
+#define AVX2 __attribute__((target("avx2")))
+
+template <typename T>
+constexpr uint32_t LANES = 32 / sizeof(T);
+
+AVX2 inline __m256i load(const uint8_t* p) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+}
+
+AVX2 inline void store(uint8_t* p, __m256i v) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v);
+}
+
+AVX2 inline __m256i ones() {
+    return _mm256_set1_epi32(-1);
+}
+
+template <typename T>
+AVX2 inline __m256i splat(T x) {
+    if constexpr (sizeof(T) == 1)
+        return _mm256_set1_epi8(char(x));
+    else if constexpr (sizeof(T) == 2)
+        return _mm256_set1_epi16(short(x));
+    else
+        return _mm256_set1_epi32(int(x));
+}
+
+// lanes below n
+template <typename T>
+AVX2 inline __m256i lanes_below(uint32_t n) {
+    n = std::min(n, LANES<T>);
+    if constexpr (sizeof(T) == 1)
+        return _mm256_cmpgt_epi8(_mm256_set1_epi8(char(n)),
+                                 _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                                                  16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31));
+    else if constexpr (sizeof(T) == 2)
+        return _mm256_cmpgt_epi16(_mm256_set1_epi16(short(n)),
+                                  _mm256_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+    else
+        return _mm256_cmpgt_epi32(_mm256_set1_epi32(int(n)), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+}
+
+// mask bits of the chunk starting at element i as lanes
+template <typename T>
+AVX2 inline __m256i expand_mask(const uint8_t* mask, uint32_t i) {
+    if constexpr (sizeof(T) == 1) {
+        uint32_t bits;
+        std::memcpy(&bits, mask + i / 8, sizeof(bits));
+        __m256i bytes = _mm256_shuffle_epi8(_mm256_set1_epi32(int(bits)),
+                                            _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                                             2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3));
+        __m256i select = _mm256_set1_epi64x(0x8040201008040201);
+        return _mm256_cmpeq_epi8(_mm256_and_si256(bytes, select), select);
+    } else if constexpr (sizeof(T) == 2) {
+        uint16_t bits;
+        std::memcpy(&bits, mask + i / 8, sizeof(bits));
+        __m256i select = _mm256_setr_epi16(0x1, 0x2, 0x4, 0x8, 0x10, 0x20, 0x40, 0x80, 0x100, 0x200, 0x400, 0x800,
+                                           0x1000, 0x2000, 0x4000, short(0x8000));
+        return _mm256_cmpeq_epi16(_mm256_and_si256(_mm256_set1_epi16(short(bits)), select), select);
+    } else {
+        __m256i select = _mm256_setr_epi32(0x1, 0x2, 0x4, 0x8, 0x10, 0x20, 0x40, 0x80);
+        return _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(mask[i / 8]), select), select);
+    }
+}
+
+// lanes to mask bits
+template <typename T>
+AVX2 inline uint32_t compress_mask(__m256i lanes) {
+    if constexpr (sizeof(T) == 1)
+        return uint32_t(_mm256_movemask_epi8(lanes));
+    else if constexpr (sizeof(T) == 2) {
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(lanes, _mm256_setzero_si256()), 0xd8);
+        return uint32_t(_mm256_movemask_epi8(packed)) & 0xffff;
+    } else
+        return uint32_t(_mm256_movemask_ps(_mm256_castsi256_ps(lanes)));
+}
+
+// 8 bit products from the 16 bit ones of the even and odd bytes
+AVX2 inline __m256i mullo_epi8(__m256i x, __m256i y) {
+    __m256i even = _mm256_mullo_epi16(x, y);
+    __m256i odd = _mm256_mullo_epi16(_mm256_srli_epi16(x, 8), _mm256_srli_epi16(y, 8));
+    return _mm256_or_si256(_mm256_and_si256(even, _mm256_set1_epi16(0xff)), _mm256_slli_epi16(odd, 8));
+}
+
+template <typename T, Op op>
+AVX2 inline __m256i apply_simd(__m256i x, __m256i y) {
+    constexpr size_t size = sizeof(T);
+    if constexpr (op == Op::ADD)
+        return size == 1 ? _mm256_add_epi8(x, y) : size == 2 ? _mm256_add_epi16(x, y) : _mm256_add_epi32(x, y);
+    else if constexpr (op == Op::SUB)
+        return size == 1 ? _mm256_sub_epi8(x, y) : size == 2 ? _mm256_sub_epi16(x, y) : _mm256_sub_epi32(x, y);
+    else if constexpr (op == Op::RSUB)
+        return apply_simd<T, Op::SUB>(y, x);
+    else if constexpr (op == Op::AND)
+        return _mm256_and_si256(x, y);
+    else if constexpr (op == Op::OR)
+        return _mm256_or_si256(x, y);
+    else if constexpr (op == Op::XOR)
+        return _mm256_xor_si256(x, y);
+    else if constexpr (op == Op::MUL)
+        return size == 1 ? mullo_epi8(x, y) : size == 2 ? _mm256_mullo_epi16(x, y) : _mm256_mullo_epi32(x, y);
+    else if constexpr (op == Op::MIN)
+        return size == 1 ? _mm256_min_epi8(x, y) : size == 2 ? _mm256_min_epi16(x, y) : _mm256_min_epi32(x, y);
+    else if constexpr (op == Op::MINU)
+        return size == 1 ? _mm256_min_epu8(x, y) : size == 2 ? _mm256_min_epu16(x, y) : _mm256_min_epu32(x, y);
+    else if constexpr (op == Op::MAX)
+        return size == 1 ? _mm256_max_epi8(x, y) : size == 2 ? _mm256_max_epi16(x, y) : _mm256_max_epi32(x, y);
+    else
+        return size == 1 ? _mm256_max_epu8(x, y) : size == 2 ? _mm256_max_epu16(x, y) : _mm256_max_epu32(x, y);
+}
+
+template <typename T>
+AVX2 inline __m256i eq(__m256i x, __m256i y) {
+    constexpr size_t size = sizeof(T);
+    return size == 1 ? _mm256_cmpeq_epi8(x, y) : size == 2 ? _mm256_cmpeq_epi16(x, y) : _mm256_cmpeq_epi32(x, y);
+}
+
+template <typename T>
+AVX2 inline __m256i gt(__m256i x, __m256i y) {
+    constexpr size_t size = sizeof(T);
+    return size == 1 ? _mm256_cmpgt_epi8(x, y) : size == 2 ? _mm256_cmpgt_epi16(x, y) : _mm256_cmpgt_epi32(x, y);
+}
+
+template <typename T, Compare compare>
+AVX2 inline __m256i test_simd(__m256i x, __m256i y) {
+    if constexpr (compare == Compare::EQ)
+        return eq<T>(x, y);
+    else if constexpr (compare == Compare::NE)
+        return _mm256_xor_si256(eq<T>(x, y), ones());
+    else if constexpr (compare == Compare::LT)
+        return gt<T>(y, x);
+    else if constexpr (compare == Compare::LTU)
+        return _mm256_xor_si256(eq<T>(apply_simd<T, Op::MAXU>(x, y), x), ones());
+    else if constexpr (compare == Compare::LE)
+        return _mm256_xor_si256(gt<T>(x, y), ones());
+    else if constexpr (compare == Compare::LEU)
+        return eq<T>(apply_simd<T, Op::MAXU>(x, y), y);
+    else if constexpr (compare == Compare::GT)
+        return gt<T>(x, y);
+    else
+        return _mm256_xor_si256(eq<T>(apply_simd<T, Op::MAXU>(x, y), y), ones());
+}
+
+template <typename T, Op op, bool scalar>
+AVX2 void arith_avx2(uint8_t* d, const uint8_t* a, const uint8_t* b, uint32_t x, const uint8_t* mask, uint32_t n) {
+    __m256i y = splat<T>(T(x));
+    for (uint32_t i = 0; i < n; i += LANES<T>) {
+        uint32_t offset = i * sizeof(T);
+        if constexpr (!scalar)
+            y = load(b + offset);
+        __m256i result = apply_simd<T, op>(load(a + offset), y);
+        if (mask || n - i < LANES<T>) {
+            __m256i keep = lanes_below<T>(n - i);
+            if (mask)
+                keep = _mm256_and_si256(keep, expand_mask<T>(mask, i));
+            result = _mm256_blendv_epi8(load(d + offset), result, keep);
+        }
+        store(d + offset, result);
+    }
+}
+
+template <typename T, Compare compare, bool scalar>
+AVX2 void compare_avx2(uint8_t* bits, const uint8_t* a, const uint8_t* b, uint32_t x, uint32_t n) {
+    __m256i y = splat<T>(T(x));
+    for (uint32_t i = 0; i < n; i += LANES<T>) {
+        uint32_t offset = i * sizeof(T);
+        if constexpr (!scalar)
+            y = load(b + offset);
+        uint32_t chunk = compress_mask<T>(test_simd<T, compare>(load(a + offset), y));
+        std::memcpy(bits + i / 8, &chunk, LANES<T> / 8);
+    }
+}
+
+template <typename T, Op op>
+AVX2 void reduce_avx2(uint8_t* d, const uint8_t* a, const uint8_t* b, const uint8_t* mask, uint32_t n) {
+    __m256i neutral = splat<T>(identity<T, op>());
+    __m256i acc = neutral;
+    for (uint32_t i = 0; i < n; i += LANES<T>) {
+        __m256i elements = load(a + i * sizeof(T));
+        if (mask || n - i < LANES<T>) {
+            __m256i keep = lanes_below<T>(n - i);
+            if (mask)
+                keep = _mm256_and_si256(keep, expand_mask<T>(mask, i));
+            elements = _mm256_blendv_epi8(neutral, elements, keep);
+        }
+        acc = apply_simd<T, op>(acc, elements);
+    }
+
+    alignas(32) uint8_t lanes[32];
+    store(lanes, acc);
+    T result = get<T>(b, 0);
+    for (uint32_t i = 0; i < LANES<T>; ++i)
+        result = apply<T, op>(result, get<T>(lanes, i));
+    put<T>(d, 0, result);
+}
+
+template <typename T>
+AVX2 void merge_avx2(uint8_t* d, const uint8_t* s, const uint8_t* mask, uint32_t n) {
+    for (uint32_t i = 0; i < n; i += LANES<T>) {
+        uint32_t offset = i * sizeof(T);
+        __m256i keep = _mm256_and_si256(lanes_below<T>(n - i), expand_mask<T>(mask, i));
+        store(d + offset, _mm256_blendv_epi8(load(d + offset), load(s + offset), keep));
+    }
+}
+
+#undef AVX2
+
+#endif
+
+template <typename T, Op op, bool scalar>
+ArithKernel arith_kernel(bool avx2) {
+#ifdef HAS_AVX2
+    if (avx2)
+        return arith_avx2<T, op, scalar>;
+#endif
+    return arith_portable<T, op, scalar>;
+}
+
+template <typename T, bool scalar>
+ArithKernel arith_kernel(Op op, bool avx2) {
+    switch (op) {
+    case Op::ADD: return arith_kernel<T, Op::ADD, scalar>(avx2);
+    case Op::SUB: return arith_kernel<T, Op::SUB, scalar>(avx2);
+    case Op::RSUB: return arith_kernel<T, Op::RSUB, scalar>(avx2);
+    case Op::AND: return arith_kernel<T, Op::AND, scalar>(avx2);
+    case Op::OR: return arith_kernel<T, Op::OR, scalar>(avx2);
+    case Op::XOR: return arith_kernel<T, Op::XOR, scalar>(avx2);
+    case Op::MUL: return arith_kernel<T, Op::MUL, scalar>(avx2);
+    case Op::MIN: return arith_kernel<T, Op::MIN, scalar>(avx2);
+    case Op::MINU: return arith_kernel<T, Op::MINU, scalar>(avx2);
+    case Op::MAX: return arith_kernel<T, Op::MAX, scalar>(avx2);
+    default: return arith_kernel<T, Op::MAXU, scalar>(avx2);
+    }
+}
+
+template <bool scalar>
+ArithKernel arith_kernel(Op op, uint32_t sew, bool avx2) {
+    switch (sew) {
+    case 8: return arith_kernel<uint8_t, scalar>(op, avx2);
+    case 16: return arith_kernel<uint16_t, scalar>(op, avx2);
+    default: return arith_kernel<uint32_t, scalar>(op, avx2);
+    }
+}
+
+template <typename T, Compare compare, bool scalar>
+CompareKernel compare_kernel(bool avx2) {
+#ifdef HAS_AVX2
+    if (avx2)
+        return compare_avx2<T, compare, scalar>;
+#endif
+    return compare_portable<T, compare, scalar>;
+}
+
+template <typename T, bool scalar>
+CompareKernel compare_kernel(Compare compare, bool avx2) {
+    switch (compare) {
+    case Compare::EQ: return compare_kernel<T, Compare::EQ, scalar>(avx2);
+    case Compare::NE: return compare_kernel<T, Compare::NE, scalar>(avx2);
+    case Compare::LT: return compare_kernel<T, Compare::LT, scalar>(avx2);
+    case Compare::LTU: return compare_kernel<T, Compare::LTU, scalar>(avx2);
+    case Compare::LE: return compare_kernel<T, Compare::LE, scalar>(avx2);
+    case Compare::LEU: return compare_kernel<T, Compare::LEU, scalar>(avx2);
+    case Compare::GT: return compare_kernel<T, Compare::GT, scalar>(avx2);
+    default: return compare_kernel<T, Compare::GTU, scalar>(avx2);
+    }
+}
+
+template <bool scalar>
+CompareKernel compare_kernel(Compare compare, uint32_t sew, bool avx2) {
+    switch (sew) {
+    case 8: return compare_kernel<uint8_t, scalar>(compare, avx2);
+    case 16: return compare_kernel<uint16_t, scalar>(compare, avx2);
+    default: return compare_kernel<uint32_t, scalar>(compare, avx2);
+    }
+}
+
+template <typename T, Op op>
+ReduceKernel reduce_kernel(bool avx2) {
+#ifdef HAS_AVX2
+    if (avx2)
+        return reduce_avx2<T, op>;
+#endif
+    return reduce_portable<T, op>;
+}
+
+template <typename T>
+ReduceKernel reduce_kernel(Op op, bool avx2) {
+    switch (op) {
+    case Op::ADD: return reduce_kernel<T, Op::ADD>(avx2);
+    case Op::AND: return reduce_kernel<T, Op::AND>(avx2);
+    case Op::OR: return reduce_kernel<T, Op::OR>(avx2);
+    case Op::XOR: return reduce_kernel<T, Op::XOR>(avx2);
+    case Op::MIN: return reduce_kernel<T, Op::MIN>(avx2);
+    case Op::MINU: return reduce_kernel<T, Op::MINU>(avx2);
+    case Op::MAX: return reduce_kernel<T, Op::MAX>(avx2);
+    case Op::MAXU: return reduce_kernel<T, Op::MAXU>(avx2);
+    default: return nullptr;
+    }
+}
+
+ReduceKernel reduce_kernel(Op op, uint32_t sew, bool avx2) {
+    switch (sew) {
+    case 8: return reduce_kernel<uint8_t>(op, avx2);
+    case 16: return reduce_kernel<uint16_t>(op, avx2);
+    default: return reduce_kernel<uint32_t>(op, avx2);
+    }
+}
+
+template <typename T>
+MergeKernel merge_kernel(bool avx2) {
+#ifdef HAS_AVX2
+    if (avx2)
+        return merge_avx2<T>;
+#endif
+    return merge_portable<T>;
+}
+
+}
+
+Vpu::Vpu() {
+#ifdef HAS_AVX2
+    avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+uint32_t Vpu::configure(uint32_t vtype, uint32_t avl) {
+    uint32_t vsew = (vtype >> 3) & 0x7;
+    uint32_t vlmul = vtype & 0x7;
+
+    type = vtype;
+    // reserved bits, SEW above ELEN, reserved LMUL, fractional LMUL too small for SEW
+    if ((vtype >> 8) || vsew > 2 || vlmul == 4 || (8u << vsew) * 8 > lmul_eighths() * ELEN) {
+        type = VILL;
+        length = 0;
+        return 0;
+    }
+
+    uint32_t vlmax = VLEN * lmul_eighths() / 8 / sew();
+    length = std::min(avl, vlmax);
+    return length;
+}
+
+void Vpu::arith_vv(Op op, unsigned vd, unsigned vs2, unsigned vs1, bool masked) {
+    uint8_t* d = group(vd, masked);
+    const uint8_t* a = group(vs2, false);
+    const uint8_t* b = group(vs1, false);
+    arith_kernel<false>(op, sew(), avx2)(d, a, b, 0, masked ? registers.data() : nullptr, length);
+}
+
+void Vpu::arith_vx(Op op, unsigned vd, unsigned vs2, uint32_t scalar, bool masked) {
+    uint8_t* d = group(vd, masked);
+    const uint8_t* a = group(vs2, false);
+    arith_kernel<true>(op, sew(), avx2)(d, a, nullptr, scalar, masked ? registers.data() : nullptr, length);
+}
+
+void Vpu::compare_vv(Compare compare, unsigned vd, unsigned vs2, unsigned vs1, bool masked) {
+    group(vd, 8, false);
+    const uint8_t* a = group(vs2, false);
+    const uint8_t* b = group(vs1, false);
+    alignas(32) uint8_t bits[VLENB];
+    compare_kernel<false>(compare, sew(), avx2)(bits, a, b, 0, length);
+    write_mask(vd, bits, masked);
+}
+
+void Vpu::compare_vx(Compare compare, unsigned vd, unsigned vs2, uint32_t scalar, bool masked) {
+    group(vd, 8, false);
+    const uint8_t* a = group(vs2, false);
+    alignas(32) uint8_t bits[VLENB];
+    compare_kernel<true>(compare, sew(), avx2)(bits, a, nullptr, scalar, length);
+    write_mask(vd, bits, masked);
+}
+
+void Vpu::reduce(Op op, unsigned vd, unsigned vs2, unsigned vs1, bool masked) {
+    uint8_t* d = group(vd, 8, false);
+    const uint8_t* a = group(vs2, false);
+    const uint8_t* b = group(vs1, 8, false);
+    ReduceKernel kernel = reduce_kernel(op, sew(), avx2);
+    if (!kernel)
+        illegal("not a reduction");
+    if (length)
+        kernel(d, a, b, masked ? registers.data() : nullptr, length);
+}
+
+void Vpu::move_vv(unsigned vd, unsigned vs1) {
+    uint8_t* d = group(vd, false);
+    const uint8_t* s = group(vs1, false);
+    if (d != s)
+        std::memcpy(d, s, length * sew() / 8);
+}
+
+void Vpu::move_vx(unsigned vd, uint32_t scalar) {
+    uint8_t* d = group(vd, false);
+    switch (sew()) {
+    case 8: std::fill_n(d, length, uint8_t(scalar)); break;
+    case 16: for (uint32_t i = 0; i < length; ++i) put<uint16_t>(d, i, uint16_t(scalar)); break;
+    default: for (uint32_t i = 0; i < length; ++i) put<uint32_t>(d, i, scalar); break;
+    }
+}
+
+uint32_t Vpu::move_to_scalar(unsigned vs2) const {
+    if (type & VILL)
+        illegal("vill is set");
+    const uint8_t* s = registers.data() + vs2 * VLENB;
+    switch (sew()) {
+    case 8: return uint32_t(int8_t(s[0]));
+    case 16: return uint32_t(int16_t(get<uint16_t>(s, 0)));
+    default: return get<uint32_t>(s, 0);
+    }
+}
+
+void Vpu::move_from_scalar(unsigned vd, uint32_t scalar) {
+    uint8_t* d = group(vd, 8, false);
+    if (!length)
+        return;
+    std::memcpy(d, &scalar, sew() / 8);
+}
+
+uint32_t Vpu::lmul_eighths() const {
+    uint32_t vlmul = type & 0x7;
+    return vlmul < 4 ? 8u << vlmul : 8u >> (8 - vlmul);
+}
+
+uint8_t* Vpu::group(unsigned v, uint32_t emul_eighths, bool masked) {
+    if (type & VILL)
+        illegal("vill is set");
+    if (emul_eighths == 0 || emul_eighths > 64)
+        illegal("EMUL out of range");
+    if (v % std::max(emul_eighths / 8, 1u))
+        illegal("misaligned register group");
+    if (masked && v == 0)
+        illegal("destination overlaps the mask");
+    return registers.data() + v * VLENB;
+}
+
+void Vpu::merge(uint8_t* dst, const uint8_t* src, uint32_t eew) {
+    MergeKernel kernel = eew == 1 ? merge_kernel<uint8_t>(avx2) : eew == 2 ? merge_kernel<uint16_t>(avx2)
+                                                                           : merge_kernel<uint32_t>(avx2);
+    kernel(dst, src, registers.data(), length);
+}
+
+void Vpu::write_mask(unsigned vd, const uint8_t* bits, bool masked) {
+    uint8_t* d = registers.data() + vd * VLENB;
+    for (uint32_t i = 0; i * 8 < length; ++i) {
+        uint32_t keep = masked ? registers[i] : 0xff;
+        if (length - i * 8 < 8)
+            keep &= (1u << (length - i * 8)) - 1;
+        d[i] = uint8_t((d[i] & ~keep) | (bits[i] & keep));
+    }
+}
+
+void Vpu::illegal(const char* what) {
+    throw std::invalid_argument(std::string("Illegal vector instruction: ") + what);
+}
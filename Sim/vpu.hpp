@@ -0,0 +1,182 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAS_AVX2
+#endif
+
+// Vector unit of a subset of RVV 1.0: Zve32x with VLEN = 256, integer elements of 8, 16 and 32 bits.
+//
+// Register groups are contiguous in a cache-aligned register file, so a group of LMUL registers
+// is one array of vl elements. Each instruction runs as one kernel over its groups: AVX2 kernels
+// if the host has it, portable loops otherwise. Tails and masked-off elements are left undisturbed,
+// which both policies of vtype allow.
+class Vpu final {
+
+public:
+
+    static constexpr uint32_t VLEN = 256;
+    static constexpr uint32_t VLENB = VLEN / 8;
+    static constexpr uint32_t ELEN = 32;
+
+    static constexpr uint32_t REGISTERS_NUM = 32;
+
+    // CSR numbers
+    static constexpr uint32_t CSR_VSTART = 0x008;
+    static constexpr uint32_t CSR_VL = 0xc20;
+    static constexpr uint32_t CSR_VTYPE = 0xc21;
+    static constexpr uint32_t CSR_VLENB = 0xc22;
+
+    static constexpr uint32_t VILL = 1u << 31;
+
+    // AVL of vsetvli with rs1 = x0 and rd != x0
+    static constexpr uint32_t AVL_MAX = ~0u;
+
+    // element-wise operations, the bitwise ones and min/max are also reductions
+    enum class Op : uint8_t { ADD, SUB, RSUB, AND, OR, XOR, MUL, MIN, MINU, MAX, MAXU };
+
+    enum class Compare : uint8_t { EQ, NE, LT, LTU, LE, LEU, GT, GTU };
+
+public:
+
+    Vpu();
+
+public:
+
+    // vsetvli, vsetivli and vsetvl, returns the new vl
+    uint32_t configure(uint32_t vtype, uint32_t avl);
+
+    uint32_t vl() const { return length; }
+    uint32_t vtype() const { return type; }
+
+    // vd = vs2 op vs1, vd = vs2 op scalar
+    void arith_vv(Op op, unsigned vd, unsigned vs2, unsigned vs1, bool masked);
+    void arith_vx(Op op, unsigned vd, unsigned vs2, uint32_t scalar, bool masked);
+
+    // mask vd = vs2 compare vs1, mask vd = vs2 compare scalar
+    void compare_vv(Compare compare, unsigned vd, unsigned vs2, unsigned vs1, bool masked);
+    void compare_vx(Compare compare, unsigned vd, unsigned vs2, uint32_t scalar, bool masked);
+
+    // vd[0] = vs1[0] op all active elements of vs2
+    void reduce(Op op, unsigned vd, unsigned vs2, unsigned vs1, bool masked);
+
+    // vmv.v.v, vmv.v.x and vmv.v.i
+    void move_vv(unsigned vd, unsigned vs1);
+    void move_vx(unsigned vd, uint32_t scalar);
+
+    // vmv.x.s, element 0 sign-extended, and vmv.s.x
+    uint32_t move_to_scalar(unsigned vs2) const;
+    void move_from_scalar(unsigned vd, uint32_t scalar);
+
+    // Unit-stride accesses when stride is eew. Unmasked unit-stride ones are one transfer
+    // of the whole group through the memory backend, the others go element by element.
+    // The memory hook of the instrumentation gets every transfer, see Sim::run.
+    template <typename Memory, typename Instrumentation>
+    void load(Memory& mem, Instrumentation& instrumentation, unsigned vd, uint32_t addr, uint32_t stride, uint32_t eew, bool masked);
+    template <typename Memory, typename Instrumentation>
+    void store(Memory& mem, Instrumentation& instrumentation, unsigned vs3, uint32_t addr, uint32_t stride, uint32_t eew, bool masked);
+
+private:
+
+    // LMUL in eighths, so that fractional ones are integers
+    uint32_t lmul_eighths() const;
+    uint32_t sew() const { return 1u << (((type >> 3) & 0x7) + 3); }
+
+    // EMUL in eighths of accesses with elements of eew bytes
+    uint32_t emul_eighths(uint32_t eew) const { return lmul_eighths() * eew * 8 / sew(); }
+
+    // group of emul_eighths registers starting at v, throws if the instruction is illegal
+    uint8_t* group(unsigned v, uint32_t emul_eighths, bool masked);
+    uint8_t* group(unsigned v, bool masked) { return group(v, lmul_eighths(), masked); }
+
+    bool active(uint32_t i) const { return registers[i / 8] >> (i % 8) & 1; }
+
+    // copies the active ones of vl elements of eew bytes from src into the group
+    void merge(uint8_t* dst, const uint8_t* src, uint32_t eew);
+
+    // writes the active ones of vl bits into mask register vd
+    void write_mask(unsigned vd, const uint8_t* bits, bool masked);
+
+    [[noreturn]] static void illegal(const char* what);
+
+private:
+
+    alignas(64) std::array<uint8_t, REGISTERS_NUM * VLENB> registers = {};
+
+    uint32_t length = 0;
+    uint32_t type = VILL;
+
+    bool avx2 = false;
+};
+
+template <typename Memory, typename Instrumentation>
+void Vpu::load(Memory& mem, Instrumentation& instrumentation, unsigned vd, uint32_t addr, uint32_t stride, uint32_t eew, bool masked) {
+    uint8_t* dst = group(vd, emul_eighths(eew), masked);
+    uint32_t n = length;
+    if (!n)
+        return;
+
+    if (stride == eew) {
+        instrumentation.memory(addr, n * eew, false);
+        if (!masked) {
+            mem.read(addr, dst, n * eew);
+            return;
+        }
+        alignas(64) std::array<uint8_t, 8 * VLENB> buffer;
+        mem.read(addr, buffer.data(), n * eew);
+        merge(dst, buffer.data(), eew);
+        return;
+    }
+
+    auto gather = [&](auto element) {
+        using T = decltype(element);
+        for (uint32_t i = 0; i < n; ++i) {
+            if (masked && !active(i))
+                continue;
+            instrumentation.memory(addr + i * stride, sizeof(T), false);
+            T value = mem.template load<T>(addr + i * stride);
+            std::memcpy(dst + i * sizeof(T), &value, sizeof(T));
+        }
+    };
+    switch (eew) {
+    case 1: gather(uint8_t{}); break;
+    case 2: gather(uint16_t{}); break;
+    default: gather(uint32_t{}); break;
+    }
+}
+
+template <typename Memory, typename Instrumentation>
+void Vpu::store(Memory& mem, Instrumentation& instrumentation, unsigned vs3, uint32_t addr, uint32_t stride, uint32_t eew, bool masked) {
+    const uint8_t* src = group(vs3, emul_eighths(eew), false);
+    uint32_t n = length;
+    if (!n)
+        return;
+
+    if (stride == eew && !masked) {
+        instrumentation.memory(addr, n * eew, true);
+        mem.write(addr, src, n * eew);
+        return;
+    }
+
+    auto scatter = [&](auto element) {
+        using T = decltype(element);
+        for (uint32_t i = 0; i < n; ++i) {
+            if (masked && !active(i))
+                continue;
+            T value;
+            std::memcpy(&value, src + i * sizeof(T), sizeof(T));
+            instrumentation.memory(addr + i * stride, sizeof(T), true);
+            mem.template store<T>(addr + i * stride, value);
+        }
+    };
+    switch (eew) {
+    case 1: scatter(uint8_t{}); break;
+    case 2: scatter(uint16_t{}); break;
+    default: scatter(uint32_t{}); break;
+    }
+}
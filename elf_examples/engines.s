@@ -0,0 +1,109 @@
+# Differential test of the execution engines, see tests/engines.cpp.
+# Hot loops over the paths translated code handles apart from the interpreter:
+# signed division overflow and division by zero, stores to code, sub-word and
+# page crossing accesses, and enough distinct blocks to fill a small JIT buffer.
+# Every iteration leaves its results in memory, which the test compares.
+# llvm-mc -triple=riscv32 -mattr=+m,+c -filetype=obj engines.s -o engines.o
+# ld.lld -m elf32lriscv engines.o -o engines.elf -e _start
+
+    .globl _start
+    .text
+_start:
+    la s0, results
+    li s1, 0                    # accumulator
+    li s2, 300                  # iterations
+
+loop:
+    # division corner cases: overflow and zero divisors
+    li t0, 0x80000000
+    li t1, -1
+    div t2, t0, t1
+    rem t3, t0, t1
+    sw t2, 8(s0)
+    sw t3, 12(s0)
+    add s1, s1, t2
+    xor s1, s1, t3
+    div t2, s2, zero
+    rem t3, s2, zero
+    sw t2, 16(s0)
+    sw t3, 20(s0)
+    add s1, s1, t2
+    add s1, s1, t3
+    divu t2, s2, zero
+    remu t3, s1, zero
+    sw t2, 24(s0)
+    sw t3, 28(s0)
+    xor s1, s1, t2
+    add s1, s1, t3
+    li t4, 7
+    div t2, s1, t4
+    rem t3, s1, t4
+    mulh t5, s1, t2
+    mulhu t6, s1, t3
+    sw t2, 32(s0)
+    sw t3, 36(s0)
+    sw t5, 40(s0)
+    sw t6, 44(s0)
+    add s1, s1, t5
+    xor s1, s1, t6
+
+    # patch the immediate of patched and call it, the store leaves translated code
+    andi t0, s2, 0x7ff
+    slli t0, t0, 20
+    li t1, 0x00000513           # addi a0, zero, 0
+    or t1, t1, t0
+    la t2, patched
+    sw t1, 0(t2)
+    j 1f
+1:  fence.i
+    call patched
+    add s1, s1, a0
+
+    # sub-word stores and loads, and a word store crossing into the next page
+    sb s1, 0(s0)
+    sh s1, 2(s0)
+    lb t0, 0(s0)
+    lhu t1, 2(s0)
+    add s1, s1, t0
+    xor s1, s1, t1
+    la t2, crossing
+    sw s1, -2(t2)
+    lw t3, -2(t2)
+    add s1, s1, t3
+
+    # distinct small blocks, each ended by a taken branch
+    .rept 48
+    addi s1, s1, 13
+    slli t0, s1, 3
+    xor s1, s1, t0
+    bnez s1, 2f
+    addi s1, s1, 1
+2:
+    .endr
+
+    sw s1, 4(s0)
+    addi s0, s0, 48
+    addi s2, s2, -1
+    bnez s2, loop
+
+    mv a0, zero
+    li a7, 93
+    ecall
+
+    .section .rwx, "awx"
+    .balign 4096
+    .option push
+    .option norvc
+patched:
+    addi a0, zero, 0
+    ret
+    .option pop
+
+    .data
+    .balign 4096
+    .space 4096 - 2
+    .balign 4096
+crossing:
+    .space 16
+results:
+    .space 48 * 300
@@ -1,7 +1,12 @@
 #include <chrono>
+#include <cstring>
 #include <fstream>
+#include <numeric>
+#include <vector>
 
 #include "Sim/Sim.hpp"
+#include "Sim/machine.hpp"
+#include "Sim/farm.hpp"
 
 #define MY_DEBUG
 
@@ -10,53 +15,195 @@
 
 int main(int argc, char **argv) {
 
+    // Sim [options] <elf> [guest args...]
+    //   exits with the exit code of the guest in a0 of hart 0, 124 when a hart timed out
+    //   --aot <out.so>           translate the ELF ahead of time and exit
+    //   --with-aot <lib.so>      run with the translated blocks
+    //   --predecode[=threads]    decode the executable segments at load time
+    //   --jit-threshold=<n>      translate blocks to native code after n executions, 0 for never
+    //   --harts=<n>              run n harts sharing the guest memory, each on its own thread
+    //   --quantum=<n>            interleave the harts deterministically, n instructions at a time
+    //   --batch[=threads]        the last argument is a manifest of jobs to run instead of an ELF
+    //   --console=line|full      flush guest stdout at every newline or only when the buffer fills,
+    //                            by default line on a terminal and full otherwise
+    //   --stack-top=<addr>       the guest stack grows down from addr instead of the top of the guest space
+    //   --hart-stack=<size>      stack of every hart, hart n starts with sp at the stack top - n * size
+    //   --timeout=<ms>           stop the harts, or every batch job, after ms milliseconds
+    //   --count                  count blocks, instructions, loads, stores and branches, one hart only
+    //   --trace=<file>           write every block, load, store and branch to file, one hart only
+    std::vector<std::string> args(argv + 1, argv + argc);
+
 #ifdef MY_DEBUG
-    std::string elf_filename = std::string("../elf_examples/a.out");
-#else
-    if (argc != 2) {
-        std::cout << "Must be 1 arg - name of elf file" << std::endl;
+    if (args.empty())
+        args.push_back("../elf_examples/a.out");
+#endif
+
+    SimOptions options;
+    unsigned harts_num = 1;
+    size_t quantum = 0;
+    bool batch = false;
+    unsigned batch_threads = 0;
+    std::string aot_output;
+    std::string aot_library;
+    std::chrono::milliseconds timeout{};
+    bool count = false;
+    std::string trace_filename;
+
+    size_t arg = 0;
+    for (; arg < args.size(); ++arg) {
+        if (args[arg] == "--aot" && arg + 2 < args.size())
+            aot_output = args[++arg];
+        else if (args[arg] == "--with-aot" && arg + 2 < args.size())
+            aot_library = args[++arg];
+        else if (args[arg] == "--predecode")
+            options.predecode = true;
+        else if (args[arg].rfind("--predecode=", 0) == 0) {
+            options.predecode = true;
+            options.predecode_threads = std::stoul(args[arg].substr(std::strlen("--predecode=")));
+        }
+        else if (args[arg].rfind("--harts=", 0) == 0)
+            harts_num = std::stoul(args[arg].substr(std::strlen("--harts=")));
+        else if (args[arg] == "--batch")
+            batch = true;
+        else if (args[arg].rfind("--batch=", 0) == 0) {
+            batch = true;
+            batch_threads = std::stoul(args[arg].substr(std::strlen("--batch=")));
+        }
+        else if (args[arg] == "--console=line")
+            options.console_buffering = ConsoleBuffering::Line;
+        else if (args[arg] == "--console=full")
+            options.console_buffering = ConsoleBuffering::Full;
+        else if (args[arg].rfind("--quantum=", 0) == 0)
+            quantum = std::stoul(args[arg].substr(std::strlen("--quantum=")));
+        else if (args[arg] == "--count")
+            count = true;
+        else if (args[arg].rfind("--trace=", 0) == 0)
+            trace_filename = args[arg].substr(std::strlen("--trace="));
+        else if (args[arg].rfind("--timeout=", 0) == 0)
+            timeout = std::chrono::milliseconds(std::stoull(args[arg].substr(std::strlen("--timeout="))));
+        else if (args[arg].rfind("--stack-top=", 0) == 0)
+            options.stack_top = std::stoull(args[arg].substr(std::strlen("--stack-top=")), nullptr, 0);
+        else if (args[arg].rfind("--jit-threshold=", 0) == 0)
+            options.jit_threshold = std::stoul(args[arg].substr(std::strlen("--jit-threshold=")));
+        else if (args[arg].rfind("--hart-stack=", 0) == 0)
+            options.hart_stack_size = std::stoul(args[arg].substr(std::strlen("--hart-stack=")), nullptr, 0);
+        else
+            break;
+    }
+
+    // the ELF ends the options, the rest is the command line of the guest
+    if (arg == args.size() || (batch && arg + 1 != args.size())) {
+        std::cout << "Usage: Sim [--aot <out.so> | --with-aot <lib.so>] [--predecode[=threads]] [--jit-threshold=<n>] [--harts=<n>] [--quantum=<n>]\n"
+                  << "           [--console=line|full] [--stack-top=<addr>] [--hart-stack=<size>] [--timeout=<ms>] [--count | --trace=<file>]\n"
+                  << "           <elf file> [args...]\n"
+                  << "       Sim --batch[=threads] [--predecode=threads] [--timeout=<ms>] <manifest>" << std::endl;
         return -1;
     }
 
-    std::string elf_filename = std::string(argv[1]);
-#endif
+    std::string elf_filename = args[arg];
+    options.args.assign(args.begin() + arg + 1, args.end());
+
+    if (!aot_output.empty()) {
+        try {
+            size_t blocks_num = aot_compile(elf_filename, aot_output);
+            std::cout << "Translated blocks: " << blocks_num << std::endl;
+        }
+        catch (std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            exit(-1);
+        }
+        return 0;
+    }
 
-#ifdef TRACE
-    std::string out_file_name("../dump.txt");
-    std::ofstream trace_out_file(out_file_name);
-    if (!trace_out_file.is_open()) {
-        std::cerr << "Can't open file" << std::endl;
+    if (batch) {
+        std::ifstream manifest(elf_filename);
+        if (!manifest.is_open()) {
+            std::cerr << "Can't open " << elf_filename << std::endl;
+            exit(-1);
+        }
+
+        try {
+            // thousands of small jobs, each of them only pays for the pages it touches
+            options.memory_backend = MemoryBackend::Paged;
+            std::vector<FarmJob> jobs = read_manifest(manifest);
+            size_t halted_num = Farm(options, batch_threads, timeout).run(jobs, std::cout);
+            std::cout << "Halted jobs: " << halted_num << " of " << jobs.size() << std::endl;
+            return halted_num == jobs.size() ? 0 : 1;
+        }
+        catch (std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            exit(-1);
+        }
+    }
+
+    bool instrumented = count || !trace_filename.empty();
+    if (instrumented && (harts_num > 1 || quantum || timeout.count())) {
+        std::cerr << "--count and --trace run one hart without limits" << std::endl;
         exit(-1);
     }
-#else
-    std::ostream& trace_out_file = std::cout;
-#endif
 
-    Sim sim(elf_filename);
+    std::ofstream trace_file;
+    if (!trace_filename.empty()) {
+        trace_file.open(trace_filename);
+        if (!trace_file.is_open()) {
+            std::cerr << "Can't open " << trace_filename << std::endl;
+            exit(-1);
+        }
+    }
 
     try {
-        
+        Machine machine(elf_filename, harts_num, options);
+
+        if (!aot_library.empty())
+            machine.load_aot(aot_library);
+
+
         auto start = std::chrono::steady_clock::now();
-        size_t instr_count = sim.run(trace_out_file);
+        RunLimits limits;
+        if (timeout.count())
+            limits.deadline = start + timeout;
+
+        // the instrumentation is picked here, every policy has an engine of its own
+        CountingInstrumentation counters;
+        std::vector<size_t> instr_counts;
+        if (count)
+            instr_counts = { machine.hart(0).run(counters) };
+        else if (trace_file.is_open()) {
+            TracingInstrumentation tracer(trace_file);
+            instr_counts = { machine.hart(0).run(tracer) };
+        }
+        else
+            instr_counts = quantum ? machine.run_deterministic(quantum, limits) : machine.run(limits);
         auto finish = std::chrono::steady_clock::now();
 
         double seconds = static_cast<double>((finish - start).count()) / 1000000000;
+        size_t instr_count = std::accumulate(instr_counts.begin(), instr_counts.end(), size_t(0));
 
-        sim.dump_registers(trace_out_file);
+        for (size_t i = 0; i < machine.harts_num(); ++i) {
+            if (!machine.hart(i).halted())
+                std::cout << "Hart " << i << " timed out\n";
+            if (machine.harts_num() > 1)
+                std::cout << "Hart " << i << ", instruction num: " << instr_counts[i] << '\n';
+            machine.hart(i).dump_registers(std::cout);
+        }
 
-#ifdef TRACE
-        trace_out_file.close();
-#endif
+        if (count)
+            counters.dump(std::cout);
 
-        std::cout << "Instruction num: "<< instr_count << std::endl;
+        std::cout << "Instruction num: "<< instr_count << '\n';
 
-        std::cout << "Time: " << seconds << std::endl;
+        std::cout << "Time: " << seconds << '\n';
         std::cout << "Mips: " << static_cast<double>(instr_count) / (seconds * 1000000) << std::endl;
+
+        // the exit status of the guest, as timeout(1) does for a hart stopped at the timeout
+        for (size_t i = 0; i < machine.harts_num(); ++i) {
+            if (!machine.hart(i).halted())
+                return 124;
+        }
+        return static_cast<int>(machine.hart(0).exit_code());
     }
     catch (std::exception& e) {
         std::cerr << e.what() <<std::endl;
         exit(-1);
     }
-
-    return 0;
 }
\ No newline at end of file
@@ -0,0 +1,22 @@
+# Runs tests/engines.cpp of the threaded and the switch build on ELF, each checks its own
+# engines, then their digests must match. With AOT the ELF is translated by SIM first.
+#   cmake -DTHREADED=<exe> -DSWITCH=<exe> -DELF=<elf> [-DSIM=<exe> -DAOT=<out.so>] -P engines.cmake
+
+if (AOT)
+    execute_process(COMMAND ${SIM} --aot ${AOT} ${ELF} RESULT_VARIABLE RESULT OUTPUT_QUIET ERROR_VARIABLE ERRORS)
+    if (NOT RESULT EQUAL 0)
+        message(FATAL_ERROR "Translation of ${ELF} failed:\n${ERRORS}")
+    endif()
+endif()
+
+foreach(BUILD THREADED SWITCH)
+    execute_process(COMMAND ${${BUILD}} ${ELF} ${AOT}
+                    RESULT_VARIABLE RESULT OUTPUT_VARIABLE DIGEST_${BUILD} ERROR_VARIABLE ERRORS)
+    if (NOT RESULT EQUAL 0)
+        message(FATAL_ERROR "${BUILD} build on ${ELF}:\n${ERRORS}")
+    endif()
+endforeach()
+
+if (NOT DIGEST_THREADED STREQUAL DIGEST_SWITCH)
+    message(FATAL_ERROR "Digests of ${ELF} differ: threaded ${DIGEST_THREADED} switch ${DIGEST_SWITCH}")
+endif()
@@ -0,0 +1,147 @@
+#include <cstdio>
+#include <exception>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <elfio.hpp>
+
+#include "Sim/Sim.hpp"
+
+// Differential run of the execution engines: the guest runs in every configuration of this
+// build and must end with the same registers, output and memory in all of them. Prints the
+// digest of the run, tests/engines.cmake compares it with the build of the switch engine.
+//   engines <elf> [AOT library of the elf]
+// The JIT translates blocks on their first execution, once with a buffer so small it starts
+// over all the time.
+
+namespace {
+
+struct Config {
+    std::string name;
+    SimOptions options;
+    bool with_aot = false;
+};
+
+// FNV-1a
+struct Digest {
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    void add(const void* data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= static_cast<const uint8_t*>(data)[i];
+            hash *= 0x100000001b3ull;
+        }
+    }
+};
+
+uint64_t run(const Config& config, const std::string& elf_filename, const std::string& aot_library) {
+
+    std::string output;
+    SimOptions options = config.options;
+    options.console_sink = [&output](int fd, const char* data, size_t size) {
+        output += static_cast<char>('0' + fd);
+        output.append(data, size);
+    };
+
+    Sim sim(elf_filename, options);
+    if (config.with_aot)
+        sim.load_aot(aot_library);
+    sim.run();
+    if (!sim.halted())
+        throw std::runtime_error("the guest didn't halt");
+
+    std::ostringstream registers;
+    sim.dump_registers(registers);
+
+    Digest digest;
+    digest.add(registers.str().data(), registers.str().size());
+    digest.add(output.data(), output.size());
+
+    // the loaded segments and the top of the stack
+    ELFIO::elfio reader;
+    reader.load(elf_filename);
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    for (const auto& segment : reader.segments) {
+        if (segment->get_type() == ELFIO::PT_LOAD)
+            ranges.emplace_back(segment->get_virtual_address(), segment->get_memory_size());
+    }
+    ranges.emplace_back(options.stack_top - 0x10000, 0x10000);
+
+    std::vector<uint8_t> bytes;
+    for (auto [addr, size] : ranges) {
+        bytes.resize(size);
+        sim.read_memory(static_cast<uint32_t>(addr), bytes.data(), size);
+        digest.add(bytes.data(), size);
+    }
+
+    return digest.hash;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+
+    if (argc != 2 && argc != 3) {
+        std::fprintf(stderr, "Usage: engines <elf> [AOT library of the elf]\n");
+        return 2;
+    }
+    std::string elf_filename = argv[1];
+    std::string aot_library = argc == 3 ? argv[2] : "";
+
+    std::vector<Config> configs;
+
+    Config interpreter{"interpreter"};
+    interpreter.options.jit_threshold = 0;
+    configs.push_back(interpreter);
+
+    Config paged{"paged"};
+    paged.options.jit_threshold = 0;
+    paged.options.memory_backend = MemoryBackend::Paged;
+    configs.push_back(paged);
+
+    Config predecoded{"predecoded"};
+    predecoded.options.predecode = true;
+    configs.push_back(predecoded);
+
+#ifdef HAS_JIT
+    Config jit{"jit"};
+    jit.options.jit_threshold = 1;
+    configs.push_back(jit);
+
+    Config jit_resets{"jit-resets"};
+    jit_resets.options.jit_threshold = 1;
+    jit_resets.options.jit_code_size = 4096;
+    configs.push_back(jit_resets);
+#endif
+
+    if (!aot_library.empty()) {
+        Config aot{"aot"};
+        aot.options.jit_threshold = 0;
+        aot.with_aot = true;
+        configs.push_back(aot);
+    }
+
+    uint64_t expected = 0;
+    bool failed = false;
+    for (const auto& config : configs) {
+        try {
+            uint64_t digest = run(config, elf_filename, aot_library);
+            if (&config == &configs.front())
+                expected = digest;
+            if (digest != expected) {
+                std::fprintf(stderr, "%s: digest %016llx differs from %016llx of %s\n", config.name.c_str(),
+                             static_cast<unsigned long long>(digest), static_cast<unsigned long long>(expected),
+                             configs.front().name.c_str());
+                failed = true;
+            }
+        }
+        catch (std::exception& e) {
+            std::fprintf(stderr, "%s: %s\n", config.name.c_str(), e.what());
+            failed = true;
+        }
+    }
+
+    std::printf("%016llx\n", static_cast<unsigned long long>(expected));
+    return failed ? 1 : 0;
+}